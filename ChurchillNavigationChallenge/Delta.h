@@ -0,0 +1,422 @@
+//
+//  Delta.h
+//  ChurchillNavigationChallenge
+//
+//  Created by Eric Campbell on 2/21/15.
+//  Copyright (c) 2015 ECC. All rights reserved.
+//
+//
+//
+//  Log-structured updates over the static KdTree. Inserts, deletes and rank changes are appended to a small active
+//  log in O(1). Every query searches the main tree and the logs and merges them, skipping points that have been
+//  deleted (tombstones) as it goes. A full log is frozen and a fresh one takes new writes straight away, so writers
+//  never wait for a compaction. Compaction builds a new main tree with the frozen logs folded in, off the write path
+//  on a background thread.
+//
+//  Readers never take the index lock, but they are not lock-free. The main tree and the list of frozen logs are
+//  published together as an immutable view through std::atomic_load / atomic_store on a shared_ptr, which libstdc++
+//  implements with a small pool of mutexes hashed by address (atomic_is_lock_free is false), and every load bumps
+//  the view's shared reference count. Those critical sections are a few instructions long, so readers contend on a
+//  cache line rather than on writers or compactions. The active log only ever grows: a writer fills the next entry,
+//  then publishes the new length with a release store, so every entry a reader can see is final. Readers hold the
+//  view they searched, so an old tree is freed by whichever reader finishes with it last.
+//
+//  A rank change is a delete plus an insert of a copy with the new rank, so the trees never see a point's rank
+//  change underneath them. A point made by an update is owned by the log it was inserted into, and a compaction
+//  hands the ones that survive it to the new main tree. One that has been removed is freed once a compaction has
+//  folded the removal in and the last view still holding the old log or tree is released, so there is no index
+//  wide list of them to grow.
+
+#ifndef ChurchillNavigationChallenge_Delta_h
+#define ChurchillNavigationChallenge_Delta_h
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "Shared.h"
+#include "Util.h"
+#include "KdTree.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const int DELTA_MAX_UPDATES = 1024;         // Entries per log. A full log is frozen and handed to the compactor
+const int DELTA_COMPACT_INTERVAL_MS = 100;  // How often the background thread folds in a log that isn't full
+const int DELTA_SIMD_WIDTH = 4;             // Log entries per 128 bit compare
+
+// A logged update
+struct DeltaEntry {
+    float x;
+    float y;
+    Point* p;
+    bool deleted;  // A tombstone for p rather than an insert of it
+    std::shared_ptr<Point> copy;  // For inserts, the index's copy p points at
+
+    DeltaEntry() : x(0), y(0), p(0), deleted(false) {}
+    DeltaEntry(Point* p) : x(p->x), y(p->y), p(p), deleted(true) {}
+    DeltaEntry(const std::shared_ptr<Point>& copy) : x(copy->x), y(copy->y), p(copy.get()), deleted(false), copy(copy) {}
+};
+
+// One generation of updates, oldest first, with the coordinates in their own arrays so a query scans them without
+// touching the points. The arrays are allocated up front and never move, and only the first `published` entries
+// are visible to readers
+struct DeltaLog {
+    std::vector<float> xs;
+    std::vector<float> ys;
+    std::vector<Point*> points;
+    std::vector<uint8_t> deleted;  // Entry is a tombstone for its point rather than an insert of it
+    std::vector<std::shared_ptr<Point> > copies;  // The inserted point for inserts, which the log owns; empty for tombstones
+    std::atomic<size_t> published;
+
+    DeltaLog() : xs(DELTA_MAX_UPDATES), ys(DELTA_MAX_UPDATES), points(DELTA_MAX_UPDATES), deleted(DELTA_MAX_UPDATES),
+                 copies(DELTA_MAX_UPDATES), published(0) {}
+};
+
+// An immutable main tree and the points it was built from
+struct DeltaMain {
+    KdTree* kdt;
+    std::vector<Point*> points;
+    std::vector<std::shared_ptr<Point> > owned;  // The points made by updates, the rest belong to the caller
+
+    DeltaMain() : kdt(0) {}
+    ~DeltaMain() {
+        if (kdt != 0)
+            kdtree_delete(kdt);
+    }
+};
+
+// What a reader searches: the main tree, the logs frozen since it was built (oldest first) and the active log.
+// Replaced, never changed, whenever a log is frozen or a compaction finishes
+struct DeltaView {
+    std::shared_ptr<const DeltaMain> main;
+    std::vector<std::shared_ptr<const DeltaLog> > frozen;
+    std::shared_ptr<const DeltaLog> active;
+};
+
+struct DeltaIndex {
+    std::shared_ptr<const DeltaView> view;      // Read with std::atomic_load, replaced under the lock
+    std::mutex lock;                            // Serializes writers and compactions; readers never take it
+    std::condition_variable changed;            // Signalled when a log freezes, a compaction finishes and on shutdown
+    std::shared_ptr<DeltaLog> active;           // The writers' handle on view->active
+    bool compacting;
+    bool stopping;
+    std::thread compactor;
+
+    int compactions;
+    std::chrono::steady_clock::duration compact_time;  // Spent folding logs in, summed over compactions
+};
+
+// Build a main tree over points, with bounds tight around them. owned holds the ones the index made
+static std::shared_ptr<const DeltaMain> delta_build_main(std::vector<Point*>& points, std::vector<std::shared_ptr<Point> >& owned) {
+    DeltaMain* main = new DeltaMain();
+    main->points = points;
+    main->owned.swap(owned);
+
+    Rect bounds(0, 0, 0, 0);
+    if (points.size() > 0)
+        bounds = Rect(points[0]->x, points[0]->x, points[0]->y, points[0]->y);
+    for (size_t i = 0; i < points.size(); i++) {
+        bounds.lx = std::min(bounds.lx, points[i]->x);
+        bounds.hx = std::max(bounds.hx, points[i]->x);
+        bounds.ly = std::min(bounds.ly, points[i]->y);
+        bounds.hy = std::max(bounds.hy, points[i]->y);
+    }
+
+    main->kdt = kdtree_construct(bounds, 0);
+    kdtree_insert(main->kdt, points);
+    return std::shared_ptr<const DeltaMain>(main);
+}
+
+// Publish a view with this main tree and frozen logs and the current active log. Called with the lock held
+static inline void delta_publish(DeltaIndex* index, const std::shared_ptr<const DeltaMain>& main,
+                                 const std::vector<std::shared_ptr<const DeltaLog> >& frozen) {
+    DeltaView* view = new DeltaView();
+    view->main = main;
+    view->frozen = frozen;
+    view->active = index->active;
+    std::atomic_store(&index->view, std::shared_ptr<const DeltaView>(view));
+}
+
+// Freeze the active log if it holds anything and start a fresh one. Called with the lock held
+static inline bool delta_freeze(DeltaIndex* index) {
+    if (index->active->published.load(std::memory_order_relaxed) == 0)
+        return false;
+
+    std::shared_ptr<const DeltaView> view = index->view;
+    std::vector<std::shared_ptr<const DeltaLog> > frozen(view->frozen);
+    frozen.push_back(index->active);
+    index->active = std::make_shared<DeltaLog>();
+    delta_publish(index, view->main, frozen);
+    return true;
+}
+
+// Fold every log, the active one included, into a new main tree. Returns false if there was nothing to fold in
+static bool delta_compact(DeltaIndex* index) {
+    std::shared_ptr<const DeltaView> view;
+    {
+        std::unique_lock<std::mutex> guard(index->lock);
+        index->changed.wait(guard, [index]() { return !index->compacting; });
+        delta_freeze(index);
+        view = index->view;
+        if (view->frozen.empty())
+            return false;
+        index->compacting = true;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // Writers carry on into the active log while the frozen ones are folded in
+    const std::vector<std::shared_ptr<const DeltaLog> >& logs = view->frozen;
+    std::unordered_set<Point*> deleted;
+    size_t inserted = 0;
+    for (size_t l = 0; l < logs.size(); l++) {
+        size_t n = logs[l]->published.load(std::memory_order_acquire);
+        for (size_t i = 0; i < n; i++) {
+            if (logs[l]->deleted[i])
+                deleted.insert(logs[l]->points[i]);
+            else
+                inserted++;
+        }
+    }
+
+    // The survivors, with the ones the index made taken over from the old main tree and the logs. The removed
+    // ones are freed when the last view holding the old tree or logs goes
+    std::vector<Point*> points;
+    std::vector<std::shared_ptr<Point> > owned;
+    points.reserve(view->main->points.size() + inserted);
+    for (size_t i = 0; i < view->main->points.size(); i++) {
+        if (deleted.count(view->main->points[i]) == 0)
+            points.push_back(view->main->points[i]);
+    }
+    for (size_t i = 0; i < view->main->owned.size(); i++) {
+        if (deleted.count(view->main->owned[i].get()) == 0)
+            owned.push_back(view->main->owned[i]);
+    }
+    for (size_t l = 0; l < logs.size(); l++) {
+        size_t n = logs[l]->published.load(std::memory_order_acquire);
+        for (size_t i = 0; i < n; i++) {
+            if (!logs[l]->deleted[i] && deleted.count(logs[l]->points[i]) == 0) {
+                points.push_back(logs[l]->points[i]);
+                owned.push_back(logs[l]->copies[i]);
+            }
+        }
+    }
+    std::shared_ptr<const DeltaMain> next = delta_build_main(points, owned);
+
+    {
+        // Logs frozen while this one ran stay behind for the next compaction
+        std::lock_guard<std::mutex> guard(index->lock);
+        std::shared_ptr<const DeltaView> current = index->view;
+        std::vector<std::shared_ptr<const DeltaLog> > remaining(current->frozen.begin() + logs.size(), current->frozen.end());
+        delta_publish(index, next, remaining);
+        index->compacting = false;
+        index->compactions++;
+        index->compact_time += std::chrono::steady_clock::now() - start;
+    }
+    index->changed.notify_all();
+    return true;
+}
+
+// Background compaction: fold in the logs as soon as one freezes, or every DELTA_COMPACT_INTERVAL_MS if the active
+// log holds anything
+static void delta_compactor(DeltaIndex* index) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(index->lock);
+            index->changed.wait_for(guard, std::chrono::milliseconds(DELTA_COMPACT_INTERVAL_MS), [index]() {
+                return index->stopping || (!index->compacting && !index->view->frozen.empty());
+            });
+            if (index->stopping)
+                return;
+        }
+        delta_compact(index);
+    }
+}
+
+// Build an updatable index over points. With background set, a thread compacts on its own; without it the owner
+// calls delta_compact and frozen logs pile up until it does
+static DeltaIndex* delta_index_create(const std::vector<Point*>& points, bool background) {
+    DeltaIndex* index = new DeltaIndex();
+    index->compacting = false;
+    index->stopping = false;
+    index->compactions = 0;
+    index->compact_time = std::chrono::steady_clock::duration(0);
+    index->active = std::make_shared<DeltaLog>();
+
+    std::vector<Point*> pts(points);
+    std::vector<std::shared_ptr<Point> > owned;
+    delta_publish(index, delta_build_main(pts, owned), std::vector<std::shared_ptr<const DeltaLog> >());
+
+    if (background)
+        index->compactor = std::thread(delta_compactor, index);
+    return index;
+}
+
+// Stop the compactor and free the trees, logs and the points the index made. No reader may still be searching
+static void delta_index_delete(DeltaIndex* index) {
+    {
+        std::lock_guard<std::mutex> guard(index->lock);
+        index->stopping = true;
+    }
+    index->changed.notify_all();
+    if (index->compactor.joinable())
+        index->compactor.join();
+
+    delete index;
+}
+
+// Append entries to the active log and publish them together, freezing the log first if they don't fit. Called
+// with the lock held; never waits
+static inline void delta_append(DeltaIndex* index, const DeltaEntry* entries, size_t count) {
+    size_t n = index->active->published.load(std::memory_order_relaxed);
+    if (n + count > DELTA_MAX_UPDATES) {
+        delta_freeze(index);
+        index->changed.notify_all();
+        n = 0;
+    }
+    DeltaLog& log = *index->active;
+    for (size_t i = 0; i < count; i++) {
+        log.xs[n + i] = entries[i].x;
+        log.ys[n + i] = entries[i].y;
+        log.points[n + i] = entries[i].p;
+        log.deleted[n + i] = entries[i].deleted;
+        log.copies[n + i] = entries[i].copy;
+    }
+    index->active->published.store(n + count, std::memory_order_release);
+}
+
+// Add a point. Returns the index's copy, which stays valid until it is removed (or replaced by delta_update_rank)
+// and a compaction has folded that in, or for as long as the caller holds a snapshot that still has it
+static Point* delta_insert(DeltaIndex* index, const Point& p) {
+    DeltaEntry entry(std::make_shared<Point>(p));
+    std::lock_guard<std::mutex> guard(index->lock);
+    delta_append(index, &entry, 1);
+    return entry.p;
+}
+
+// Remove a live point, either one the index was built over or one returned by delta_insert / delta_update_rank
+static void delta_remove(DeltaIndex* index, Point* p) {
+    DeltaEntry entry(p);
+    std::lock_guard<std::mutex> guard(index->lock);
+    delta_append(index, &entry, 1);
+}
+
+// Change a live point's rank. Returns the point that replaces it, valid as for delta_insert. Readers see both
+// halves or neither
+static Point* delta_update_rank(DeltaIndex* index, Point* p, int rank) {
+    std::shared_ptr<Point> copy = std::make_shared<Point>(*p);
+    copy->rank = rank;
+    DeltaEntry entries[2] = { DeltaEntry(p), DeltaEntry(copy) };
+    std::lock_guard<std::mutex> guard(index->lock);
+    delta_append(index, entries, 2);
+    return copy.get();
+}
+
+// Bitmask of the 4 entries at xs/ys that query contains
+static inline unsigned delta_match4(const float* xs, const float* ys, const Rect& query) {
+#ifdef __SSE2__
+    __m128 x = _mm_loadu_ps(xs), y = _mm_loadu_ps(ys);
+    __m128 in = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(x, _mm_set1_ps(query.lx)), _mm_cmple_ps(x, _mm_set1_ps(query.hx))),
+                           _mm_and_ps(_mm_cmpge_ps(y, _mm_set1_ps(query.ly)), _mm_cmple_ps(y, _mm_set1_ps(query.hy))));
+    return (unsigned)_mm_movemask_ps(in);
+#else
+    unsigned mask = 0;
+    for (int j = 0; j < DELTA_SIMD_WIDTH; j++) {
+        if (xs[j] >= query.lx && xs[j] <= query.hx && ys[j] >= query.ly && ys[j] <= query.hy)
+            mask |= 1u << j;
+    }
+    return mask;
+#endif
+}
+
+// Append the log's entry i to tombstones or inserts
+static inline void delta_collect(const DeltaLog& log, size_t i, std::vector<const Point*>& tombstones, std::vector<Point*>& inserts) {
+    if (log.deleted[i])
+        tombstones.push_back(log.points[i]);
+    else
+        inserts.push_back(log.points[i]);
+}
+
+// Append the published entries of log inside query, tombstones and inserts separately. Whole groups of
+// DELTA_SIMD_WIDTH are matched at once; the tail is matched one by one so nothing past `published` is read
+static inline void delta_scan_log(const DeltaLog& log, const Rect& query, std::vector<const Point*>& tombstones, std::vector<Point*>& inserts) {
+    size_t n = log.published.load(std::memory_order_acquire), i = 0;
+    for (; i + DELTA_SIMD_WIDTH <= n; i += DELTA_SIMD_WIDTH) {
+        for (unsigned mask = delta_match4(&log.xs[i], &log.ys[i], query); mask != 0; mask &= mask - 1) {
+            delta_collect(log, i + __builtin_ctz(mask), tombstones, inserts);
+        }
+    }
+    for (; i < n; i++) {
+        if (log.xs[i] >= query.lx && log.xs[i] <= query.hx && log.ys[i] >= query.ly && log.ys[i] <= query.hy)
+            delta_collect(log, i, tombstones, inserts);
+    }
+}
+
+// The index as it stands. Holding it keeps every point it contains alive, removed or not
+static inline std::shared_ptr<const DeltaView> delta_snapshot(DeltaIndex* index) {
+    return std::atomic_load(&index->view);
+}
+
+// Search the main tree and the logs for the K lowest ranked live points inside query, without taking the index lock.
+// A result the index made can be freed by a compaction once it is removed; a caller that keeps results while other
+// threads write passes snapshot, gets the view searched back in it and holds it as long as it uses them
+template <int K = SEARCH_MAX_RESULTS>
+static inline void delta_search(DeltaIndex* index, const Rect& query, ResultQueue& results, int& ct,
+                                std::shared_ptr<const DeltaView>* snapshot = 0) {
+    std::shared_ptr<const DeltaView> view = delta_snapshot(index);
+    if (snapshot != 0)
+        *snapshot = view;
+
+    // Only the updates inside the query matter, and there are few of them
+    std::vector<const Point*> tombstones;
+    std::vector<Point*> inserts;
+    for (size_t l = 0; l < view->frozen.size(); l++) {
+        delta_scan_log(*view->frozen[l], query, tombstones, inserts);
+    }
+    delta_scan_log(*view->active, query, tombstones, inserts);
+    std::sort(tombstones.begin(), tombstones.end());
+
+    for (size_t i = 0; i < inserts.size(); i++) {
+        if (!kd_is_excluded(tombstones, inserts[i]) && results_offer<K>(results, inserts[i]))
+            ct++;
+    }
+    kdtree_search_excluding<K>(view->main->kdt, query, tombstones, results, ct);
+}
+
+// Every live point, in no particular order
+static void delta_live_points(DeltaIndex* index, std::vector<Point*>& out) {
+    std::shared_ptr<const DeltaView> view = delta_snapshot(index);
+    std::vector<const DeltaLog*> logs;
+    for (size_t l = 0; l < view->frozen.size(); l++) logs.push_back(view->frozen[l].get());
+    logs.push_back(view->active.get());
+
+    std::unordered_set<Point*> deleted;
+    for (size_t l = 0; l < logs.size(); l++) {
+        size_t n = logs[l]->published.load(std::memory_order_acquire);
+        for (size_t i = 0; i < n; i++) {
+            if (logs[l]->deleted[i])
+                deleted.insert(logs[l]->points[i]);
+        }
+    }
+
+    out.clear();
+    for (size_t i = 0; i < view->main->points.size(); i++) {
+        if (deleted.count(view->main->points[i]) == 0)
+            out.push_back(view->main->points[i]);
+    }
+    for (size_t l = 0; l < logs.size(); l++) {
+        size_t n = logs[l]->published.load(std::memory_order_acquire);
+        for (size_t i = 0; i < n; i++) {
+            if (!logs[l]->deleted[i] && deleted.count(logs[l]->points[i]) == 0)
+                out.push_back(logs[l]->points[i]);
+        }
+    }
+}
+
+#endif
@@ -9,11 +9,20 @@
 #ifndef ChurchillNavigationChallenge_Gen_h
 #define ChurchillNavigationChallenge_Gen_h
 
+#include <stdint.h>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+#include <vector>
 #include "Shared.h"
+#include "Perf.h"
 
 const int NUM_PTS = 50000;
 const int MAX_PT_RANGE = 1024;
 
+const int NUM_BATCH_QUERIES = 10000; // Number of queries in the batch throughput benchmark
+const int SEARCH_BATCH_SIZE = 64;    // Number of Morton sorted queries traversed together per batch
+
 //const int NUM_PTS = 100000;
 //const int MAX_PT_RANGE = std::numeric_limits<int>::max();
 
@@ -22,11 +31,17 @@ struct QueryResult {
     int ct_bf;
     int ct_qt;
     int ct_kd;
+    int ct_qtr;
     float bf;
     float qt;
     float kd;
+    float qtr;
+    PerfSample bf_perf;   // Hardware counters per engine, see Perf.h
+    PerfSample qt_perf;
+    PerfSample kd_perf;
+    PerfSample qtr_perf;
     
-    QueryResult() : i(0), ct_bf(0), ct_qt(0), bf(0), qt(0), kd(0), ct_kd(0) {}
+    QueryResult() : i(0), ct_bf(0), ct_qt(0), bf(0), qt(0), kd(0), ct_kd(0), ct_qtr(0), qtr(0) {}
 };
 
 static inline int rand_num() {
@@ -46,7 +61,7 @@ void generate_points(int ct, std::vector<Point*>& points)
     
     for (int i = 0; i < ct; i++) {
         Point* p = new Point();
-        p->id = rand() % 10000;
+        p->id = rand() % ID_DOMAIN;
         p->rank = i;
         
         while (p->x == 0) {
@@ -68,4 +83,205 @@ void generate_queries(int ct, std::vector<Rect>& queries) {
     }
 }
 
+// Deterministic, parallel generator. Every point and query is a pure function of (seed, index) through a counter
+// based hash, so the output is identical whatever the thread count and any slice can be generated on its own
+// (a shard only needs its own index range)
+
+enum GenDistribution {
+    GEN_UNIFORM,     // Uniform over the whole range
+    GEN_CLUSTERED,   // Gaussian blobs of varying size around a handful of centers
+    GEN_ROADS,       // Points strung along line segments with a little sideways jitter
+    GEN_ZIPF,        // Uniform within grid cells, cells picked with Zipf skewed popularity
+    GEN_DUPLICATES,  // A small set of locations, each repeated many times
+    GEN_NUM_DISTRIBUTIONS
+};
+
+const int GEN_CLUSTERS = 16;       // Centers in GEN_CLUSTERED
+const int GEN_ROADS_COUNT = 32;    // Segments in GEN_ROADS
+const int GEN_ZIPF_GRID = 64;      // GEN_ZIPF cells per side
+const float GEN_ZIPF_EXPONENT = 1.1f;
+const int GEN_DUPLICATE_SITES = 1024;
+
+// Points generated straight into one contiguous block in rank order, with the Point* view the indexes take
+struct PointStore {
+    std::vector<Point> data;
+    std::vector<Point*> ptrs;
+};
+
+// splitmix64 finalizer over (seed, counter), the counter based RNG behind the generator
+static inline uint64_t gen_hash(uint64_t seed, uint64_t counter) {
+    uint64_t z = seed + (counter + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Independent stream for one index: lane picks one of several hashes per index. Lanes 0-4 are per point, 5-7 per
+// query and 8-10 per distribution constant (cluster, road, duplicate site), so no two uses ever share a hash
+static inline uint64_t gen_stream(uint64_t seed, uint64_t index, int lane) {
+    return gen_hash(seed ^ ((uint64_t)lane << 56), index);
+}
+
+// Uniform float in [0, 1) from the top 24 bits
+static inline float gen_unit(uint64_t h) {
+    return (h >> 40) * (1.0f / 16777216.0f);
+}
+
+// Uniform integer in [0, n) without modulo bias (multiply-shift)
+static inline uint32_t gen_below(uint64_t h, uint32_t n) {
+    return (uint32_t)(((h >> 32) * (uint64_t)n) >> 32);
+}
+
+// Standard normal from two hashes (Box-Muller)
+static inline float gen_normal(uint64_t h1, uint64_t h2) {
+    float u1 = std::max(gen_unit(h1), 1.0f / 16777216.0f);
+    return sqrtf(-2.0f * logf(u1)) * cosf(6.2831853f * gen_unit(h2));
+}
+
+// Pull a coordinate back inside [0, MAX_PT_RANGE)
+static inline float gen_clamp(float v) {
+    return std::min(std::max(v, 0.0f), std::nextafter((float)MAX_PT_RANGE, 0.0f));
+}
+
+// Cumulative Zipf weights over the GEN_ZIPF cells, the cells themselves in a seed dependent order
+struct GenZipfTable {
+    std::vector<float> cdf;
+    std::vector<int> cells;
+};
+
+static void gen_zipf_table(uint64_t seed, GenZipfTable& table) {
+    const int n = GEN_ZIPF_GRID * GEN_ZIPF_GRID;
+    table.cdf.resize(n);
+    table.cells.resize(n);
+
+    double total = 0;
+    for (int i = 0; i < n; i++) {
+        total += 1.0 / pow(i + 1, GEN_ZIPF_EXPONENT);
+        table.cdf[i] = (float)total;
+        table.cells[i] = i;
+    }
+    for (int i = 0; i < n; i++) {
+        table.cdf[i] /= (float)total;
+    }
+
+    // Fisher-Yates with the counter RNG so popular cells are scattered
+    for (int i = n - 1; i > 0; i--) {
+        std::swap(table.cells[i], table.cells[gen_below(gen_hash(seed ^ 0x5A1FULL, i), i + 1)]);
+    }
+}
+
+// Generate point i of distribution dist
+static inline void gen_point(GenDistribution dist, uint64_t seed, uint64_t i, const GenZipfTable& zipf, Point& p) {
+    const float range = (float)MAX_PT_RANGE;
+    uint64_t h0 = gen_stream(seed, i, 0), h1 = gen_stream(seed, i, 1), h2 = gen_stream(seed, i, 2), h3 = gen_stream(seed, i, 3);
+
+    p.rank = (int)i;
+    p.id = (short)gen_below(gen_stream(seed, i, 4), ID_DOMAIN);
+
+    switch (dist) {
+        case GEN_CLUSTERED: {
+            uint32_t c = gen_below(h0, GEN_CLUSTERS);
+            float cx = gen_unit(gen_stream(seed, c * 3, 8)) * range;
+            float cy = gen_unit(gen_stream(seed, c * 3 + 1, 8)) * range;
+            float sigma = range * (0.005f + 0.04f * gen_unit(gen_stream(seed, c * 3 + 2, 8)));
+            p.x = gen_clamp(cx + sigma * gen_normal(h1, h2));
+            p.y = gen_clamp(cy + sigma * gen_normal(h3, h2 ^ h1));
+            break;
+        }
+        case GEN_ROADS: {
+            uint32_t r = gen_below(h0, GEN_ROADS_COUNT);
+            float x1 = gen_unit(gen_stream(seed, r * 4, 9)) * range, y1 = gen_unit(gen_stream(seed, r * 4 + 1, 9)) * range;
+            float x2 = gen_unit(gen_stream(seed, r * 4 + 2, 9)) * range, y2 = gen_unit(gen_stream(seed, r * 4 + 3, 9)) * range;
+            float t = gen_unit(h1);
+            float jitter = 0.5f * gen_normal(h2, h3);
+            float len = std::max(1e-6f, sqrtf((x2 - x1) * (x2 - x1) + (y2 - y1) * (y2 - y1)));
+            p.x = gen_clamp(x1 + t * (x2 - x1) - jitter * (y2 - y1) / len);
+            p.y = gen_clamp(y1 + t * (y2 - y1) + jitter * (x2 - x1) / len);
+            break;
+        }
+        case GEN_ZIPF: {
+            int slot = (int)(std::upper_bound(zipf.cdf.begin(), zipf.cdf.end(), gen_unit(h0)) - zipf.cdf.begin());
+            int cell = zipf.cells[std::min(slot, (int)zipf.cells.size() - 1)];
+            const float size = range / GEN_ZIPF_GRID;
+            p.x = gen_clamp((cell % GEN_ZIPF_GRID + gen_unit(h1)) * size);
+            p.y = gen_clamp((cell / GEN_ZIPF_GRID + gen_unit(h2)) * size);
+            break;
+        }
+        case GEN_DUPLICATES: {
+            uint32_t site = gen_below(h0, GEN_DUPLICATE_SITES);
+            p.x = gen_unit(gen_stream(seed, site * 2, 10)) * range;
+            p.y = gen_unit(gen_stream(seed, site * 2 + 1, 10)) * range;
+            break;
+        }
+        default:
+            p.x = gen_unit(h1) * range;
+            p.y = gen_unit(h2) * range;
+            break;
+    }
+}
+
+// Fill store with ct points of distribution dist, using num_threads threads (<= 0 for one per hardware thread).
+// The result only depends on (ct, dist, seed)
+static void gen_points(PointStore& store, int ct, GenDistribution dist, uint64_t seed, int num_threads = 0) {
+    store.data.resize(ct);
+    store.ptrs.resize(ct);
+
+    GenZipfTable zipf;
+    if (dist == GEN_ZIPF)
+        gen_zipf_table(seed, zipf);
+
+    if (num_threads <= 0)
+        num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    num_threads = std::max(1, std::min(num_threads, ct / 4096));
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        int begin = (int)((int64_t)ct * t / num_threads), end = (int)((int64_t)ct * (t + 1) / num_threads);
+        auto fill = [&store, &zipf, dist, seed, begin, end]() {
+            for (int i = begin; i < end; i++) {
+                gen_point(dist, seed, i, zipf, store.data[i]);
+                store.ptrs[i] = &store.data[i];
+            }
+        };
+        if (t == num_threads - 1)
+            fill();
+        else
+            threads.push_back(std::thread(fill));
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+}
+
+// Append ct queries each covering `selectivity` of the range's area (so roughly that fraction of uniform points),
+// with aspect ratios between 1:4 and 4:1, placed uniformly and kept inside the range
+static void gen_queries(std::vector<Rect>& queries, int ct, float selectivity, uint64_t seed) {
+    const float range = (float)MAX_PT_RANGE;
+    const float area = std::min(std::max(selectivity, 0.0f), 1.0f) * range * range;
+    const uint64_t base = queries.size();
+
+    for (int i = 0; i < ct; i++) {
+        uint64_t q = base + i;
+        float aspect = powf(4.0f, 2.0f * gen_unit(gen_stream(seed, q, 5)) - 1.0f);
+        float w = std::min(range, sqrtf(area * aspect));
+        float h = std::min(range, area / std::max(w, 1e-6f));
+        float lx = gen_unit(gen_stream(seed, q, 6)) * (range - w);
+        float ly = gen_unit(gen_stream(seed, q, 7)) * (range - h);
+        queries.push_back(Rect(lx, lx + w, ly, ly + h));
+    }
+}
+
+// Mixed workload: mostly point lookups and neighbourhood queries with a tail of large scans
+static void gen_query_mix(std::vector<Rect>& queries, int ct, uint64_t seed) {
+    const float selectivity[] = { 0.00001f, 0.001f, 0.01f, 0.1f };
+    const float share[] = { 0.4f, 0.3f, 0.2f, 0.1f };
+
+    int made = 0;
+    for (int m = 0; m < 4; m++) {
+        int n = m == 3 ? ct - made : (int)(ct * share[m]);
+        gen_queries(queries, n, selectivity[m], seed + m);
+        made += n;
+    }
+}
+
 #endif
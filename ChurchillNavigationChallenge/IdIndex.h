@@ -0,0 +1,133 @@
+//
+//  IdIndex.h
+//  ChurchillNavigationChallenge
+//
+//  Created by Eric Campbell on 2/17/15.
+//  Copyright (c) 2015 ECC. All rights reserved.
+//
+//
+//
+//  Id-partitioned layout for filtered searches. The points are grouped by id, each id's points (its posting) in rank
+//  order with their coordinates inline. A filter that accepts few points is answered straight from the postings it
+//  names: each posting is scanned in rank order and abandoned at the first point that can't make the top K, so the
+//  work follows the number of matching points rather than the size of the query. Filters that accept many points
+//  are left to the trees' summary pushdown (quadtree_search_filtered / kdtree_search_filtered), which this index
+//  reports by returning false.
+
+#ifndef ChurchillNavigationChallenge_IdIndex_h
+#define ChurchillNavigationChallenge_IdIndex_h
+
+#include <algorithm>
+#include <vector>
+#include "Shared.h"
+#include "Util.h"
+
+const size_t ID_INDEX_MAX_SCAN = 3072;  // Most posting entries a filter may name before the tree pushdown takes over.
+                                        // Postings beat the QuadTree pushdown below about 3000 at 50k points
+
+struct IdIndex {
+    std::vector<short> ids;        // Distinct ids, ascending
+    std::vector<uint32_t> begin;   // Posting of ids[i] is [begin[i], begin[i + 1]); one extra entry at the end
+    std::vector<float> xs;         // Entries in (id, rank) order
+    std::vector<float> ys;
+    std::vector<int> ranks;
+    std::vector<Point*> pts;
+};
+
+static inline bool id_index_compare(const Point* p1, const Point* p2) {
+    return p1->id != p2->id ? p1->id < p2->id : p1->rank < p2->rank;
+}
+
+// Group points by id, each group in rank order
+static IdIndex* id_index_build(const std::vector<Point*>& points) {
+    IdIndex* index = new IdIndex();
+    std::vector<Point*> sorted(points);
+    std::sort(sorted.begin(), sorted.end(), id_index_compare);
+
+    index->xs.resize(sorted.size());
+    index->ys.resize(sorted.size());
+    index->ranks.resize(sorted.size());
+    index->pts = sorted;
+    for (size_t i = 0; i < sorted.size(); i++) {
+        if (i == 0 || sorted[i]->id != sorted[i - 1]->id) {
+            index->ids.push_back(sorted[i]->id);
+            index->begin.push_back((uint32_t)i);
+        }
+        index->xs[i] = sorted[i]->x;
+        index->ys[i] = sorted[i]->y;
+        index->ranks[i] = sorted[i]->rank;
+    }
+    index->begin.push_back((uint32_t)sorted.size());
+    return index;
+}
+
+static void id_index_delete(IdIndex* index) {
+    delete index;
+}
+
+static inline size_t id_index_size(const IdIndex* index) {
+    return index->ids.size() * sizeof(short) + index->begin.size() * sizeof(uint32_t) +
+           index->pts.size() * (2 * sizeof(float) + sizeof(int) + sizeof(Point*));
+}
+
+// Range [lo, hi) of ids[] the filter can accept
+static inline void id_index_span(const IdIndex* index, const IdFilter& filter, size_t& lo, size_t& hi) {
+    lo = std::lower_bound(index->ids.begin(), index->ids.end(), filter.min_id) - index->ids.begin();
+    hi = std::upper_bound(index->ids.begin(), index->ids.end(), filter.max_id) - index->ids.begin();
+    hi = std::max(lo, hi);
+}
+
+// Number of points the filter accepts, wherever they are
+static inline size_t id_index_count(const IdIndex* index, const IdFilter& filter) {
+    size_t lo, hi;
+    id_index_span(index, filter, lo, hi);
+    if (filter.ids.size() == 0)
+        return index->begin[hi] - index->begin[lo];
+
+    size_t count = 0;
+    for (size_t i = 0; i < filter.ids.size(); i++) {
+        std::vector<short>::const_iterator it = std::lower_bound(index->ids.begin() + lo, index->ids.begin() + hi, filter.ids[i]);
+        if (it != index->ids.begin() + hi && *it == filter.ids[i])
+            count += index->begin[it - index->ids.begin() + 1] - index->begin[it - index->ids.begin()];
+    }
+    return count;
+}
+
+// Offer the points of posting i inside query, in rank order, until one can't make the top K
+template <int K>
+static inline void id_index_scan(const IdIndex* index, size_t i, const Rect& query, ResultQueue& results, int& ct) {
+    for (uint32_t e = index->begin[i]; e < index->begin[i + 1]; e++) {
+        if (results.size() >= K && index->ranks[e] > results.top()->rank)
+            break;
+        if (index->xs[e] >= query.lx && index->xs[e] <= query.hx && index->ys[e] >= query.ly && index->ys[e] <= query.hy &&
+            results_offer<K>(results, index->pts[e]))
+            ct++;
+    }
+}
+
+// Search the postings for the K lowest ranked points inside query whose id passes filter. Returns false, leaving
+// results alone, if the filter names more than max_scan points; run the tree pushdown for those
+template <int K = SEARCH_MAX_RESULTS>
+static inline bool id_index_search(const IdIndex* index, const Rect& query, const IdFilter& filter, ResultQueue& results, int& ct,
+                                   size_t max_scan = ID_INDEX_MAX_SCAN) {
+    if (id_index_count(index, filter) > max_scan)
+        return false;
+
+    size_t lo, hi;
+    id_index_span(index, filter, lo, hi);
+    if (filter.ids.size() == 0) {
+        for (size_t i = lo; i < hi; i++) {
+            id_index_scan<K>(index, i, query, results, ct);
+        }
+        return true;
+    }
+
+    for (size_t f = 0; f < filter.ids.size(); f++) {
+        std::vector<short>::const_iterator it = std::lower_bound(index->ids.begin() + lo, index->ids.begin() + hi, filter.ids[f]);
+        if (it != index->ids.begin() + hi && *it == filter.ids[f])
+            id_index_scan<K>(index, it - index->ids.begin(), query, results, ct);
+    }
+    return true;
+}
+
+#endif
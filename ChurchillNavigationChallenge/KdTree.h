@@ -10,6 +10,7 @@
 #define ChurchillNavigationChallenge_KdTree_h
 
 #include "Shared.h"
+#include "Util.h"
 #include <algorithm>
 #include <vector>
 
@@ -19,17 +20,19 @@ struct KdTree {
     
     Rect bounds;
     int depth;
-    std::vector<Point*> points;
+    PointList points;
     KdTree* left;
     KdTree* right;
+    IdSummary ids;  // Ids anywhere in this node's subtree
+    int count;      // Number of points in this node's subtree
     
-    KdTree() : depth(0), left(0), right(0) { }
+    KdTree() : depth(0), left(0), right(0), count(0) { }
     
 };
 
 // Create a new KdTree node and initialize with bounds and dpeth
 static KdTree* kdtree_construct(Rect bounds, int depth) {
-    KdTree* tree = new KdTree();
+    KdTree* tree = index_new<KdTree>();
     tree->depth = depth;
     tree->bounds = bounds;
     return tree;
@@ -45,31 +48,84 @@ static void kdtree_delete(KdTree* tree) {
         kdtree_delete(tree->right);
     }
     
-    delete tree;
+    index_delete(tree);
     tree = 0;
 }
 
+// Deep copy a kdtree, allocating from the current index arena when one is set (see Memory.h).
+// Node points are remapped through point_map so the copy can reference replicated point data
+static KdTree* kdtree_clone(KdTree* src, const PointMap& point_map) {
+    KdTree* tree = kdtree_construct(src->bounds, src->depth);
+    tree->ids = src->ids;
+    tree->count = src->count;
+    
+    tree->points.reserve(src->points.size());
+    for (PointList::iterator it = src->points.begin() ; it != src->points.end(); ++it) {
+        tree->points.push_back(point_map.find(*it)->second);
+    }
+    
+    if (src->left != 0)
+        tree->left = kdtree_clone(src->left, point_map);
+    
+    if (src->right != 0)
+        tree->right = kdtree_clone(src->right, point_map);
+    
+    return tree;
+}
+
+// Bytes used by the nodes and their point lists, not counting the points themselves
+static size_t kdtree_size(const KdTree* tree) {
+    size_t size = sizeof(KdTree) + tree->points.capacity() * sizeof(Point*);
+    if (tree->left != 0)
+        size += kdtree_size(tree->left);
+    if (tree->right != 0)
+        size += kdtree_size(tree->right);
+    return size;
+}
+
 // Method for comparing points by their rank
 static inline bool kd_compare_pts_rank(const Point* p1, const Point* p2) {
     return p1->rank < p2->rank;
 }
 
-// Method for comparing points by their X value
-static inline bool kd_compare_pts_x(const Point* p1, const Point* p2) {
-    return p1->x < p2->x;
+// Method for comparing points by their X (Axis 0) or Y (Axis 1) value
+template <int Axis>
+static inline bool kd_compare_pts(const Point* p1, const Point* p2) {
+    return pt_coord<Axis>(*p1) < pt_coord<Axis>(*p2);
 }
 
-// Method for comparing points by their Y value
-static inline bool kd_compare_pts_y(const Point* p1, const Point* p2) {
-    return p1->y < p2->y;
+// Fold a node's own points and its (already summarized) children into its id summary and count
+static inline void kdtree_summarize(KdTree* tree) {
+    tree->count = (int)tree->points.size();
+    for (PointList::iterator it = tree->points.begin() ; it != tree->points.end(); ++it) {
+        id_summary_add(tree->ids, (*it)->id);
+    }
+    
+    if (tree->left != 0) {
+        id_summary_merge(tree->ids, tree->left->ids);
+        tree->count += tree->left->count;
+    }
+    
+    if (tree->right != 0) {
+        id_summary_merge(tree->ids, tree->right->ids);
+        tree->count += tree->right->count;
+    }
 }
 
-// Insert a vector of points into the tree
-static void kdtree_insert(KdTree* tree, std::vector<Point*>& pts) {
-    
+// Insert a vector of points into a node that splits along Axis (0 = X, 1 = Y).
+// The axis alternates through the template parameter, so the comparator and bounds updates are resolved at compile time
+template <int Axis>
+static void kdtree_insert_axis(KdTree* tree, std::vector<Point*>& pts) {
+
+    // Nothing to insert (an empty point set would otherwise index past the end below)
+    if (pts.size() == 0) {
+        return;
+    }
+
     // If we're down to one point, insert it into this leaf node
     if (pts.size() == 1) {
         tree->points.push_back(pts[0]);
+        kdtree_summarize(tree);
         return;
     }
     
@@ -81,6 +137,7 @@ static void kdtree_insert(KdTree* tree, std::vector<Point*>& pts) {
         
         // Sort the points by rank so we can get the lowest ranks first when searching
         std::sort(tree->points.begin(), tree->points.end(), kd_compare_pts_rank);
+        kdtree_summarize(tree);
         
         // Stop subdividing
         return;
@@ -89,130 +146,490 @@ static void kdtree_insert(KdTree* tree, std::vector<Point*>& pts) {
     // Median index for splitting the points
     const size_t median_index = pts.size() / 2;
     
-    // Select comparison method based on the depth - (even=X, odd=Y)
-    // Since this is a 2D kdtree, we only have 2 axes
-    bool (*comparator)(const Point* p1, const Point* p2);
-    
-    if (tree->depth % 2 == 0)
-        comparator = &kd_compare_pts_x;
-    else
-        comparator = &kd_compare_pts_y;
-
     // Reorder the points vector such that all points with an index value LEFT of the median index
-    // have an X or Y value (depending on depth) less than the value at the median index.
+    // have an X or Y value (depending on Axis) less than the value at the median index.
     // Doesn't need to completely sort the vector, which makes it much faster for large data sets
-    std::nth_element(pts.begin(), pts.begin()+median_index, pts.end(), comparator);
+    std::nth_element(pts.begin(), pts.begin()+median_index, pts.end(), kd_compare_pts<Axis>);
 
     // Add the selected median point to this tree's points vector
     tree->points.push_back(pts[median_index]);
+    const float split = pt_coord<Axis>(*pts[median_index]);
     
     // Split the points into the left and right vectors for child noes
     std::vector<Point*> left_pts = std::vector<Point*>(pts.begin(), pts.begin() + median_index);
     std::vector<Point*> right_pts = std::vector<Point*>(pts.begin() + median_index + 1, pts.end());
 
-    // If there are still points on the left side then calculate the new bounds for the left child node and recursively
-    // add the left points down the tree
+    // If there are still points on the left side then the left child node ends at the median along Axis,
+    // recursively add the left points down the tree
     if (left_pts.size() > 0) {
-        Rect left_rect;
-        
-        if (tree->depth % 2 == 0) {
-            left_rect.lx = tree->bounds.lx;
-            left_rect.hx = pts[median_index]->x;
-            left_rect.ly = tree->bounds.ly;
-            left_rect.hy = tree->bounds.hy;
-        } else {
-            left_rect.lx = tree->bounds.lx;
-            left_rect.hx = tree->bounds.hx;
-            left_rect.ly = tree->bounds.ly;
-            left_rect.hy = pts[median_index]->y;
-        }
+        Rect left_rect(tree->bounds);
+        if (Axis == 0)
+            left_rect.hx = split;
+        else
+            left_rect.hy = split;
         
         tree->left = kdtree_construct(left_rect, tree->depth+1);
-        kdtree_insert(tree->left, left_pts);
+        kdtree_insert_axis<1 - Axis>(tree->left, left_pts);
     }
     
-    // If there are still points on the right side then calculate the new bounds for the right child node and recursively
-    // add the riht points down the tree
+    // If there are still points on the right side then the right child node starts at the median along Axis,
+    // recursively add the right points down the tree
     if (right_pts.size() > 0) {
-        Rect right_rect;
-        
-        if (tree->depth % 2 == 0) {
-            right_rect.lx = pts[median_index]->x;
-            right_rect.hx = tree->bounds.hx;
-            right_rect.ly = tree->bounds.ly;
-            right_rect.hy = tree->bounds.hy;
-        } else {
-            right_rect.lx = tree->bounds.lx;
-            right_rect.hx = tree->bounds.hx;
-            right_rect.ly = pts[median_index]->y;
-            right_rect.hy = tree->bounds.hy;
-        }
+        Rect right_rect(tree->bounds);
+        if (Axis == 0)
+            right_rect.lx = split;
+        else
+            right_rect.ly = split;
         
         tree->right = kdtree_construct(right_rect, tree->depth+1);
-        kdtree_insert(tree->right, right_pts);
+        kdtree_insert_axis<1 - Axis>(tree->right, right_pts);
     }
+    
+    kdtree_summarize(tree);
+}
+
+// Insert a vector of points into the tree, splitting on X at even depths and Y at odd depths
+static void kdtree_insert(KdTree* tree, std::vector<Point*>& pts) {
+    if (tree->depth % 2 == 0)
+        kdtree_insert_axis<0>(tree, pts);
+    else
+        kdtree_insert_axis<1>(tree, pts);
 }
 
 // Returns the entire subtree with no bounds checking - Used when this node's bounds are fully contained with the search rect
-static inline void kdtree_return_subtree(KdTree* tree, std::priority_queue<Point*, std::vector<Point*>>& results, int& ct) {
-    for (std::vector<Point*>::iterator it = tree->points.begin() ; it != tree->points.end(); ++it) {
-        if (results.size() < 20) {
-            results.push(*it);
-            ct++;
-        }
-        else if (results.top()->rank > (*it)->rank) {
-            results.pop();
-            results.push(*it);
-            ct++;
-        } else {
+template <int K = SEARCH_MAX_RESULTS>
+static inline void kdtree_return_subtree(KdTree* tree, ResultQueue& results, int& ct) {
+    for (PointList::iterator it = tree->points.begin() ; it != tree->points.end(); ++it) {
+        if (!results_offer<K>(results, *it))
             break;
-        }
+        ct++;
     }
 
     if (tree->left != 0) {
-        kdtree_return_subtree(tree->left, results, ct);
+        kdtree_return_subtree<K>(tree->left, results, ct);
     }
     
     if (tree->right != 0) {
-        kdtree_return_subtree(tree->right, results, ct);
+        kdtree_return_subtree<K>(tree->right, results, ct);
     }
 }
 
-// Depth-first recursive searching the tree with a 2D rectangular range query and return the results in the results container
-static inline void kdtree_search(KdTree* tree, const Rect& query, std::priority_queue<Point*, std::vector<Point*>> & results, int& ct) {
+// Depth-first recursive search of a node that splits along Axis and whose bounds are already known to intersect the query.
+// A child's bounds only differ from its parent's along the parent's split axis, so deciding whether to descend into a child
+// takes a single compile time resolved comparison instead of a full rect intersection test
+template <int K, int Axis>
+static void kdtree_search_axis(KdTree* tree, const Rect& query, ResultQueue& results, int& ct) {
     
     // If this node's bounds are fully contained within the search query bounds, then return the entire subtree
     if (rects_contained(query, tree->bounds)) {
-        kdtree_return_subtree(tree, results, ct);
-    }
-    // Else, if there's an intersection between this node's bounds and the search query bounds, keep searching
-    else if (rects_intersect(tree->bounds, query)) {
-        // Check all points in this leaf node for containment
-        for (std::vector<Point*>::iterator it = tree->points.begin() ; it != tree->points.end(); ++it) {
-            if (pt_contained(query, **it)) {
-                // For this challenge, we only want the 20 points with the lowest rank value
-                if (results.size() < 20) {
-                    results.push(*it);
-                    ct++;
-                }
-                else if (results.top()->rank > (*it)->rank) {
-                    results.pop();
-                    results.push(*it);
-                    ct++;
-                } else {
+        kdtree_return_subtree<K>(tree, results, ct);
+        return;
+    }
+    
+    // Check all points in this leaf node for containment
+    for (PointList::iterator it = tree->points.begin() ; it != tree->points.end(); ++it) {
+        if (pt_contained(query, **it)) {
+            // For this challenge, we only want the K points with the lowest rank value
+            if (!results_offer<K>(results, *it))
+                break;
+            ct++;
+        }
+    }
+    
+    // Recursively search the left node if the query reaches below the split
+    if (tree->left != 0 && rect_lo<Axis>(query) <= rect_hi<Axis>(tree->left->bounds))
+        kdtree_search_axis<K, 1 - Axis>(tree->left, query, results, ct);
+    
+    // Recursively search the right node if the query reaches above the split
+    if (tree->right != 0 && rect_hi<Axis>(query) >= rect_lo<Axis>(tree->right->bounds))
+        kdtree_search_axis<K, 1 - Axis>(tree->right, query, results, ct);
+}
+
+// Depth-first recursive searching the tree with a 2D rectangular range query and return the K lowest ranked results in the results container
+template <int K = SEARCH_MAX_RESULTS>
+static inline void kdtree_search(KdTree* tree, const Rect& query, ResultQueue& results, int& ct) {
+    if (!rects_intersect(tree->bounds, query))
+        return;
+    
+    if (tree->depth % 2 == 0)
+        kdtree_search_axis<K, 0>(tree, query, results, ct);
+    else
+        kdtree_search_axis<K, 1>(tree, query, results, ct);
+}
+
+// kdtree_search_axis restricted to points whose id passes filter, skipping subtrees whose id summary can't match it.
+// The early leaf exit only applies to points the filter accepts; rejected ids say nothing about the ranks after them
+template <int K, int Axis>
+static void kdtree_search_filtered_axis(KdTree* tree, const Rect& query, const IdFilter& filter, ResultQueue& results, int& ct, bool contained) {
+    
+    if (!id_filter_may_match(filter, tree->ids)) {
+        return;
+    }
+    
+    if (!contained && rects_contained(query, tree->bounds)) {
+        contained = true;
+    }
+    
+    for (PointList::iterator it = tree->points.begin() ; it != tree->points.end(); ++it) {
+        if ((contained || pt_contained(query, **it)) && id_filter_matches(filter, (*it)->id)) {
+            if (!results_offer<K>(results, *it))
+                break;
+            ct++;
+        }
+    }
+    
+    if (tree->left != 0 && (contained || rect_lo<Axis>(query) <= rect_hi<Axis>(tree->left->bounds)))
+        kdtree_search_filtered_axis<K, 1 - Axis>(tree->left, query, filter, results, ct, contained);
+    
+    if (tree->right != 0 && (contained || rect_hi<Axis>(query) >= rect_lo<Axis>(tree->right->bounds)))
+        kdtree_search_filtered_axis<K, 1 - Axis>(tree->right, query, filter, results, ct, contained);
+}
+
+// Search the kdtree for the K lowest ranked points inside query whose id passes filter
+template <int K = SEARCH_MAX_RESULTS>
+static inline void kdtree_search_filtered(KdTree* tree, const Rect& query, const IdFilter& filter, ResultQueue& results, int& ct) {
+    if (!rects_intersect(tree->bounds, query))
+        return;
+    
+    if (tree->depth % 2 == 0)
+        kdtree_search_filtered_axis<K, 0>(tree, query, filter, results, ct, false);
+    else
+        kdtree_search_filtered_axis<K, 1>(tree, query, filter, results, ct, false);
+}
+
+// true if p is in excluded, which is sorted
+static inline bool kd_is_excluded(const std::vector<const Point*>& excluded, const Point* p) {
+    return std::binary_search(excluded.begin(), excluded.end(), p);
+}
+
+// kdtree_search_axis skipping the points in excluded. A point is only looked up once it would make the results, so
+// the lookups stay off the common path, and a skipped point doesn't end the leaf because the ranks after it still can
+template <int K, int Axis>
+static void kdtree_search_excluding_axis(KdTree* tree, const Rect& query, const std::vector<const Point*>& excluded, ResultQueue& results, int& ct, bool contained) {
+
+    if (!contained && rects_contained(query, tree->bounds)) {
+        contained = true;
+    }
+
+    for (PointList::iterator it = tree->points.begin() ; it != tree->points.end(); ++it) {
+        if (!contained && !pt_contained(query, **it))
+            continue;
+        if (results.size() >= K && results.top()->rank <= (*it)->rank)
+            break;
+        if (!kd_is_excluded(excluded, *it)) {
+            results_offer<K>(results, *it);
+            ct++;
+        }
+    }
+
+    if (tree->left != 0 && (contained || rect_lo<Axis>(query) <= rect_hi<Axis>(tree->left->bounds)))
+        kdtree_search_excluding_axis<K, 1 - Axis>(tree->left, query, excluded, results, ct, contained);
+
+    if (tree->right != 0 && (contained || rect_hi<Axis>(query) >= rect_lo<Axis>(tree->right->bounds)))
+        kdtree_search_excluding_axis<K, 1 - Axis>(tree->right, query, excluded, results, ct, contained);
+}
+
+// Search the kdtree for the K lowest ranked points inside query that aren't in excluded (sorted)
+template <int K = SEARCH_MAX_RESULTS>
+static inline void kdtree_search_excluding(KdTree* tree, const Rect& query, const std::vector<const Point*>& excluded, ResultQueue& results, int& ct) {
+    if (excluded.empty()) {
+        kdtree_search<K>(tree, query, results, ct);
+        return;
+    }
+    if (!rects_intersect(tree->bounds, query))
+        return;
+
+    if (tree->depth % 2 == 0)
+        kdtree_search_excluding_axis<K, 0>(tree, query, excluded, results, ct, false);
+    else
+        kdtree_search_excluding_axis<K, 1>(tree, query, excluded, results, ct, false);
+}
+
+// Number of points inside query, answering nodes the query fully contains from their subtree count
+static int kdtree_count(KdTree* tree, const Rect& query) {
+    if (rects_contained(query, tree->bounds))
+        return tree->count;
+    
+    if (!rects_intersect(tree->bounds, query))
+        return 0;
+    
+    int ct = 0;
+    for (PointList::iterator it = tree->points.begin() ; it != tree->points.end(); ++it) {
+        if (pt_contained(query, **it))
+            ct++;
+    }
+    
+    if (tree->left != 0)
+        ct += kdtree_count(tree->left, query);
+    
+    if (tree->right != 0)
+        ct += kdtree_count(tree->right, query);
+    
+    return ct;
+}
+
+// Accumulate the subtree's points into grid, see quadtree_density_fill
+static void kdtree_density_fill(KdTree* tree, DensityGrid& grid) {
+    if (tree->count == 0 || !rects_intersect(tree->bounds, grid.rect))
+        return;
+    
+    if (density_grid_add_node(grid, tree->bounds, tree->count))
+        return;
+    
+    for (PointList::iterator it = tree->points.begin() ; it != tree->points.end(); ++it) {
+        density_grid_add(grid, **it);
+    }
+    
+    if (tree->left != 0)
+        kdtree_density_fill(tree->left, grid);
+    
+    if (tree->right != 0)
+        kdtree_density_fill(tree->right, grid);
+}
+
+// Histogram of the points inside rect over a w x h grid in a single descent of the tree
+static inline void kdtree_density_grid(KdTree* root, const Rect& rect, int w, int h, DensityGrid& grid) {
+    density_grid_init(grid, rect, w, h);
+    kdtree_density_fill(root, grid);
+}
+
+// Explicit stack entry for the iterative kdtree search
+struct KdTreeStackEntry {
+    KdTree* tree;
+    bool contained;  // The query fully contains this node, skip bounds checks below it
+};
+
+// Iterative version of kdtree_search with software prefetching, see quadtree_search_prefetch
+template <int K = SEARCH_MAX_RESULTS>
+static inline void kdtree_search_prefetch(KdTree* root, const Rect& query, ResultQueue& results, int& ct, int distance = SEARCH_PREFETCH_DISTANCE) {
+    KdTreeStackEntry stack[KD_MAX_DEPTH + 4];
+    int top = 0;
+    
+    stack[top].tree = root;
+    stack[top].contained = false;
+    top++;
+    
+    while (top > 0) {
+        if (distance > 0) {
+            if (top > distance)
+                SEARCH_PREFETCH(stack[top - 1 - distance].tree);
+            if (top >= distance && distance > 1 && stack[top - distance].tree->points.size() > 0)
+                SEARCH_PREFETCH(stack[top - distance].tree->points.data());
+        }
+        
+        top--;
+        KdTree* tree = stack[top].tree;
+        bool contained = stack[top].contained;
+        
+        if (!contained) {
+            if (rects_contained(query, tree->bounds))
+                contained = true;
+            else if (!rects_intersect(tree->bounds, query))
+                continue;
+        }
+        
+        // Leaf points are sorted by rank, stop at the first contained point that doesn't make the results
+        for (PointList::iterator it = tree->points.begin() ; it != tree->points.end(); ++it) {
+            if (contained || pt_contained(query, **it)) {
+                if (!results_offer<K>(results, *it))
+                    break;
+                ct++;
+            }
+        }
+        
+        // Push right first so left pops first, matching the recursive search
+        if (tree->right != 0) {
+            stack[top].tree = tree->right; stack[top].contained = contained; top++;
+        }
+        if (tree->left != 0) {
+            stack[top].tree = tree->left; stack[top].contained = contained; top++;
+        }
+    }
+}
+
+// One query's traversal in kdtree_search_interleaved: kdtree_search_prefetch's explicit stack, split into steps
+struct KdTreeTraversal {
+    int query;        // Index into the queries and results, -1 once the slot is idle
+    KdTree* node;     // Node whose points are being scanned, 0 if the next step pops
+    bool contained;   // The query fully contains node
+    int next;         // Next point of node to scan, -1 until the first chunk has been prefetched
+    KdTreeStackEntry stack[KD_MAX_DEPTH + 4];
+    int top;
+};
+
+// Start query q at the root
+static inline void kdtree_traversal_init(KdTreeTraversal& t, KdTree* root, int q) {
+    t.query = q;
+    t.node = 0;
+    t.stack[0].tree = root;
+    t.stack[0].contained = false;
+    t.top = 1;
+    SEARCH_PREFETCH(root);
+}
+
+// Advance a traversal by one memory stage, prefetching whatever the next stage reads: a pop checks a node's bounds
+// and prefetches its pointer block, the next step prefetches the first chunk of points, and each step after that
+// scans a chunk while prefetching the one after it. Once the node is done its children are pushed and the next node
+// to pop is prefetched. Returns false once the traversal is done
+template <int K>
+static inline bool kdtree_traversal_step(KdTreeTraversal& t, const Rect& query, ResultQueue& results, int& ct) {
+    if (t.node == 0) {
+        t.top--;
+        KdTree* tree = t.stack[t.top].tree;
+        bool contained = t.stack[t.top].contained;
+        
+        if (!contained) {
+            if (rects_contained(query, tree->bounds))
+                contained = true;
+            else if (!rects_intersect(tree->bounds, query)) {
+                if (t.top > 0)
+                    SEARCH_PREFETCH(t.stack[t.top - 1].tree);
+                return t.top > 0;
+            }
+        }
+        
+        t.node = tree;
+        t.contained = contained;
+        t.next = -1;
+        if (tree->points.size() > 0) {
+            SEARCH_PREFETCH(tree->points.data());
+            return true;
+        }
+    }
+    
+    KdTree* tree = t.node;
+    const int size = (int)tree->points.size();
+    if (t.next < 0 && size > 0) {
+        prefetch_points(tree->points.data(), 0, std::min(size, SEARCH_INTERLEAVE_CHUNK));
+        t.next = 0;
+        return true;
+    }
+    
+    // Leaf points are sorted by rank, stop at the first contained point that doesn't make the results
+    bool done = true;
+    if (size > 0) {
+        int end = std::min(size, t.next + SEARCH_INTERLEAVE_CHUNK);
+        prefetch_points(tree->points.data(), end, std::min(size, end + SEARCH_INTERLEAVE_CHUNK));
+        for (; t.next < end; t.next++) {
+            Point* p = tree->points[t.next];
+            if (t.contained || pt_contained(query, *p)) {
+                if (!results_offer<K>(results, p))
                     break;
-                }
+                ct++;
             }
         }
+        done = t.next < end || end == size;
+    }
+    if (!done)
+        return true;
+    
+    t.node = 0;
+    if (tree->right != 0) {
+        t.stack[t.top].tree = tree->right; t.stack[t.top].contained = t.contained; t.top++;
+    }
+    if (tree->left != 0) {
+        t.stack[t.top].tree = tree->left; t.stack[t.top].contained = t.contained; t.top++;
+    }
+    if (t.top > 0)
+        SEARCH_PREFETCH(t.stack[t.top - 1].tree);
+    return t.top > 0;
+}
+
+// Search the kdtree for every query, keeping `group` traversals in flight and stepping them round robin (AMAC), so
+// one query's node and point loads overlap with the others' work instead of stalling the core. A finished query's
+// slot takes the next one. results[q] receives the results of queries[q]
+template <int K = SEARCH_MAX_RESULTS>
+static void kdtree_search_interleaved(KdTree* root, const std::vector<Rect>& queries, std::vector<ResultQueue>& results, int& ct,
+                                      int group = SEARCH_INTERLEAVE_GROUP) {
+    results.resize(queries.size());
+    std::vector<KdTreeTraversal> slots(std::max(1, group));
+    
+    size_t next = 0;
+    int live = 0;
+    for (size_t s = 0; s < slots.size(); s++) {
+        slots[s].query = -1;
+        if (next < queries.size()) {
+            kdtree_traversal_init(slots[s], root, (int)next++);
+            live++;
+        }
+    }
+    
+    while (live > 0) {
+        for (size_t s = 0; s < slots.size(); s++) {
+            KdTreeTraversal& t = slots[s];
+            if (t.query < 0 || kdtree_traversal_step<K>(t, queries[t.query], results[t.query], ct))
+                continue;
+            
+            if (next < queries.size())
+                kdtree_traversal_init(t, root, (int)next++);
+            else {
+                t.query = -1;
+                live--;
+            }
+        }
+    }
+}
+
+// Search the kdtree for a whole batch of queries in one traversal, see quadtree_search_batch.
+// active[begin, end) holds the parent's live queries encoded as (query index << 1) | contained
+template <int K = SEARCH_MAX_RESULTS>
+static void kdtree_search_batch(KdTree* tree, const std::vector<Rect>& queries, std::vector<int>& active, size_t begin, std::vector<ResultQueue>& results) {
+    const size_t end = active.size();
+    
+    // Narrow the parent's active set down to the queries touching this node
+    for (size_t i = begin; i < end; i++) {
+        int a = active[i];
         
-        // Recursively search the left node
-        if (tree->left != 0)
-            kdtree_search(tree->left, query, results, ct);
+        if (a & 1) {
+            active.push_back(a);
+        }
+        else if (rects_contained(queries[a >> 1], tree->bounds)) {
+            active.push_back(a | 1);
+        }
+        else if (rects_intersect(tree->bounds, queries[a >> 1])) {
+            active.push_back(a);
+        }
+    }
     
-        // Recursively search the right node
-        if (tree->right != 0)
-            kdtree_search(tree->right, query, results, ct);
+    if (active.size() == end) {
+        return;
+    }
+    
+    // Scan this node's points once for every active query. Leaf points are sorted by rank, so once a
+    // query rejects a contained point it would reject the rest of this leaf too -- drop it from the scan
+    size_t node_end = active.size();
+    for (PointList::iterator it = tree->points.begin() ; it != tree->points.end() && node_end > end; ++it) {
+        for (size_t i = end; i < node_end; ) {
+            int a = active[i];
+            if (((a & 1) || pt_contained(queries[a >> 1], **it)) && !results_offer<K>(results[a >> 1], *it)) {
+                // Swap the finished query past the scan range; it stays active for the children
+                node_end--;
+                std::swap(active[i], active[node_end]);
+            } else {
+                i++;
+            }
+        }
+    }
+    
+    if (tree->left != 0)
+        kdtree_search_batch<K>(tree->left, queries, active, end, results);
+    
+    if (tree->right != 0)
+        kdtree_search_batch<K>(tree->right, queries, active, end, results);
+    
+    // Pop this node's active set before returning to the parent
+    active.resize(end);
+}
+
+// Search the kdtree for queries[batch[0 .. batch_size]], results[q] receives the results of queries[q]
+template <int K = SEARCH_MAX_RESULTS>
+static inline void kdtree_search_batch(KdTree* root, const std::vector<Rect>& queries, const int* batch, int batch_size, std::vector<ResultQueue>& results) {
+    std::vector<int> active;
+    active.reserve(batch_size * 8);
+    for (int i = 0; i < batch_size; i++) {
+        active.push_back(batch[i] << 1);
     }
+    kdtree_search_batch<K>(root, queries, active, 0, results);
 }
 
 #endif
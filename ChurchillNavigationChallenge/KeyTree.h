@@ -0,0 +1,574 @@
+//
+//  KeyTree.h
+//  ChurchillNavigationChallenge
+//
+//  Created by Eric Campbell on 2/19/15.
+//  Copyright (c) 2015 ECC. All rights reserved.
+//
+//
+//
+//  Integer key index. Coordinates are mapped once, at build and at query entry, to integer keys with an exact,
+//  order preserving mapping, so a translated query selects exactly the points the float query would. Two key widths:
+//    - 32 bit (the default): the float's bits, with negatives flipped so integer order matches float order. Takes
+//      any input and needs no table.
+//    - 16 bit: a coordinate's key is its position among the axis's sorted distinct values (rank space), stored as
+//      a biased int16. Needs the sorted values to translate queries and at most 65536 distinct values per axis.
+//      The table costs 4 bytes per distinct value per axis, so this only pays off on low cardinality data (snapped
+//      or duplicated coordinates). With a distinct value per point it is larger than 32 bit keys (1225 KB against
+//      984 KB for 50k uniform points) and no faster, since every query is translated through the table.
+//  Points live in a static kd-tree whose leaves keep their keys as SoA arrays, scanned 8 points per SIMD pass.
+//  Each node's key bounds sit next to its sibling's, so both children are tested against the query (intersect and
+//  contained) with one set of integer compares.
+
+#ifndef ChurchillNavigationChallenge_KeyTree_h
+#define ChurchillNavigationChallenge_KeyTree_h
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+#include "Shared.h"
+#include "Util.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const int KEY_MAX_DISTINCT = 65536;  // Distinct coordinates per axis a 16 bit key can address
+const int KEY_LEAF_SIZE = 1024;      // Max points per leaf. A leaf's rank ordered scan stops at the first rank that
+                                     // can't make the results, so big leaves cost little and save node visits
+const int KEY_SIMD_WIDTH = 8;        // Points per leaf scan pass. Leaves start on a multiple of it
+const int KEY_MAP_BUCKET = 8;        // Distinct coordinates per bucket of a CoordAxisMap, on average
+
+// Sorted distinct coordinates of one axis, the rank space of 16 bit keys: key k stands for values[k + 32768].
+// Equal width buckets over the value range narrow a lookup to the values in one bucket
+struct CoordAxisMap {
+    std::vector<float> values;
+    std::vector<uint32_t> buckets;   // First value in each bucket, plus values.size()
+    float lo;                        // Start of bucket 0
+    float scale;                     // Buckets per unit
+
+    CoordAxisMap() : lo(0), scale(0) {}
+};
+
+struct CoordKeyMap {
+    CoordAxisMap x;
+    CoordAxisMap y;
+};
+
+struct KeyTreeNode {
+    int min_rank;     // Lowest rank in the subtree
+    uint32_t begin;   // Leaf point range [begin, end) in the key arrays
+    uint32_t end;
+    int32_t left;     // First child's node index, the second child follows it. -1 for a leaf
+};
+
+template <typename CoordKey>
+struct BasicKeyTree {
+    CoordKeyMap map;                  // Rank space, 16 bit keys only
+    std::vector<KeyTreeNode> nodes;   // nodes[0] is the root
+    std::vector<CoordKey> bounds;     // lx, ly, hx, hy of each node's keys, by node index. Padded by one node
+    std::vector<CoordKey> xs;         // Point keys in leaf order, each leaf sorted by rank and padded
+    std::vector<CoordKey> ys;         //   to a multiple of KEY_SIMD_WIDTH
+    std::vector<int> ranks;           // Point ranks in the same order, so the scan never reads a Point
+    std::vector<Point*> pts;          // Original points in the same order, 0 in padding
+};
+
+// The index at the narrowest key width the data allows
+struct KeyTree {
+    BasicKeyTree<int16_t>* narrow;
+    BasicKeyTree<int32_t>* wide;
+
+    KeyTree() : narrow(0), wide(0) {}
+};
+
+// A point's keys during the build, with the index of the point it came from
+template <typename CoordKey>
+struct KeyedPoint {
+    CoordKey x;
+    CoordKey y;
+    int rank;
+    uint32_t source;
+};
+
+// A translated query, with the splats the SIMD leaf scan and node tests compare against
+template <typename CoordKey>
+struct KeyQuery {
+    BasicRect<CoordKey> r;
+#ifdef __SSE2__
+    __m128i lx, hx, ly, hy;           // Each bound in every lane
+    __m128i outside_lo, outside_hi;   // Per bounds lane (lx, ly, hx, hy): a node is disjoint if hx < q.lx, ..., lx > q.hx
+    __m128i inside_lo, inside_hi;     // and not contained if lx < q.lx, ..., hx > q.hx
+#endif
+};
+
+static inline int16_t key_from_index(size_t i) {
+    return (int16_t)((int)i - 32768);
+}
+
+// Float coordinate for a 16 bit key
+static inline float key_to_coord(const CoordAxisMap& map, int16_t key) {
+    return map.values[(int)key + 32768];
+}
+
+// Bucket holding v. Never decreases as v grows, so every value in an earlier bucket is smaller than v
+static inline size_t key_bucket(const CoordAxisMap& map, float v) {
+    float f = (v - map.lo) * map.scale;
+    size_t last = map.buckets.size() - 2;
+    if (!(f >= 0))
+        return 0;
+    return f >= (float)last ? last : (size_t)f;
+}
+
+// Index the buckets of a map whose values are filled in
+static void key_map_buckets(CoordAxisMap& map) {
+    size_t count = map.values.size() / KEY_MAP_BUCKET + 1;
+    map.lo = map.values.front();
+    map.scale = map.values.back() > map.lo ? (float)count / (map.values.back() - map.lo) : 0;
+    map.buckets.resize(count + 1);
+
+    size_t i = 0;
+    for (size_t b = 0; b < count; b++) {
+        while (i < map.values.size() && key_bucket(map, map.values[i]) < b)
+            i++;
+        map.buckets[b] = (uint32_t)i;
+    }
+    map.buckets[count] = (uint32_t)map.values.size();
+}
+
+// Position of the first value >= v (or > v if upper), searching only v's bucket
+static inline size_t key_map_find(const CoordAxisMap& map, float v, bool upper) {
+    size_t b = key_bucket(map, v);
+    std::vector<float>::const_iterator begin = map.values.begin() + map.buckets[b], end = map.values.begin() + map.buckets[b + 1];
+    return (upper ? std::upper_bound(begin, end, v) : std::lower_bound(begin, end, v)) - map.values.begin();
+}
+
+// 32 bit key for a coordinate: its bits, negatives flipped so integer order is float order. -0 and 0 share a key
+static inline int32_t key_from_float(float v) {
+    int32_t bits;
+    v = v == 0 ? 0.0f : v;
+    memcpy(&bits, &v, sizeof(bits));
+    return bits >= 0 ? bits : bits ^ 0x7FFFFFFF;
+}
+
+// Fill the query's SIMD splats from its key bounds
+static inline void key_prepare_query(KeyQuery<int16_t>& q) {
+#ifdef __SSE2__
+    const int16_t lo = std::numeric_limits<int16_t>::min(), hi = std::numeric_limits<int16_t>::max();
+    q.lx = _mm_set1_epi16(q.r.lx);
+    q.hx = _mm_set1_epi16(q.r.hx);
+    q.ly = _mm_set1_epi16(q.r.ly);
+    q.hy = _mm_set1_epi16(q.r.hy);
+    // Two nodes' bounds per register
+    q.outside_lo = _mm_setr_epi16(lo, lo, q.r.lx, q.r.ly, lo, lo, q.r.lx, q.r.ly);
+    q.outside_hi = _mm_setr_epi16(q.r.hx, q.r.hy, hi, hi, q.r.hx, q.r.hy, hi, hi);
+    q.inside_lo = _mm_setr_epi16(q.r.lx, q.r.ly, lo, lo, q.r.lx, q.r.ly, lo, lo);
+    q.inside_hi = _mm_setr_epi16(hi, hi, q.r.hx, q.r.hy, hi, hi, q.r.hx, q.r.hy);
+#endif
+}
+
+static inline void key_prepare_query(KeyQuery<int32_t>& q) {
+#ifdef __SSE2__
+    const int32_t lo = std::numeric_limits<int32_t>::min(), hi = std::numeric_limits<int32_t>::max();
+    q.lx = _mm_set1_epi32(q.r.lx);
+    q.hx = _mm_set1_epi32(q.r.hx);
+    q.ly = _mm_set1_epi32(q.r.ly);
+    q.hy = _mm_set1_epi32(q.r.hy);
+    // One node's bounds per register
+    q.outside_lo = _mm_setr_epi32(lo, lo, q.r.lx, q.r.ly);
+    q.outside_hi = _mm_setr_epi32(q.r.hx, q.r.hy, hi, hi);
+    q.inside_lo = _mm_setr_epi32(q.r.lx, q.r.ly, lo, lo);
+    q.inside_hi = _mm_setr_epi32(hi, hi, q.r.hx, q.r.hy);
+#endif
+}
+
+// Translate a float query into key space. Returns false if no point can fall inside it
+static inline bool key_translate_query(const BasicKeyTree<int16_t>* tree, const Rect& query, KeyQuery<int16_t>& out) {
+    if (!(query.lx <= query.hx && query.ly <= query.hy))
+        return false;
+
+    size_t lx = key_map_find(tree->map.x, query.lx, false), hx = key_map_find(tree->map.x, query.hx, true);
+    size_t ly = key_map_find(tree->map.y, query.ly, false), hy = key_map_find(tree->map.y, query.hy, true);
+    if (lx >= hx || ly >= hy)
+        return false;
+
+    out.r = BasicRect<int16_t>(key_from_index(lx), key_from_index(hx - 1), key_from_index(ly), key_from_index(hy - 1));
+    key_prepare_query(out);
+    return true;
+}
+
+static inline bool key_translate_query(const BasicKeyTree<int32_t>*, const Rect& query, KeyQuery<int32_t>& out) {
+    if (!(query.lx <= query.hx && query.ly <= query.hy))
+        return false;
+
+    out.r = BasicRect<int32_t>(key_from_float(query.lx), key_from_float(query.hx), key_from_float(query.ly), key_from_float(query.hy));
+    key_prepare_query(out);
+    return true;
+}
+
+// Test the two adjacent nodes whose bounds start at bounds against the query. Returns a mask whose low 4 bits are
+// nonzero if the first node is disjoint from the query, bits 4-7 the same for the second, bits 8-11 nonzero if the
+// first is not contained in the query and bits 12-15 the same for the second
+static inline unsigned keytree_test_pair(const int16_t* bounds, const KeyQuery<int16_t>& q) {
+#ifdef __SSE2__
+    __m128i b = _mm_loadu_si128((const __m128i*)bounds);
+    __m128i outside = _mm_or_si128(_mm_cmplt_epi16(b, q.outside_lo), _mm_cmpgt_epi16(b, q.outside_hi));
+    __m128i partial = _mm_or_si128(_mm_cmplt_epi16(b, q.inside_lo), _mm_cmpgt_epi16(b, q.inside_hi));
+    return (unsigned)_mm_movemask_epi8(_mm_packs_epi16(outside, partial));
+#else
+    unsigned mask = 0;
+    for (int c = 0; c < 2; c++) {
+        const int16_t* n = bounds + 4 * c;
+        if (n[2] < q.r.lx || n[3] < q.r.ly || n[0] > q.r.hx || n[1] > q.r.hy)
+            mask |= 0xFu << (4 * c);
+        if (n[0] < q.r.lx || n[1] < q.r.ly || n[2] > q.r.hx || n[3] > q.r.hy)
+            mask |= 0xFu << (8 + 4 * c);
+    }
+    return mask;
+#endif
+}
+
+static inline unsigned keytree_test_pair(const int32_t* bounds, const KeyQuery<int32_t>& q) {
+#ifdef __SSE2__
+    __m128i b0 = _mm_loadu_si128((const __m128i*)bounds);
+    __m128i b1 = _mm_loadu_si128((const __m128i*)(bounds + 4));
+    __m128i outside = _mm_packs_epi32(_mm_or_si128(_mm_cmplt_epi32(b0, q.outside_lo), _mm_cmpgt_epi32(b0, q.outside_hi)),
+                                      _mm_or_si128(_mm_cmplt_epi32(b1, q.outside_lo), _mm_cmpgt_epi32(b1, q.outside_hi)));
+    __m128i partial = _mm_packs_epi32(_mm_or_si128(_mm_cmplt_epi32(b0, q.inside_lo), _mm_cmpgt_epi32(b0, q.inside_hi)),
+                                      _mm_or_si128(_mm_cmplt_epi32(b1, q.inside_lo), _mm_cmpgt_epi32(b1, q.inside_hi)));
+    return (unsigned)_mm_movemask_epi8(_mm_packs_epi16(outside, partial));
+#else
+    unsigned mask = 0;
+    for (int c = 0; c < 2; c++) {
+        const int32_t* n = bounds + 4 * c;
+        if (n[2] < q.r.lx || n[3] < q.r.ly || n[0] > q.r.hx || n[1] > q.r.hy)
+            mask |= 0xFu << (4 * c);
+        if (n[0] < q.r.lx || n[1] < q.r.ly || n[2] > q.r.hx || n[3] > q.r.hy)
+            mask |= 0xFu << (8 + 4 * c);
+    }
+    return mask;
+#endif
+}
+
+// Bitmask of the 8 points at xs/ys (bit 2*j for point j) that query contains
+static inline unsigned keytree_match8(const int16_t* xs, const int16_t* ys, const KeyQuery<int16_t>& query) {
+#ifdef __SSE2__
+    __m128i x = _mm_loadu_si128((const __m128i*)xs);
+    __m128i y = _mm_loadu_si128((const __m128i*)ys);
+    __m128i outside = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi16(x, query.lx), _mm_cmpgt_epi16(x, query.hx)),
+                                   _mm_or_si128(_mm_cmplt_epi16(y, query.ly), _mm_cmpgt_epi16(y, query.hy)));
+    return ~(unsigned)_mm_movemask_epi8(outside) & 0xFFFF;
+#else
+    unsigned mask = 0;
+    for (int j = 0; j < KEY_SIMD_WIDTH; j++) {
+        if (xs[j] >= query.r.lx && xs[j] <= query.r.hx && ys[j] >= query.r.ly && ys[j] <= query.r.hy)
+            mask |= 3u << (2 * j);
+    }
+    return mask;
+#endif
+}
+
+static inline unsigned keytree_match8(const int32_t* xs, const int32_t* ys, const KeyQuery<int32_t>& query) {
+#ifdef __SSE2__
+    __m128i x0 = _mm_loadu_si128((const __m128i*)xs), x1 = _mm_loadu_si128((const __m128i*)(xs + 4));
+    __m128i y0 = _mm_loadu_si128((const __m128i*)ys), y1 = _mm_loadu_si128((const __m128i*)(ys + 4));
+    __m128i outside0 = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi32(x0, query.lx), _mm_cmpgt_epi32(x0, query.hx)),
+                                    _mm_or_si128(_mm_cmplt_epi32(y0, query.ly), _mm_cmpgt_epi32(y0, query.hy)));
+    __m128i outside1 = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi32(x1, query.lx), _mm_cmpgt_epi32(x1, query.hx)),
+                                    _mm_or_si128(_mm_cmplt_epi32(y1, query.ly), _mm_cmpgt_epi32(y1, query.hy)));
+    return ~(unsigned)_mm_movemask_epi8(_mm_packs_epi32(outside0, outside1)) & 0xFFFF;
+#else
+    unsigned mask = 0;
+    for (int j = 0; j < KEY_SIMD_WIDTH; j++) {
+        if (xs[j] >= query.r.lx && xs[j] <= query.r.hx && ys[j] >= query.r.ly && ys[j] <= query.r.hy)
+            mask |= 3u << (2 * j);
+    }
+    return mask;
+#endif
+}
+
+// Fill node n from keys[begin, end), splitting at the median key along alternating axes. Children are allocated
+// as adjacent pairs so their bounds can be tested together
+template <typename CoordKey>
+static void keytree_build_node(BasicKeyTree<CoordKey>* tree, std::vector<KeyedPoint<CoordKey> >& keys, int n,
+                               uint32_t begin, uint32_t end, int depth) {
+    typedef KeyedPoint<CoordKey> Keyed;
+    tree->nodes[n].begin = begin;
+    tree->nodes[n].end = end;
+    tree->nodes[n].left = -1;
+
+    CoordKey* bounds = &tree->bounds[4 * n];
+    bounds[0] = bounds[2] = keys[begin].x;
+    bounds[1] = bounds[3] = keys[begin].y;
+    int min_rank = keys[begin].rank;
+    for (uint32_t i = begin; i < end; i++) {
+        bounds[0] = std::min(bounds[0], keys[i].x);
+        bounds[1] = std::min(bounds[1], keys[i].y);
+        bounds[2] = std::max(bounds[2], keys[i].x);
+        bounds[3] = std::max(bounds[3], keys[i].y);
+        min_rank = std::min(min_rank, keys[i].rank);
+    }
+    tree->nodes[n].min_rank = min_rank;
+
+    if (end - begin <= KEY_LEAF_SIZE) {
+        // Leaves are scanned in rank order so a scan can stop at the first rejected point
+        std::sort(keys.begin() + begin, keys.begin() + end, [](const Keyed& a, const Keyed& b) { return a.rank < b.rank; });
+        return;
+    }
+
+    uint32_t mid = begin + (end - begin) / 2;
+    if (depth % 2 == 0)
+        std::nth_element(keys.begin() + begin, keys.begin() + mid, keys.begin() + end,
+                         [](const Keyed& a, const Keyed& b) { return a.x < b.x; });
+    else
+        std::nth_element(keys.begin() + begin, keys.begin() + mid, keys.begin() + end,
+                         [](const Keyed& a, const Keyed& b) { return a.y < b.y; });
+
+    int left = (int)tree->nodes.size();
+    tree->nodes.resize(left + 2);
+    tree->bounds.resize(4 * (left + 2));
+    tree->nodes[n].left = left;
+    keytree_build_node(tree, keys, left, begin, mid, depth + 1);
+    keytree_build_node(tree, keys, left + 1, mid, end, depth + 1);
+}
+
+// Lay the leaves out in the key arrays, each starting on a KEY_SIMD_WIDTH block, and point them at their new ranges
+template <typename CoordKey>
+static void keytree_layout_leaves(BasicKeyTree<CoordKey>* tree, const std::vector<KeyedPoint<CoordKey> >& keys,
+                                  const std::vector<Point*>& points, int n, uint32_t& cursor) {
+    KeyTreeNode& node = tree->nodes[n];
+    if (node.left >= 0) {
+        keytree_layout_leaves(tree, keys, points, node.left, cursor);
+        keytree_layout_leaves(tree, keys, points, node.left + 1, cursor);
+        return;
+    }
+
+    uint32_t begin = cursor;
+    for (uint32_t i = node.begin; i < node.end; i++, cursor++) {
+        tree->xs[cursor] = keys[i].x;
+        tree->ys[cursor] = keys[i].y;
+        tree->ranks[cursor] = keys[i].rank;
+        tree->pts[cursor] = points[keys[i].source];
+    }
+    node.begin = begin;
+    node.end = cursor;
+    cursor = (cursor + KEY_SIMD_WIDTH - 1) / KEY_SIMD_WIDTH * KEY_SIMD_WIDTH;
+}
+
+// Build the tree over keys, already translated from points
+template <typename CoordKey>
+static void keytree_build_keys(BasicKeyTree<CoordKey>* tree, std::vector<KeyedPoint<CoordKey> >& keys,
+                               const std::vector<Point*>& points) {
+    tree->nodes.resize(1);
+    tree->bounds.resize(4);
+    keytree_build_node(tree, keys, 0, 0, (uint32_t)keys.size(), 0);
+    tree->bounds.resize(tree->bounds.size() + 4, 0);
+
+    // Room for every leaf's padding, plus a block of slack
+    size_t leaves = (tree->nodes.size() + 1) / 2;
+    size_t slots = (keys.size() + leaves * (KEY_SIMD_WIDTH - 1)) / KEY_SIMD_WIDTH * KEY_SIMD_WIDTH + KEY_SIMD_WIDTH;
+    tree->xs.assign(slots, std::numeric_limits<CoordKey>::max());
+    tree->ys.assign(slots, std::numeric_limits<CoordKey>::max());
+    tree->pts.assign(slots, 0);
+    tree->ranks.assign(slots, std::numeric_limits<int>::max());
+
+    uint32_t cursor = 0;
+    keytree_layout_leaves(tree, keys, points, 0, cursor);
+    size_t used = cursor + KEY_SIMD_WIDTH;
+    tree->xs.resize(used);
+    tree->ys.resize(used);
+    tree->pts.resize(used);
+    tree->ranks.resize(used);
+}
+
+// Sort one axis's coordinates, recording the distinct values and each point's position among them
+static void keytree_rank_axis(const std::vector<Point*>& points, int axis, std::vector<float>& values, std::vector<uint32_t>& key_index) {
+    std::vector<std::pair<float, uint32_t> > sorted(points.size());
+    for (size_t i = 0; i < points.size(); i++) {
+        sorted[i] = std::make_pair(axis == 0 ? points[i]->x : points[i]->y, (uint32_t)i);
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    values.clear();
+    key_index.resize(points.size());
+    for (size_t i = 0; i < sorted.size(); i++) {
+        if (values.empty() || values.back() != sorted[i].first)
+            values.push_back(sorted[i].first);
+        key_index[sorted[i].second] = (uint32_t)values.size() - 1;
+    }
+}
+
+// Build a key tree over points with 32 bit keys, or with 16 bit rank keys when key_bits is 16 and every axis has
+// few enough distinct values (worth it only for low cardinality coordinates, see above)
+static KeyTree* keytree_build(const std::vector<Point*>& points, int key_bits = 32) {
+    KeyTree* tree = new KeyTree();
+    if (points.size() == 0)
+        return tree;
+
+    if (key_bits <= 16) {
+        BasicKeyTree<int16_t>* narrow = new BasicKeyTree<int16_t>();
+        std::vector<uint32_t> x_index, y_index;
+        keytree_rank_axis(points, 0, narrow->map.x.values, x_index);
+        keytree_rank_axis(points, 1, narrow->map.y.values, y_index);
+
+        if (narrow->map.x.values.size() <= KEY_MAX_DISTINCT && narrow->map.y.values.size() <= KEY_MAX_DISTINCT) {
+            key_map_buckets(narrow->map.x);
+            key_map_buckets(narrow->map.y);
+
+            std::vector<KeyedPoint<int16_t> > keys(points.size());
+            for (size_t i = 0; i < points.size(); i++) {
+                keys[i].x = key_from_index(x_index[i]);
+                keys[i].y = key_from_index(y_index[i]);
+                keys[i].rank = points[i]->rank;
+                keys[i].source = (uint32_t)i;
+            }
+            keytree_build_keys(narrow, keys, points);
+            tree->narrow = narrow;
+            return tree;
+        }
+        delete narrow;
+    }
+
+    // 32 bit keys asked for, or too many distinct coordinates for 16 bit keys
+    BasicKeyTree<int32_t>* wide = new BasicKeyTree<int32_t>();
+    std::vector<KeyedPoint<int32_t> > keys(points.size());
+    for (size_t i = 0; i < points.size(); i++) {
+        keys[i].x = key_from_float(points[i]->x);
+        keys[i].y = key_from_float(points[i]->y);
+        keys[i].rank = points[i]->rank;
+        keys[i].source = (uint32_t)i;
+    }
+    keytree_build_keys(wide, keys, points);
+    tree->wide = wide;
+    return tree;
+}
+
+static void keytree_delete(KeyTree* tree) {
+    delete tree->narrow;
+    delete tree->wide;
+    delete tree;
+}
+
+// Width of the tree's keys in bits
+static inline int keytree_key_bits(const KeyTree* tree) {
+    return tree->wide != 0 ? 32 : 16;
+}
+
+// The lowest ranked matches seen so far as (rank, slot) pairs in a max heap on rank. The search compares against
+// the ranks stored beside the keys and only reads the Points that make the final results
+template <int K>
+struct KeyCandidates {
+    std::pair<int, uint32_t> heap[K];
+    int size;
+    int bound;   // Rank a match has to beat
+
+    // Start from whatever the caller's results already hold
+    explicit KeyCandidates(const ResultQueue& results) : size(0) {
+        bound = results.size() >= K ? results.top()->rank : std::numeric_limits<int>::max();
+    }
+
+    inline bool offer(int rank, uint32_t slot) {
+        if (rank >= bound)
+            return false;
+        if (size == K) {
+            std::pop_heap(heap, heap + K);
+            size--;
+        }
+        heap[size++] = std::make_pair(rank, slot);
+        std::push_heap(heap, heap + size);
+        if (size == K)
+            bound = heap[0].first;
+        return true;
+    }
+};
+
+// Offer the leaf's points inside query (all of them if contained) in rank order, stopping at the first rejection
+template <int K, typename CoordKey>
+static inline void keytree_scan_leaf(const BasicKeyTree<CoordKey>* tree, const KeyTreeNode& node, const KeyQuery<CoordKey>& query,
+                                     bool contained, KeyCandidates<K>& candidates, int& ct) {
+    for (uint32_t i = node.begin; i < node.end; i += KEY_SIMD_WIDTH) {
+        // Ranks only grow from here
+        if (tree->ranks[i] >= candidates.bound)
+            return;
+
+        unsigned mask = contained ? 0xFFFF : keytree_match8(&tree->xs[i], &tree->ys[i], query);
+        uint32_t block_end = std::min(node.end, i + KEY_SIMD_WIDTH);
+        for (uint32_t j = i; j < block_end; j++) {
+            if (mask & (1u << (2 * (j - i)))) {
+                if (!candidates.offer(tree->ranks[j], j))
+                    return;
+                ct++;
+            }
+        }
+    }
+}
+
+// Search the subtree at n, which intersects the query (and lies inside it if contained)
+template <int K, typename CoordKey>
+static void keytree_search_node(const BasicKeyTree<CoordKey>* tree, int n, bool contained, const KeyQuery<CoordKey>& query,
+                                KeyCandidates<K>& candidates, int& ct) {
+    const KeyTreeNode& node = tree->nodes[n];
+
+    // Nothing in this subtree can make the results
+    if (node.min_rank >= candidates.bound)
+        return;
+
+    if (node.left < 0) {
+        keytree_scan_leaf<K>(tree, node, query, contained, candidates, ct);
+        return;
+    }
+
+    unsigned test = contained ? 0 : keytree_test_pair(&tree->bounds[4 * node.left], query);
+
+    // Lower min_rank child first so the other is more likely to be pruned
+    int first = tree->nodes[node.left + 1].min_rank < tree->nodes[node.left].min_rank ? 1 : 0;
+    for (int c = first, i = 0; i < 2; c ^= 1, i++) {
+        if ((test >> (4 * c)) & 0xF)
+            continue;
+        keytree_search_node<K>(tree, node.left + c, !((test >> (8 + 4 * c)) & 0xF), query, candidates, ct);
+    }
+}
+
+template <int K, typename CoordKey>
+static inline void keytree_search_keys(const BasicKeyTree<CoordKey>* tree, const Rect& query, ResultQueue& results, int& ct) {
+    KeyQuery<CoordKey> key_query;
+    if (!key_translate_query(tree, query, key_query))
+        return;
+
+    // The root's bounds test with the pair it starts
+    unsigned test = keytree_test_pair(&tree->bounds[0], key_query);
+    if (test & 0xF)
+        return;
+
+    KeyCandidates<K> candidates(results);
+    keytree_search_node<K>(tree, 0, !(test & 0xF00), key_query, candidates, ct);
+    for (int i = 0; i < candidates.size; i++) {
+        results_offer<K>(results, tree->pts[candidates.heap[i].second]);
+    }
+}
+
+// Search the key tree with a float query, translated to key space once. Results are the original points
+template <int K = SEARCH_MAX_RESULTS>
+static inline void keytree_search(const KeyTree* tree, const Rect& query, ResultQueue& results, int& ct) {
+    if (tree->narrow != 0)
+        keytree_search_keys<K>(tree->narrow, query, results, ct);
+    else if (tree->wide != 0)
+        keytree_search_keys<K>(tree->wide, query, results, ct);
+}
+
+template <typename CoordKey>
+static inline size_t keytree_size(const BasicKeyTree<CoordKey>* tree) {
+    return (tree->xs.size() + tree->ys.size() + tree->bounds.size()) * sizeof(CoordKey) + tree->pts.size() * sizeof(Point*) +
+           tree->ranks.size() * sizeof(int) + tree->nodes.size() * sizeof(KeyTreeNode) +
+           (tree->map.x.values.size() + tree->map.y.values.size()) * sizeof(float) +
+           (tree->map.x.buckets.size() + tree->map.y.buckets.size()) * sizeof(uint32_t);
+}
+
+// Bytes used by the key arrays, nodes and coordinate maps
+static inline size_t keytree_size(const KeyTree* tree) {
+    return sizeof(KeyTree) + (tree->narrow != 0 ? keytree_size(tree->narrow) : 0) + (tree->wide != 0 ? keytree_size(tree->wide) : 0);
+}
+
+#endif
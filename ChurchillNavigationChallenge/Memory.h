@@ -0,0 +1,222 @@
+//
+//  Memory.h
+//  ChurchillNavigationChallenge
+//
+//  Created by Eric Campbell on 2/15/15.
+//  Copyright (c) 2015 ECC. All rights reserved.
+//
+//
+//
+//  Bump allocated arena for read-only index storage. Chunks are mapped straight from the kernel,
+//  either from explicit huge pages (MAP_HUGETLB) or 2MB aligned and advised for transparent huge pages,
+//  so a cloned index sits in a few large pages instead of being scattered across the heap.
+
+#ifndef ChurchillNavigationChallenge_Memory_h
+#define ChurchillNavigationChallenge_Memory_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <type_traits>
+#include <algorithm>
+#include <vector>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+const size_t HUGE_PAGE_SIZE = 2 << 20;        // 2MB huge pages (x86-64 / aarch64 default)
+const size_t INDEX_ARENA_CHUNK = 64 << 20;    // Arena chunk size, a multiple of HUGE_PAGE_SIZE
+
+// A single kernel mapping owned by an arena
+struct IndexArenaChunk {
+    char* map;        // Start of the mapping
+    size_t map_size;  // Size of the mapping
+    char* base;       // First HUGE_PAGE_SIZE aligned byte within the mapping
+    size_t size;      // Usable bytes from base
+};
+
+struct IndexArena {
+    std::vector<IndexArenaChunk> chunks;
+    size_t used;          // Bytes handed out from the last chunk
+    bool explicit_huge;   // Ask for MAP_HUGETLB pages (falls back to transparent huge pages if none are reserved)
+    int huge_chunks;      // Number of chunks that actually got explicit huge pages
+    int numa_node;        // NUMA node new chunks are bound to, -1 for the default (first touch) policy
+
+    IndexArena() : used(0), explicit_huge(false), huge_chunks(0), numa_node(-1) {}
+};
+
+// Arena the calling thread's new index allocations are made from, 0 to use the regular heap.
+// Per thread, so a builder filling one arena never redirects allocations made concurrently elsewhere
+static thread_local IndexArena* index_arena = 0;
+
+// Map a new chunk of at least min_size bytes into the arena
+static bool index_arena_grow(IndexArena* arena, size_t min_size) {
+    IndexArenaChunk chunk;
+    chunk.size = std::max(INDEX_ARENA_CHUNK, (min_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+    chunk.map = (char*)MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (arena->explicit_huge) {
+        chunk.map_size = chunk.size;
+        chunk.map = (char*)mmap(0, chunk.map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (chunk.map != MAP_FAILED) {
+            chunk.base = chunk.map;
+            arena->huge_chunks++;
+        }
+    }
+#endif
+
+    if (chunk.map == MAP_FAILED) {
+        // Over-map by one huge page so the usable range can start on a huge page boundary
+        chunk.map_size = chunk.size + HUGE_PAGE_SIZE;
+        chunk.map = (char*)mmap(0, chunk.map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk.map == MAP_FAILED)
+            return false;
+
+        chunk.base = (char*)(((size_t)chunk.map + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+#ifdef MADV_HUGEPAGE
+        madvise(chunk.base, chunk.size, MADV_HUGEPAGE);
+#endif
+    }
+
+#if defined(__linux__) && defined(SYS_mbind)
+    // Bind the chunk to the arena's NUMA node (MPOL_BIND = 2) before anything touches it
+    if (arena->numa_node >= 0 && arena->numa_node < 64) {
+        unsigned long nodemask = 1UL << arena->numa_node;
+        syscall(SYS_mbind, chunk.base, chunk.size, 2, &nodemask, 64, 0);
+    }
+#endif
+
+    arena->chunks.push_back(chunk);
+    arena->used = 0;
+    return true;
+}
+
+// Create an empty arena, bound to numa_node if >= 0. Without a binding, pages land on the node of whoever
+// first touches them, so build the index on a thread pinned to the NUMA node that will query it
+static IndexArena* index_arena_create(bool explicit_huge, int numa_node = -1) {
+    IndexArena* arena = new IndexArena();
+    arena->explicit_huge = explicit_huge;
+    arena->numa_node = numa_node;
+    return arena;
+}
+
+// Unmap all of the arena's memory. Objects allocated from it must already be destroyed
+static void index_arena_destroy(IndexArena* arena) {
+    for (size_t i = 0; i < arena->chunks.size(); i++) {
+        munmap(arena->chunks[i].map, arena->chunks[i].map_size);
+    }
+
+    if (index_arena == arena)
+        index_arena = 0;
+
+    delete arena;
+}
+
+// Bump allocate size bytes from the arena
+static inline void* index_arena_alloc(IndexArena* arena, size_t size, size_t align = 16) {
+    if (arena->chunks.size() > 0) {
+        IndexArenaChunk& chunk = arena->chunks.back();
+        size_t offset = (arena->used + align - 1) & ~(align - 1);
+        if (offset + size <= chunk.size) {
+            arena->used = offset + size;
+            return chunk.base + offset;
+        }
+    }
+
+    if (!index_arena_grow(arena, size))
+        throw std::bad_alloc();
+
+    arena->used = size;
+    return arena->chunks.back().base;
+}
+
+// Total bytes handed out by the arena
+static inline size_t index_arena_size(IndexArena* arena) {
+    size_t size = arena->used;
+    for (size_t i = 0; i + 1 < arena->chunks.size(); i++) {
+        size += arena->chunks[i].size;
+    }
+    return size;
+}
+
+// Bytes of this process backed by transparent huge pages, -1 if unknown (not Linux)
+static inline long index_thp_bytes() {
+    long kb = -1;
+    FILE* f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == 0) return -1;
+
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "AnonHugePages:", 14) == 0) {
+            kb = atol(line + 14);
+            break;
+        }
+    }
+    fclose(f);
+    return kb < 0 ? -1 : kb * 1024;
+}
+
+// Prefix of every index_new object, recording the arena it came from (0 for the heap) so index_delete knows
+// whether to free it without looking the address up anywhere
+struct alignas(16) IndexHeader {
+    IndexArena* arena;
+};
+
+// Allocate and construct a T from the calling thread's index arena, or the heap if none is set
+template <typename T>
+static inline T* index_new() {
+    static_assert(alignof(T) <= alignof(IndexHeader), "index_new objects must fit IndexHeader's alignment");
+    const size_t size = sizeof(IndexHeader) + sizeof(T);
+    void* block = index_arena != 0 ? index_arena_alloc(index_arena, size, alignof(IndexHeader)) : ::operator new(size);
+    IndexHeader* header = new (block) IndexHeader();
+    header->arena = index_arena;
+    return new (header + 1) T();
+}
+
+// Destroy a T made with index_new, freeing it only if it came from the heap
+template <typename T>
+static inline void index_delete(T* p) {
+    IndexHeader* header = (IndexHeader*)p - 1;
+    bool heap = header->arena == 0;
+    p->~T();
+    if (heap)
+        ::operator delete(header);
+}
+
+// STL allocator for index containers. A container takes the calling thread's index arena when it is created and
+// keeps it, so it allocates from that arena (or the heap) for life and a free never has to ask where memory came
+// from. Arena memory is released with the arena, heap memory is freed as usual
+template <typename T>
+struct IndexAllocator {
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    IndexArena* arena;  // 0 for the heap
+
+    IndexAllocator() : arena(index_arena) {}
+    template <typename U> IndexAllocator(const IndexAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        if (arena != 0)
+            return (T*)index_arena_alloc(arena, n * sizeof(T), alignof(T));
+        return (T*)::operator new(n * sizeof(T));
+    }
+
+    void deallocate(T* p, size_t) {
+        if (arena == 0)
+            ::operator delete(p);
+    }
+};
+
+template <typename T, typename U>
+static inline bool operator==(const IndexAllocator<T>& a, const IndexAllocator<U>& b) { return a.arena == b.arena; }
+
+template <typename T, typename U>
+static inline bool operator!=(const IndexAllocator<T>& a, const IndexAllocator<U>& b) { return a.arena != b.arena; }
+
+#endif
@@ -0,0 +1,170 @@
+//
+//  Numa.h
+//  ChurchillNavigationChallenge
+//
+//  Created by Eric Campbell on 2/15/15.
+//  Copyright (c) 2015 ECC. All rights reserved.
+//
+//
+//
+//  NUMA topology, thread pinning and per-node replicas of the read-only index. Each replica copies the
+//  points and both trees into an arena bound to its node, so query threads pinned to that node only
+//  touch local memory. On systems without NUMA information everything collapses to a single node.
+
+#ifndef ChurchillNavigationChallenge_Numa_h
+#define ChurchillNavigationChallenge_Numa_h
+
+#include <stdio.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include "Shared.h"
+#include "Memory.h"
+#include "QuadTree.h"
+#include "KdTree.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+struct NumaNode {
+    int id;                 // Kernel NUMA node id
+    std::vector<int> cpus;  // CPUs local to this node
+};
+
+// A read-only copy of the index living entirely in one NUMA node's memory
+struct IndexReplica {
+    int numa_node;
+    IndexArena* arena;   // Owns the points and every tree node below
+    Point* points;       // Copies of the source points, in rank order
+    size_t num_points;
+    QuadTree* qt;
+    KdTree* kdt;
+};
+
+// Parse a kernel cpulist ("0-7,16-23") into cpu ids
+static inline void numa_parse_cpulist(const char* list, std::vector<int>& cpus) {
+    const char* p = list;
+    while (*p != 0 && *p != '\n') {
+        char* end;
+        int lo = (int)strtol(p, &end, 10);
+        int hi = lo;
+        if (end == p) break;
+        if (*end == '-') {
+            p = end + 1;
+            hi = (int)strtol(p, &end, 10);
+        }
+        for (int c = lo; c <= hi; c++) cpus.push_back(c);
+        p = (*end == ',') ? end + 1 : end;
+    }
+}
+
+// Discover the NUMA nodes with CPUs. Falls back to a single node holding every CPU
+static void numa_topology(std::vector<NumaNode>& nodes) {
+    nodes.clear();
+
+#ifdef __linux__
+    for (int id = 0; id < 1024; id++) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        FILE* f = fopen(path, "r");
+        if (f == 0) {
+            if (id > 0 && nodes.size() > 0) break;
+            continue;
+        }
+
+        char line[4096];
+        NumaNode node;
+        node.id = id;
+        if (fgets(line, sizeof(line), f))
+            numa_parse_cpulist(line, node.cpus);
+        fclose(f);
+
+        // Memory-only nodes can't run query threads
+        if (node.cpus.size() > 0)
+            nodes.push_back(node);
+    }
+#endif
+
+    if (nodes.size() == 0) {
+        NumaNode node;
+        node.id = -1;
+        int ct = std::max(1, (int)std::thread::hardware_concurrency());
+        for (int c = 0; c < ct; c++) node.cpus.push_back(c);
+        nodes.push_back(node);
+    }
+}
+
+// Pin the calling thread to the CPUs of node. Returns false if pinning isn't supported
+static inline bool numa_pin_thread(const NumaNode& node) {
+#ifdef __linux__
+    if (node.id < 0) return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < node.cpus.size(); i++) {
+        CPU_SET(node.cpus[i], &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+// Copy the points and both trees into a new arena bound to numa_node (-1 for no binding).
+// Call from a thread pinned to that node so any unbound pages are first touched locally
+static IndexReplica* index_replicate(const std::vector<Point*>& points, QuadTree* qt, KdTree* kdt, int numa_node, bool explicit_huge) {
+    IndexReplica* replica = new IndexReplica();
+    replica->numa_node = numa_node;
+    replica->arena = index_arena_create(explicit_huge, numa_node);
+    replica->num_points = points.size();
+
+    IndexArena* previous = index_arena;
+    index_arena = replica->arena;
+
+    // Points first and contiguous in rank order, then the trees depth first. The source points come in
+    // whatever order the caller keeps them (main's are permuted by the KdTree build), so sort a copy first
+    std::vector<Point*> by_rank(points);
+    std::stable_sort(by_rank.begin(), by_rank.end(), PointRankCompare());
+
+    PointMap point_map;
+    point_map.reserve(by_rank.size());
+    replica->points = (Point*)index_arena_alloc(replica->arena, sizeof(Point) * std::max((size_t)1, by_rank.size()), 64);
+    for (size_t i = 0; i < by_rank.size(); i++) {
+        new (&replica->points[i]) Point(*by_rank[i]);
+        point_map[by_rank[i]] = &replica->points[i];
+    }
+
+    replica->qt = quadtree_clone(qt, point_map);
+    replica->kdt = kdtree_clone(kdt, point_map);
+
+    index_arena = previous;
+    return replica;
+}
+
+static void index_replica_delete(IndexReplica* replica) {
+    quadtree_delete(replica->qt);
+    kdtree_delete(replica->kdt);
+    index_arena_destroy(replica->arena);
+    delete replica;
+}
+
+// Build one replica per NUMA node, each on a thread pinned to its node. replicas[i] belongs to nodes[i].
+// index_arena is per thread, so the replicas are built concurrently
+static void index_replicate_numa(const std::vector<Point*>& points, QuadTree* qt, KdTree* kdt, const std::vector<NumaNode>& nodes,
+                                 std::vector<IndexReplica*>& replicas, bool explicit_huge) {
+    replicas.resize(nodes.size());
+    std::vector<std::thread> builders;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        builders.push_back(std::thread([&, i]() {
+            numa_pin_thread(nodes[i]);
+            replicas[i] = index_replicate(points, qt, kdt, nodes[i].id, explicit_huge);
+        }));
+    }
+    for (size_t i = 0; i < builders.size(); i++) {
+        builders[i].join();
+    }
+}
+
+#endif
@@ -13,6 +13,7 @@
 #ifndef ChurchillNavigationChallenge_ppm_h
 #define ChurchillNavigationChallenge_ppm_h
 #include <fstream>
+#include <cmath>
 
 // RGB 0-255 pixel struct
 struct ppm {
@@ -221,6 +222,25 @@ static void ppm_draw_kdtree(ppm& img, KdTree* tree, ppm::pixel point_color) {
     }
 }
 
+// Draw a density grid (see quadtree_density_grid) as a heatmap stretched over the whole image.
+// Counts are log scaled from black through red and yellow to white, so sparse cells stay visible next to dense ones
+static void ppm_draw_heatmap(ppm& img, const DensityGrid& grid) {
+    int max_count = 0;
+    for (size_t i = 0; i < grid.counts.size(); i++) {
+        max_count = std::max(max_count, grid.counts[i]);
+    }
+    if (max_count == 0) return;
+    
+    const float scale = 1.0f / logf(1.0f + max_count);
+    for (int y = 0; y < img.height; y++) {
+        for (int x = 0; x < img.width; x++) {
+            int count = grid.counts[(y * grid.h / img.height) * grid.w + (x * grid.w / img.width)];
+            int heat = (int)(767 * logf(1.0f + count) * scale);
+            img.pixels[ppm_get_pos(img, x, y)] = ppm::pixel(std::min(heat, 255), std::min(std::max(heat - 256, 0), 255), std::max(heat - 512, 0));
+        }
+    }
+}
+
 static void ppm_write(ppm& img, std::string outfile) {
     // Open output stream
     std::ofstream ofs (outfile, std::ofstream::out);
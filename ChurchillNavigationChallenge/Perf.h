@@ -0,0 +1,190 @@
+//
+//  Perf.h
+//  ChurchillNavigationChallenge
+//
+//  Created by Eric Campbell on 2/19/15.
+//  Copyright (c) 2015 ECC. All rights reserved.
+//
+//
+//
+//  Hardware performance counters for the benchmark driver, read through Linux perf_event_open. Counts the calling
+//  thread in user space only, so perf_event_paranoid <= 2 is enough. The events are opened as one group, so they
+//  are scheduled onto the PMU together and every count covers the same interval; if the kernel has to multiplex
+//  the group, all of them are scaled by the same factor. Events the CPU or kernel doesn't offer (or that don't fit
+//  in the group) are reported as n/a. Everywhere else the counters never open and every call is a no-op.
+
+#ifndef ChurchillNavigationChallenge_Perf_h
+#define ChurchillNavigationChallenge_Perf_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+enum PerfEvent {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,     // L1 data cache read misses
+    PERF_LLC_MISSES,     // Last level cache misses
+    PERF_BRANCH_MISSES,
+    PERF_DTLB_MISSES,    // Data TLB read misses
+    PERF_NUM_EVENTS
+};
+
+static const char* perf_event_names[PERF_NUM_EVENTS] = {
+    "cycles", "instructions", "L1d misses", "LLC misses", "branch misses", "dTLB misses"
+};
+
+// Counter totals accumulated over one or more measured regions
+struct PerfSample {
+    double values[PERF_NUM_EVENTS];
+    bool valid[PERF_NUM_EVENTS];
+
+    PerfSample() {
+        for (int e = 0; e < PERF_NUM_EVENTS; e++) {
+            values[e] = 0;
+            valid[e] = false;
+        }
+    }
+};
+
+// Open counters for the calling thread: one descriptor per event (-1 when unavailable), the first open one leading the group
+struct PerfCounters {
+    int fds[PERF_NUM_EVENTS];
+    int leader;                     // Group leader's descriptor, -1 if nothing opened
+    int members;                    // Events in the group
+    int order[PERF_NUM_EVENTS];     // Event of each group member, in the order the group read reports them
+
+    PerfCounters() : leader(-1), members(0) {
+        for (int e = 0; e < PERF_NUM_EVENTS; e++) fds[e] = -1;
+    }
+};
+
+// Open every event for the calling thread as one group. Returns true if at least one counter is available
+static bool perf_counters_open(PerfCounters& pc) {
+#ifdef __linux__
+    const uint32_t types[PERF_NUM_EVENTS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE
+    };
+    const uint64_t configs[PERF_NUM_EVENTS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    };
+
+    for (int e = 0; e < PERF_NUM_EVENTS; e++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[e];
+        attr.config = configs[e];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // The leader starts disabled and members follow it. Reading the leader returns every member's count
+        // plus the group's enabled and running times, for scaling if the group is multiplexed
+        attr.disabled = pc.leader < 0 ? 1 : 0;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        pc.fds[e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, pc.leader, 0);
+        if (pc.fds[e] < 0)
+            continue;
+        if (pc.leader < 0)
+            pc.leader = pc.fds[e];
+        pc.order[pc.members++] = e;
+    }
+#endif
+
+    return pc.leader >= 0;
+}
+
+static void perf_counters_close(PerfCounters& pc) {
+#ifdef __linux__
+    // Members before the leader
+    for (int e = PERF_NUM_EVENTS - 1; e >= 0; e--) {
+        if (pc.fds[e] >= 0)
+            close(pc.fds[e]);
+        pc.fds[e] = -1;
+    }
+#endif
+    pc.leader = -1;
+    pc.members = 0;
+}
+
+// Zero and start the whole group
+static inline void perf_counters_start(PerfCounters& pc) {
+#ifdef __linux__
+    if (pc.leader >= 0) {
+        ioctl(pc.leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(pc.leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+}
+
+// Stop the group and add what it counted since perf_counters_start to sample
+static inline void perf_counters_stop(PerfCounters& pc, PerfSample& sample) {
+#ifdef __linux__
+    if (pc.leader < 0)
+        return;
+    ioctl(pc.leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    uint64_t data[3 + PERF_NUM_EVENTS];  // members, time enabled, time running, then one value per member
+    ssize_t expected = (ssize_t)((3 + pc.members) * sizeof(uint64_t));
+    if (read(pc.leader, data, sizeof(data)) != expected || data[0] != (uint64_t)pc.members)
+        return;
+
+    // A group that never got onto the PMU counted nothing
+    if (data[2] == 0)
+        return;
+    double scale = data[2] < data[1] ? (double)data[1] / data[2] : 1.0;
+    for (int m = 0; m < pc.members; m++) {
+        sample.values[pc.order[m]] += (double)data[3 + m] * scale;
+        sample.valid[pc.order[m]] = true;
+    }
+#endif
+}
+
+// Add the counts in src to dst
+static inline void perf_sample_add(PerfSample& dst, const PerfSample& src) {
+    for (int e = 0; e < PERF_NUM_EVENTS; e++) {
+        if (src.valid[e]) {
+            dst.values[e] += src.values[e];
+            dst.valid[e] = true;
+        }
+    }
+}
+
+// True if sample holds any counter values
+static inline bool perf_sample_valid(const PerfSample& sample) {
+    for (int e = 0; e < PERF_NUM_EVENTS; e++) {
+        if (sample.valid[e]) return true;
+    }
+    return false;
+}
+
+// Print sample divided by `per` (e.g. the number of queries) on one line after label. Prints nothing without counters
+static void perf_sample_print(const char* label, const PerfSample& sample, double per = 1) {
+    if (!perf_sample_valid(sample))
+        return;
+
+    printf("%s", label);
+    for (int e = 0; e < PERF_NUM_EVENTS; e++) {
+        if (sample.valid[e])
+            printf("  %s %.0f", perf_event_names[e], sample.values[e] / per);
+        else
+            printf("  %s n/a", perf_event_names[e]);
+    }
+    if (sample.valid[PERF_CYCLES] && sample.valid[PERF_INSTRUCTIONS] && sample.values[PERF_CYCLES] > 0)
+        printf("  IPC %.2f", sample.values[PERF_INSTRUCTIONS] / sample.values[PERF_CYCLES]);
+    printf("\n");
+}
+
+#endif
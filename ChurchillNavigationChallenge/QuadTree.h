@@ -10,6 +10,11 @@
 #define ChurchillNavigationChallenge_QuadTree_h
 
 #include "Shared.h"
+#include "Util.h"
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <thread>
 
 const int QT_MAX_PER_NODE = 32; // Maximun number of points per node before subdividing
 const int QT_MAX_DEPTH = 64;    // Maximum depth to allow before dumping all additional points into the leaf node
@@ -24,14 +29,17 @@ struct QuadTree {
     QuadTree *sw;  // Southwest subdivision quadrant
     QuadTree *se;  // Southeast subdivision quadrant
     
-    std::vector<Point*> pts; // Points in this node
+    PointList pts; // Points in this node
+    int min_rank;  // Lowest rank anywhere in this node's subtree, INT_MAX while empty
+    IdSummary ids; // Ids anywhere in this node's subtree
+    int count;     // Number of points in this node's subtree
     
-    QuadTree() : depth(0), nw(0), sw(0), ne(0), se(0) { }
+    QuadTree() : depth(0), nw(0), sw(0), ne(0), se(0), min_rank(std::numeric_limits<int>::max()), count(0) { }
 };
 
 // Create a quadtree node, initialized with bounds and depth
 static QuadTree* quadtree_construct(Rect bounds, int depth) {
-    QuadTree* node = new QuadTree();
+    QuadTree* node = index_new<QuadTree>();
     node->bounds = bounds;
     node->depth = depth;
     node->nw = 0;
@@ -52,11 +60,34 @@ static void quadtree_delete(QuadTree* root) {
         if (root->se != 0)
             quadtree_delete(root->se);
         
-        delete root;
+        index_delete(root);
         root = 0;
     }
 }
 
+// Deep copy a quadtree, allocating from the current index arena when one is set (see Memory.h).
+// Node points are remapped through point_map so the copy can reference replicated point data
+static QuadTree* quadtree_clone(QuadTree* src, const PointMap& point_map) {
+    QuadTree* node = quadtree_construct(src->bounds, src->depth);
+    node->min_rank = src->min_rank;
+    node->ids = src->ids;
+    node->count = src->count;
+    
+    node->pts.reserve(src->pts.size());
+    for (PointList::iterator it = src->pts.begin() ; it != src->pts.end(); ++it) {
+        node->pts.push_back(point_map.find(*it)->second);
+    }
+    
+    if (src->nw != 0) {
+        node->nw = quadtree_clone(src->nw, point_map);
+        node->ne = quadtree_clone(src->ne, point_map);
+        node->sw = quadtree_clone(src->sw, point_map);
+        node->se = quadtree_clone(src->se, point_map);
+    }
+    
+    return node;
+}
+
 // Forward declaration of internal quadtree_insert method (below)
 static bool quadtree_insert(QuadTree* node, Point* p);
 
@@ -89,66 +120,419 @@ static inline void quadtree_print(QuadTree* node) {
 // Return all points within this node and all of it's children
 // This is used when the boundary is fully contained within the search
 // range and further rect intersection/containment checks are no longer needed
-static inline void quadtree_return_subtree(QuadTree* node, std::priority_queue<Point*, std::vector<Point*>>& results, int& ct) {
+template <int K = SEARCH_MAX_RESULTS>
+static inline void quadtree_return_subtree(QuadTree* node, ResultQueue& results, int& ct) {
     
     // Add all points within this node to the search results container
-    for (std::vector<Point*>::iterator it = node->pts.begin() ; it != node->pts.end(); ++it) {
-        if (results.size() < 20) {
-            results.push(*it);
+    for (PointList::iterator it = node->pts.begin() ; it != node->pts.end(); ++it) {
+        if (results_offer<K>(results, *it))
             ct++;
-        }
-        else if (results.top()->rank > (*it)->rank) {
-            results.pop();
-            results.push(*it);
-            ct++;
-        }
     }
     
     // Return all results in the child nodes of this node
     if (node->nw != 0) {
-        quadtree_return_subtree(node->nw, results, ct);
-        quadtree_return_subtree(node->ne, results, ct);
-        quadtree_return_subtree(node->sw, results, ct);
-        quadtree_return_subtree(node->se, results, ct);
+        quadtree_return_subtree<K>(node->nw, results, ct);
+        quadtree_return_subtree<K>(node->ne, results, ct);
+        quadtree_return_subtree<K>(node->sw, results, ct);
+        quadtree_return_subtree<K>(node->se, results, ct);
     }
 }
 
 // Depth first search the quadtree node (root) for all points within query Rect, add them to the results container
-// Top level points in the tree will always have the lowest ranks in that boundary, if we get to 20 (max search result count) we can stop searching
-static inline void quadtree_search(QuadTree* node, const Rect query, std::priority_queue<Point*, std::vector<Point*>>& results, int& ct) {
+// Top level points in the tree will always have the lowest ranks in that boundary, if we get to K (max search result count) we can stop searching
+template <int K = SEARCH_MAX_RESULTS>
+static inline void quadtree_search(QuadTree* node, const Rect query, ResultQueue& results, int& ct) {
     
     // If this node is fully contained within the search query, return all points in tree below this node
     if (rects_contained(query, node->bounds)) {
-        quadtree_return_subtree(node, results, ct);
+        quadtree_return_subtree<K>(node, results, ct);
     }
     // If this node's boundary rectangle intersects with the query rectangle, then check all points in this node for containment
     // and add to the results container when inside the search rect
     else if (rects_intersect(node->bounds, query)) {
-        for (std::vector<Point*>::iterator it = node->pts.begin() ; it != node->pts.end(); ++it) {
-            if (pt_contained(query, **it)) {
-                if (results.size() < 20) {
-                    results.push(*it);
-                    ct++;
-                }
-                else if (results.top()->rank > (*it)->rank) {
-                    results.pop();
-                    results.push(*it);
-                    ct++;
-                }
-            }
+        for (PointList::iterator it = node->pts.begin() ; it != node->pts.end(); ++it) {
+            if (pt_contained(query, **it) && results_offer<K>(results, *it))
+                ct++;
         }
         
         // If there was an intersection, then recursively search the child nodes
         if (node->nw != 0) {
-            quadtree_search(node->nw, query, results, ct);
-            quadtree_search(node->ne, query, results, ct);
-            quadtree_search(node->sw, query, results, ct);
-            quadtree_search(node->se, query, results, ct);
+            quadtree_search<K>(node->nw, query, results, ct);
+            quadtree_search<K>(node->ne, query, results, ct);
+            quadtree_search<K>(node->sw, query, results, ct);
+            quadtree_search<K>(node->se, query, results, ct);
         }
     }
     // Else no intersection and no containment, stop recursing the tree
 }
 
+// Depth first search that visits children lowest min_rank first and prunes any subtree whose min_rank can't beat
+// the current Kth best result. Node points are in rank order (inserted sorted), so a node's scan also stops at
+// the first point ranked too high. Large queries finish after a handful of nodes instead of enumerating the whole
+// intersection
+template <int K = SEARCH_MAX_RESULTS>
+static void quadtree_search_ranked(QuadTree* node, const Rect& query, ResultQueue& results, int& ct, bool contained = false) {
+    
+    // Nothing in this subtree can make the results
+    if (results.size() >= K && node->min_rank >= results.top()->rank) {
+        return;
+    }
+    
+    if (!contained) {
+        if (rects_contained(query, node->bounds))
+            contained = true;
+        else if (!rects_intersect(node->bounds, query))
+            return;
+    }
+    
+    for (PointList::iterator it = node->pts.begin() ; it != node->pts.end(); ++it) {
+        if (results.size() >= K && (*it)->rank > results.top()->rank)
+            break;
+        
+        if ((contained || pt_contained(query, **it)) && results_offer<K>(results, *it))
+            ct++;
+    }
+    
+    if (node->nw != 0) {
+        // Order the four children by min_rank (insertion sort)
+        QuadTree* children[4] = { node->nw, node->ne, node->sw, node->se };
+        for (int i = 1; i < 4; i++) {
+            QuadTree* child = children[i];
+            int j = i - 1;
+            while (j >= 0 && children[j]->min_rank > child->min_rank) {
+                children[j + 1] = children[j];
+                j--;
+            }
+            children[j + 1] = child;
+        }
+        
+        for (int i = 0; i < 4; i++) {
+            // Children are sorted, so once one is pruned the rest are too
+            if (results.size() >= K && children[i]->min_rank >= results.top()->rank)
+                break;
+            quadtree_search_ranked<K>(children[i], query, results, ct, contained);
+        }
+    }
+}
+
+// quadtree_search_ranked restricted to points whose id passes filter. Subtrees whose id summary can't match the
+// filter are skipped outright, so selective filters never reach the leaves that would have rejected every point
+template <int K = SEARCH_MAX_RESULTS>
+static void quadtree_search_filtered(QuadTree* node, const Rect& query, const IdFilter& filter, ResultQueue& results, int& ct, bool contained = false) {
+    
+    if (!id_filter_may_match(filter, node->ids)) {
+        return;
+    }
+    
+    if (results.size() >= K && node->min_rank >= results.top()->rank) {
+        return;
+    }
+    
+    if (!contained) {
+        if (rects_contained(query, node->bounds))
+            contained = true;
+        else if (!rects_intersect(node->bounds, query))
+            return;
+    }
+    
+    for (PointList::iterator it = node->pts.begin() ; it != node->pts.end(); ++it) {
+        if (results.size() >= K && (*it)->rank > results.top()->rank)
+            break;
+        
+        if ((contained || pt_contained(query, **it)) && id_filter_matches(filter, (*it)->id) && results_offer<K>(results, *it))
+            ct++;
+    }
+    
+    if (node->nw != 0) {
+        QuadTree* children[4] = { node->nw, node->ne, node->sw, node->se };
+        for (int i = 1; i < 4; i++) {
+            QuadTree* child = children[i];
+            int j = i - 1;
+            while (j >= 0 && children[j]->min_rank > child->min_rank) {
+                children[j + 1] = children[j];
+                j--;
+            }
+            children[j + 1] = child;
+        }
+        
+        for (int i = 0; i < 4; i++) {
+            if (results.size() >= K && children[i]->min_rank >= results.top()->rank)
+                break;
+            quadtree_search_filtered<K>(children[i], query, filter, results, ct, contained);
+        }
+    }
+}
+
+// Number of points inside query. Nodes the query fully contains are answered from their subtree count,
+// so only the nodes straddling the query's edges are scanned
+static int quadtree_count(QuadTree* node, const Rect& query) {
+    if (rects_contained(query, node->bounds))
+        return node->count;
+    
+    if (!rects_intersect(node->bounds, query))
+        return 0;
+    
+    int ct = 0;
+    for (PointList::iterator it = node->pts.begin() ; it != node->pts.end(); ++it) {
+        if (pt_contained(query, **it))
+            ct++;
+    }
+    
+    if (node->nw != 0) {
+        ct += quadtree_count(node->nw, query);
+        ct += quadtree_count(node->ne, query);
+        ct += quadtree_count(node->sw, query);
+        ct += quadtree_count(node->se, query);
+    }
+    return ct;
+}
+
+// Accumulate the subtree's points into grid, descending only into nodes that span more than one cell
+static void quadtree_density_fill(QuadTree* node, DensityGrid& grid) {
+    if (node->count == 0 || !rects_intersect(node->bounds, grid.rect))
+        return;
+    
+    if (density_grid_add_node(grid, node->bounds, node->count))
+        return;
+    
+    for (PointList::iterator it = node->pts.begin() ; it != node->pts.end(); ++it) {
+        density_grid_add(grid, **it);
+    }
+    
+    if (node->nw != 0) {
+        quadtree_density_fill(node->nw, grid);
+        quadtree_density_fill(node->ne, grid);
+        quadtree_density_fill(node->sw, grid);
+        quadtree_density_fill(node->se, grid);
+    }
+}
+
+// Histogram of the points inside rect over a w x h grid in a single descent of the tree. Only nodes strictly inside
+// a cell are counted whole and the points held by interior nodes are binned one by one, so this is slower than a
+// plain scan of the points until there are millions of them on a coarse grid (execute_count_queries reports where)
+static inline void quadtree_density_grid(QuadTree* root, const Rect& rect, int w, int h, DensityGrid& grid) {
+    density_grid_init(grid, rect, w, h);
+    quadtree_density_fill(root, grid);
+}
+
+// Explicit stack entry for the iterative quadtree search
+struct QuadTreeStackEntry {
+    QuadTree* node;
+    bool contained;  // The query fully contains this node, skip bounds checks below it
+};
+
+// Iterative version of quadtree_search, visiting nodes in the same order from an explicit stack so upcoming nodes
+// are known ahead of time. Each step prefetches the node `distance` pops ahead and the point block of the node
+// one pop closer (its node was prefetched on the previous step), hiding the child loads behind the current scan
+template <int K = SEARCH_MAX_RESULTS>
+static inline void quadtree_search_prefetch(QuadTree* root, const Rect& query, ResultQueue& results, int& ct, int distance = SEARCH_PREFETCH_DISTANCE) {
+    QuadTreeStackEntry stack[QT_MAX_DEPTH * 3 + 4];
+    int top = 0;
+    
+    stack[top].node = root;
+    stack[top].contained = false;
+    top++;
+    
+    while (top > 0) {
+        if (distance > 0) {
+            if (top > distance)
+                SEARCH_PREFETCH(stack[top - 1 - distance].node);
+            if (top >= distance && distance > 1 && stack[top - distance].node->pts.size() > 0)
+                SEARCH_PREFETCH(stack[top - distance].node->pts.data());
+        }
+        
+        top--;
+        QuadTree* node = stack[top].node;
+        bool contained = stack[top].contained;
+        
+        if (!contained) {
+            if (rects_contained(query, node->bounds))
+                contained = true;
+            else if (!rects_intersect(node->bounds, query))
+                continue;
+        }
+        
+        for (PointList::iterator it = node->pts.begin() ; it != node->pts.end(); ++it) {
+            if ((contained || pt_contained(query, **it)) && results_offer<K>(results, *it))
+                ct++;
+        }
+        
+        // Push the children in reverse so they pop in NW, NE, SW, SE order like the recursive search
+        if (node->nw != 0) {
+            stack[top].node = node->se; stack[top].contained = contained; top++;
+            stack[top].node = node->sw; stack[top].contained = contained; top++;
+            stack[top].node = node->ne; stack[top].contained = contained; top++;
+            stack[top].node = node->nw; stack[top].contained = contained; top++;
+        }
+    }
+}
+
+// One query's traversal in quadtree_search_interleaved: quadtree_search_prefetch's explicit stack, split into steps
+struct QuadTreeTraversal {
+    int query;        // Index into the queries and results, -1 once the slot is idle
+    QuadTree* node;   // Node whose points are being scanned, 0 if the next step pops
+    bool contained;   // The query fully contains node
+    bool primed;      // node's points have been prefetched
+    QuadTreeStackEntry stack[QT_MAX_DEPTH * 3 + 4];
+    int top;
+};
+
+// Start query q at the root
+static inline void quadtree_traversal_init(QuadTreeTraversal& t, QuadTree* root, int q) {
+    t.query = q;
+    t.node = 0;
+    t.stack[0].node = root;
+    t.stack[0].contained = false;
+    t.top = 1;
+    SEARCH_PREFETCH(root);
+}
+
+// Advance a traversal by one memory stage, see kdtree_traversal_step. Nodes hold few points, so one step prefetches
+// all of a node's points and the next scans them. Returns false once the traversal is done
+template <int K>
+static inline bool quadtree_traversal_step(QuadTreeTraversal& t, const Rect& query, ResultQueue& results, int& ct) {
+    if (t.node == 0) {
+        t.top--;
+        QuadTree* node = t.stack[t.top].node;
+        bool contained = t.stack[t.top].contained;
+        
+        if (!contained) {
+            if (rects_contained(query, node->bounds))
+                contained = true;
+            else if (!rects_intersect(node->bounds, query)) {
+                if (t.top > 0)
+                    SEARCH_PREFETCH(t.stack[t.top - 1].node);
+                return t.top > 0;
+            }
+        }
+        
+        t.node = node;
+        t.contained = contained;
+        t.primed = false;
+        if (node->pts.size() > 0) {
+            SEARCH_PREFETCH(node->pts.data());
+            return true;
+        }
+    }
+    
+    QuadTree* node = t.node;
+    if (!t.primed && node->pts.size() > 0) {
+        prefetch_points(node->pts.data(), 0, node->pts.size());
+        t.primed = true;
+        return true;
+    }
+    t.node = 0;
+    for (PointList::iterator it = node->pts.begin() ; it != node->pts.end(); ++it) {
+        if ((t.contained || pt_contained(query, **it)) && results_offer<K>(results, *it))
+            ct++;
+    }
+    
+    if (node->nw != 0) {
+        t.stack[t.top].node = node->se; t.stack[t.top].contained = t.contained; t.top++;
+        t.stack[t.top].node = node->sw; t.stack[t.top].contained = t.contained; t.top++;
+        t.stack[t.top].node = node->ne; t.stack[t.top].contained = t.contained; t.top++;
+        t.stack[t.top].node = node->nw; t.stack[t.top].contained = t.contained; t.top++;
+    }
+    if (t.top > 0)
+        SEARCH_PREFETCH(t.stack[t.top - 1].node);
+    return t.top > 0;
+}
+
+// Search the quadtree for every query with `group` traversals interleaved on this thread, see
+// kdtree_search_interleaved. results[q] receives the results of queries[q]
+template <int K = SEARCH_MAX_RESULTS>
+static void quadtree_search_interleaved(QuadTree* root, const std::vector<Rect>& queries, std::vector<ResultQueue>& results, int& ct,
+                                        int group = SEARCH_INTERLEAVE_GROUP) {
+    results.resize(queries.size());
+    std::vector<QuadTreeTraversal> slots(std::max(1, group));
+    
+    size_t next = 0;
+    int live = 0;
+    for (size_t s = 0; s < slots.size(); s++) {
+        slots[s].query = -1;
+        if (next < queries.size()) {
+            quadtree_traversal_init(slots[s], root, (int)next++);
+            live++;
+        }
+    }
+    
+    while (live > 0) {
+        for (size_t s = 0; s < slots.size(); s++) {
+            QuadTreeTraversal& t = slots[s];
+            if (t.query < 0 || quadtree_traversal_step<K>(t, queries[t.query], results[t.query], ct))
+                continue;
+            
+            if (next < queries.size())
+                quadtree_traversal_init(t, root, (int)next++);
+            else {
+                t.query = -1;
+                live--;
+            }
+        }
+    }
+}
+
+// Search the quadtree for a whole batch of queries in one traversal. active[begin, end) holds the queries still
+// alive at the parent, encoded as (query index << 1) | contained. The queries that touch this node are appended
+// to active, each node's points are scanned once for all of them, and the appended range is handed to the children.
+// Batches sorted with morton_sort_queries share most of their path, so the upper levels and leaves stay in cache
+template <int K = SEARCH_MAX_RESULTS>
+static void quadtree_search_batch(QuadTree* node, const std::vector<Rect>& queries, std::vector<int>& active, size_t begin, std::vector<ResultQueue>& results) {
+    const size_t end = active.size();
+    
+    // Narrow the parent's active set down to the queries touching this node
+    for (size_t i = begin; i < end; i++) {
+        int a = active[i];
+        
+        // Queries containing the parent contain all of its children as well
+        if (a & 1) {
+            active.push_back(a);
+        }
+        else if (rects_contained(queries[a >> 1], node->bounds)) {
+            active.push_back(a | 1);
+        }
+        else if (rects_intersect(node->bounds, queries[a >> 1])) {
+            active.push_back(a);
+        }
+    }
+    
+    // No query reaches this node, stop recursing the tree
+    if (active.size() == end) {
+        return;
+    }
+    
+    // Scan this node's points once for every active query
+    const size_t node_end = active.size();
+    for (PointList::iterator it = node->pts.begin() ; it != node->pts.end(); ++it) {
+        for (size_t i = end; i < node_end; i++) {
+            int a = active[i];
+            if ((a & 1) || pt_contained(queries[a >> 1], **it))
+                results_offer<K>(results[a >> 1], *it);
+        }
+    }
+    
+    if (node->nw != 0) {
+        quadtree_search_batch<K>(node->nw, queries, active, end, results);
+        quadtree_search_batch<K>(node->ne, queries, active, end, results);
+        quadtree_search_batch<K>(node->sw, queries, active, end, results);
+        quadtree_search_batch<K>(node->se, queries, active, end, results);
+    }
+    
+    // Pop this node's active set before returning to the parent
+    active.resize(end);
+}
+
+// Search the quadtree for queries[batch[0 .. batch_size]], results[q] receives the results of queries[q]
+template <int K = SEARCH_MAX_RESULTS>
+static inline void quadtree_search_batch(QuadTree* root, const std::vector<Rect>& queries, const int* batch, int batch_size, std::vector<ResultQueue>& results) {
+    std::vector<int> active;
+    active.reserve(batch_size * 8);
+    for (int i = 0; i < batch_size; i++) {
+        active.push_back(batch[i] << 1);
+    }
+    quadtree_search_batch<K>(root, queries, active, 0, results);
+}
+
 // Subdivides this quadtree node assuming a left->right, bottom->up coordinate system
 //       |
 //       . (0,1)      . (1,1)
@@ -203,6 +587,12 @@ static inline bool quadtree_insert(QuadTree* node, Point* p) {
         return false;
     }
     
+    // The children cover this node's bounds, so the point will land somewhere in this subtree
+    if (p->rank < node->min_rank)
+        node->min_rank = p->rank;
+    id_summary_add(node->ids, p->id);
+    node->count++;
+    
     // If we have subdivided, add to the children
     if (node->nw != 0) {
         
@@ -243,13 +633,135 @@ static inline bool quadtree_insert(QuadTree* node, Point* p) {
             //                quadtree_insert(node, *p);
             //            }
             
-            // Re-call the insert on this node -- since we have now subdivided the tree,
-            // it will go into one of the new child nodes
-            return quadtree_insert(node, p);
+            // Hand the point to the new child node it belongs in (re-inserting into this node would count it twice)
+            return quadtree_insert(node->nw, p) || quadtree_insert(node->ne, p) ||
+                   quadtree_insert(node->sw, p) || quadtree_insert(node->se, p);
         }
     }
     
     return false;
 }
 
+// A subtree left for the build pool: a node and the rank ordered range of pts it is built from
+struct QuadTreeBuildTask {
+    QuadTree* node;
+    size_t begin;
+    size_t end;
+};
+
+// Build the subtree under node from pts[begin, end), a rank ordered range that node's bounds fully contain.
+// Produces exactly what inserting the range one point at a time would: the node keeps the first QT_MAX_PER_NODE points
+// (or all of them at QT_MAX_DEPTH), and the rest go to the first child quadrant (NW, NE, SW, SE) containing them, in order.
+// Only [begin, end) of pts, scratch and quadrant is touched, so disjoint ranges can be built concurrently.
+// With tasks set, children at split_depth are queued there instead of being built
+static void quadtree_build_node(QuadTree* node, std::vector<Point*>& pts, std::vector<Point*>& scratch, std::vector<unsigned char>& quadrant,
+                                size_t begin, size_t end, std::vector<QuadTreeBuildTask>* tasks, int split_depth) {
+    if (begin == end) {
+        return;
+    }
+    
+    for (size_t i = begin; i < end; i++) {
+        if (pts[i]->rank < node->min_rank)
+            node->min_rank = pts[i]->rank;
+        id_summary_add(node->ids, pts[i]->id);
+    }
+    node->count += (int)(end - begin);
+    
+    size_t keep = node->depth >= QT_MAX_DEPTH ? end - begin : std::min(end - begin, (size_t)QT_MAX_PER_NODE);
+    node->pts.reserve(keep);
+    for (size_t i = begin; i < begin + keep; i++) {
+        node->pts.push_back(pts[i]);
+    }
+    begin += keep;
+    
+    if (begin == end) {
+        return;
+    }
+    
+    // Stable counting sort of the remaining points into their child quadrants. The quadrants meet at the midpoint
+    // quadtree_subdivide computed, so for a point inside this node the first quadrant containing it (boundaries
+    // included) takes one compare per axis instead of up to four rect tests
+    quadtree_subdivide(node);
+    QuadTree* children[4] = { node->nw, node->ne, node->sw, node->se };
+    const float mid_x = node->nw->bounds.hx, mid_y = node->nw->bounds.ly;
+    
+    size_t child_begin[5] = { begin, 0, 0, 0, 0 };
+    for (size_t i = begin; i < end; i++) {
+        int c = (pts[i]->y >= mid_y ? 0 : 2) + (pts[i]->x <= mid_x ? 0 : 1);
+        quadrant[i] = (unsigned char)c;
+        child_begin[c + 1]++;
+    }
+    for (int c = 0; c < 4; c++) {
+        child_begin[c + 1] += child_begin[c];
+    }
+    
+    size_t fill[4] = { child_begin[0], child_begin[1], child_begin[2], child_begin[3] };
+    for (size_t i = begin; i < end; i++) {
+        scratch[fill[quadrant[i]]++] = pts[i];
+    }
+    std::copy(scratch.begin() + begin, scratch.begin() + end, pts.begin() + begin);
+    
+    for (int c = 0; c < 4; c++) {
+        if (child_begin[c] == child_begin[c + 1])
+            continue;
+        if (tasks != 0 && children[c]->depth >= split_depth) {
+            QuadTreeBuildTask task = { children[c], child_begin[c], child_begin[c + 1] };
+            tasks->push_back(task);
+        } else {
+            quadtree_build_node(children[c], pts, scratch, quadrant, child_begin[c], child_begin[c + 1], tasks, split_depth);
+        }
+    }
+}
+
+// Bulk replacement for quadtree_insert(root, points, ct) on an empty root, producing an identical tree.
+// The top levels are split on the calling thread down to parallel_depth, and the subtrees below are handed, largest
+// first, to a fixed pool of one thread per hardware thread (the caller included) that claim them until none are left.
+// parallel_depth < 0 picks enough levels for about 8 subtrees per thread, so skewed data still balances.
+// A shared index arena can't be bumped from several threads, so with one set the caller builds every subtree itself
+static void quadtree_build(QuadTree* root, std::vector<Point*>& points, int& ct, int parallel_depth = -1) {
+    if (root->pts.size() > 0 || root->nw != 0) {
+        quadtree_insert(root, points, ct);
+        return;
+    }
+    
+    int num_threads = index_arena != 0 ? 1 : std::max(1, (int)std::thread::hardware_concurrency());
+    if (parallel_depth < 0) {
+        parallel_depth = 0;
+        for (int subtrees = 1; subtrees < 8 * num_threads; subtrees *= 4) {
+            parallel_depth++;
+        }
+    }
+    
+    // Points outside the root are dropped, as quadtree_insert would
+    std::vector<Point*> pts;
+    pts.reserve(points.size());
+    for (std::vector<Point*>::iterator it = points.begin() ; it != points.end(); ++it) {
+        if (pt_contained(root->bounds, **it))
+            pts.push_back(*it);
+    }
+    ct += points.size();
+    
+    std::vector<Point*> scratch(pts.size());
+    std::vector<unsigned char> quadrant(pts.size());
+    std::vector<QuadTreeBuildTask> tasks;
+    quadtree_build_node(root, pts, scratch, quadrant, 0, pts.size(), &tasks, root->depth + std::max(1, parallel_depth));
+    std::sort(tasks.begin(), tasks.end(), [](const QuadTreeBuildTask& a, const QuadTreeBuildTask& b) { return a.end - a.begin > b.end - b.begin; });
+    
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t t = next++; t < tasks.size(); t = next++) {
+            quadtree_build_node(tasks[t].node, pts, scratch, quadrant, tasks[t].begin, tasks[t].end, 0, 0);
+        }
+    };
+    
+    std::vector<std::thread> workers;
+    for (int t = 1; t < std::min(num_threads, (int)tasks.size()); t++) {
+        workers.push_back(std::thread(work));
+    }
+    work();
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+}
+
 #endif
@@ -0,0 +1,518 @@
+//
+//  Server.h
+//  ChurchillNavigationChallenge
+//
+//  Created by Eric Campbell on 2/17/15.
+//  Copyright (c) 2015 ECC. All rights reserved.
+//
+//
+//
+//  Local query server: builds the index once and answers rect queries over a Unix domain socket, so many
+//  frontend processes can share one index. A single poll() event loop owns every connection; requests that
+//  arrive together are coalesced into micro-batches and searched by a worker pool with kdtree_search_batch.
+//
+//  Protocol (native byte order, the socket is local):
+//    request   QueryRequest                                  (20 bytes)
+//    response  QueryResponseHeader + count * QueryResponsePoint, lowest rank first
+//  Requests can be pipelined; responses carry the request id and may come back out of order.
+
+#ifndef ChurchillNavigationChallenge_Server_h
+#define ChurchillNavigationChallenge_Server_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Shared.h"
+#include "Util.h"
+#include "KdTree.h"
+#include "Gen.h"
+
+const int SERVER_BATCH_SIZE = 64;     // Max queries per micro-batch handed to a worker
+const int SERVER_READ_SIZE = 64 * 1024;
+
+struct QueryRequest {
+    uint32_t id;
+    float lx;
+    float hx;
+    float ly;
+    float hy;
+};
+
+struct QueryResponseHeader {
+    uint32_t id;
+    uint32_t count;
+};
+
+struct QueryResponsePoint {
+    int32_t rank;
+    int16_t id;
+    int16_t reserved;
+    float x;
+    float y;
+};
+
+// A connection owned by the event loop
+struct ServerConnection {
+    int fd;
+    uint64_t key;       // Unique for the life of the server, so late completions for closed connections can be dropped
+    std::string in;     // Bytes read but not yet parsed into requests
+    std::string out;    // Response bytes waiting to be written
+};
+
+// A micro-batch of queries for one worker
+struct ServerJob {
+    std::vector<uint64_t> conns;
+    std::vector<uint32_t> ids;
+    std::vector<Rect> queries;
+};
+
+// Serialized responses for one connection, handed back from a worker to the event loop
+struct ServerCompletion {
+    uint64_t conn;
+    std::string bytes;
+};
+
+struct QueryServer {
+    KdTree* kdt;
+    int listen_fd;
+    int wake_pipe[2];   // Workers write a byte here when completions are ready
+
+    std::mutex lock;
+    std::condition_variable jobs_ready;
+    std::deque<ServerJob> jobs;
+    std::vector<ServerCompletion> completions;
+    std::vector<std::thread> workers;
+    bool stopping;
+
+    QueryServer() : kdt(0), listen_fd(-1), stopping(false) { wake_pipe[0] = wake_pipe[1] = -1; }
+};
+
+static volatile sig_atomic_t server_stop = 0;
+
+static void server_handle_signal(int) {
+    server_stop = 1;
+}
+
+static inline bool server_set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// Fill a sockaddr_un for path. Returns false if the path doesn't fit
+static inline bool server_address(const char* path, sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return false;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    return true;
+}
+
+// Search one micro-batch and serialize the responses, one completion per connection
+static void server_execute_job(QueryServer* server, ServerJob& job, std::vector<ServerCompletion>& out) {
+    std::vector<int> order;
+    std::vector<ResultQueue> results(job.queries.size());
+
+    morton_sort_queries(job.queries, server->kdt->bounds, order);
+    kdtree_search_batch(server->kdt, job.queries, &order[0], (int)order.size(), results);
+
+    std::vector<Point*> sorted;
+    for (size_t i = 0; i < job.queries.size(); i++) {
+        // Responses for the same connection are concatenated into a single completion
+        if (out.size() == 0 || out.back().conn != job.conns[i]) {
+            out.push_back(ServerCompletion());
+            out.back().conn = job.conns[i];
+        }
+        std::string& bytes = out.back().bytes;
+
+        sorted.clear();
+        while (results[i].size() > 0) {
+            sorted.push_back(results[i].top());
+            results[i].pop();
+        }
+
+        QueryResponseHeader header;
+        header.id = job.ids[i];
+        header.count = (uint32_t)sorted.size();
+        bytes.append((const char*)&header, sizeof(header));
+
+        for (int p = (int)sorted.size() - 1; p >= 0; p--) {
+            QueryResponsePoint rp;
+            rp.rank = sorted[p]->rank;
+            rp.id = sorted[p]->id;
+            rp.reserved = 0;
+            rp.x = sorted[p]->x;
+            rp.y = sorted[p]->y;
+            bytes.append((const char*)&rp, sizeof(rp));
+        }
+    }
+}
+
+static void server_worker(QueryServer* server) {
+    while (true) {
+        ServerJob job;
+        {
+            std::unique_lock<std::mutex> guard(server->lock);
+            while (server->jobs.size() == 0 && !server->stopping)
+                server->jobs_ready.wait(guard);
+            if (server->jobs.size() == 0)
+                return;
+            job.conns.swap(server->jobs.front().conns);
+            job.ids.swap(server->jobs.front().ids);
+            job.queries.swap(server->jobs.front().queries);
+            server->jobs.pop_front();
+        }
+
+        std::vector<ServerCompletion> done;
+        server_execute_job(server, job, done);
+
+        {
+            std::lock_guard<std::mutex> guard(server->lock);
+            for (size_t i = 0; i < done.size(); i++) {
+                server->completions.push_back(ServerCompletion());
+                server->completions.back().conn = done[i].conn;
+                server->completions.back().bytes.swap(done[i].bytes);
+            }
+        }
+
+        char wake = 1;
+        if (write(server->wake_pipe[1], &wake, 1) < 0) {
+            // The pipe is full, so the event loop is already due to wake up
+        }
+    }
+}
+
+// Bind and listen on path, start the worker pool. Returns false (with a message) on failure
+static bool server_start(QueryServer* server, const char* path, KdTree* kdt, int num_workers) {
+    server->kdt = kdt;
+
+    sockaddr_un addr;
+    if (!server_address(path, addr)) {
+        printf("Socket path too long: %s\n", path);
+        return false;
+    }
+
+    unlink(path);
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->listen_fd < 0 || bind(server->listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(server->listen_fd, 128) != 0) {
+        printf("Couldn't listen on %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    if (pipe(server->wake_pipe) != 0) {
+        printf("Couldn't create wake pipe: %s\n", strerror(errno));
+        return false;
+    }
+    server_set_nonblocking(server->listen_fd);
+    server_set_nonblocking(server->wake_pipe[0]);
+    server_set_nonblocking(server->wake_pipe[1]);
+
+    if (num_workers <= 0)
+        num_workers = std::max(1, (int)std::thread::hardware_concurrency());
+    for (int i = 0; i < num_workers; i++) {
+        server->workers.push_back(std::thread(server_worker, server));
+    }
+
+    return true;
+}
+
+// Stop the workers and close every descriptor
+static void server_shutdown(QueryServer* server, const char* path) {
+    {
+        std::lock_guard<std::mutex> guard(server->lock);
+        server->stopping = true;
+    }
+    server->jobs_ready.notify_all();
+    for (size_t i = 0; i < server->workers.size(); i++) {
+        server->workers[i].join();
+    }
+    server->workers.clear();
+
+    close(server->listen_fd);
+    close(server->wake_pipe[0]);
+    close(server->wake_pipe[1]);
+    unlink(path);
+}
+
+// Event loop: accept connections, parse requests into micro-batches for the workers and write back completions.
+// Runs until SIGINT/SIGTERM
+static void server_run(QueryServer* server) {
+    std::vector<ServerConnection> conns;
+    std::vector<pollfd> fds;
+    uint64_t next_key = 1;
+    char buffer[SERVER_READ_SIZE];
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, server_handle_signal);
+    signal(SIGTERM, server_handle_signal);
+
+    while (!server_stop) {
+        fds.resize(2 + conns.size());
+        fds[0].fd = server->listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = server->wake_pipe[0];
+        fds[1].events = POLLIN;
+        for (size_t i = 0; i < conns.size(); i++) {
+            fds[2 + i].fd = conns[i].fd;
+            fds[2 + i].events = POLLIN | (conns[i].out.size() > 0 ? POLLOUT : 0);
+        }
+        for (size_t i = 0; i < fds.size(); i++) {
+            fds[i].revents = 0;
+        }
+
+        if (poll(&fds[0], fds.size(), 100) < 0 && errno != EINTR)
+            break;
+
+        // Hand finished responses to their connections
+        if (fds[1].revents & POLLIN) {
+            while (read(server->wake_pipe[0], buffer, sizeof(buffer)) > 0) {}
+
+            std::vector<ServerCompletion> done;
+            {
+                std::lock_guard<std::mutex> guard(server->lock);
+                done.swap(server->completions);
+            }
+            for (size_t d = 0; d < done.size(); d++) {
+                for (size_t i = 0; i < conns.size(); i++) {
+                    if (conns[i].key == done[d].conn) {
+                        conns[i].out.append(done[d].bytes);
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Read and parse requests, coalescing everything that arrived this round into micro-batches
+        ServerJob pending;
+        std::vector<bool> closed(conns.size(), false);
+        for (size_t i = 0; i < conns.size(); i++) {
+            if (fds[2 + i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                while (true) {
+                    ssize_t n = read(conns[i].fd, buffer, sizeof(buffer));
+                    if (n > 0) {
+                        conns[i].in.append(buffer, n);
+                        continue;
+                    }
+                    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                        closed[i] = true;
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    break;
+                }
+
+                size_t parsed = 0;
+                while (conns[i].in.size() - parsed >= sizeof(QueryRequest)) {
+                    QueryRequest req;
+                    memcpy(&req, conns[i].in.data() + parsed, sizeof(req));
+                    parsed += sizeof(req);
+
+                    pending.conns.push_back(conns[i].key);
+                    pending.ids.push_back(req.id);
+                    pending.queries.push_back(Rect(req.lx, req.hx, req.ly, req.hy));
+                }
+                conns[i].in.erase(0, parsed);
+            }
+
+            // Write out whatever the socket will take
+            while (!closed[i] && conns[i].out.size() > 0) {
+                ssize_t n = write(conns[i].fd, conns[i].out.data(), conns[i].out.size());
+                if (n > 0) {
+                    conns[i].out.erase(0, n);
+                } else {
+                    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                        closed[i] = true;
+                    break;
+                }
+            }
+        }
+
+        for (int i = (int)conns.size() - 1; i >= 0; i--) {
+            if (closed[i]) {
+                close(conns[i].fd);
+                conns.erase(conns.begin() + i);
+            }
+        }
+
+        if (pending.queries.size() > 0) {
+            {
+                std::lock_guard<std::mutex> guard(server->lock);
+                for (size_t b = 0; b < pending.queries.size(); b += SERVER_BATCH_SIZE) {
+                    size_t e = std::min(pending.queries.size(), b + SERVER_BATCH_SIZE);
+                    server->jobs.push_back(ServerJob());
+                    ServerJob& job = server->jobs.back();
+                    job.conns.assign(pending.conns.begin() + b, pending.conns.begin() + e);
+                    job.ids.assign(pending.ids.begin() + b, pending.ids.begin() + e);
+                    job.queries.assign(pending.queries.begin() + b, pending.queries.begin() + e);
+                }
+            }
+            server->jobs_ready.notify_all();
+        }
+
+        // Accept new connections last so the fds above still line up with conns
+        if (fds[0].revents & POLLIN) {
+            while (true) {
+                int fd = accept(server->listen_fd, 0, 0);
+                if (fd < 0)
+                    break;
+                server_set_nonblocking(fd);
+                ServerConnection conn;
+                conn.fd = fd;
+                conn.key = next_key++;
+                conns.push_back(conn);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < conns.size(); i++) {
+        close(conns[i].fd);
+    }
+}
+
+// Connect to a query server, returns the socket or -1
+static int client_connect(const char* path) {
+    sockaddr_un addr;
+    if (!server_address(path, addr))
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static inline bool client_read_fully(int fd, void* data, size_t size) {
+    char* p = (char*)data;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static inline bool client_write_fully(int fd, const void* data, size_t size) {
+    const char* p = (const char*)data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Load generator: num_connections connections, each keeping `depth` requests in flight, num_queries in total.
+// Reports throughput and latency percentiles. Returns false if any connection failed
+static bool client_run(const char* path, int num_queries, int num_connections, int depth) {
+    std::vector<std::vector<double> > latencies(num_connections);
+    std::vector<char> failed(num_connections, 0);  // Not vector<bool>: each thread writes its own flag, and packed bits share words
+    std::vector<std::thread> threads;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int c = 0; c < num_connections; c++) {
+        threads.push_back(std::thread([&, c]() {
+            int fd = client_connect(path);
+            if (fd < 0) {
+                failed[c] = 1;
+                return;
+            }
+
+            int to_send = num_queries / num_connections + (c < num_queries % num_connections ? 1 : 0);
+            std::mt19937 rng(c + 1);
+            std::vector<std::chrono::steady_clock::time_point> sent_at(to_send);
+            int sent = 0, received = 0;
+
+            while (received < to_send) {
+                // Top the pipeline back up
+                while (sent < to_send && sent - received < depth) {
+                    float r = (float)(rng() % MAX_PT_RANGE), r2 = (float)(rng() % MAX_PT_RANGE);
+                    QueryRequest req;
+                    req.id = sent;
+                    req.lx = r / 2; req.hx = r;
+                    req.ly = r2 / 2; req.hy = r2;
+                    sent_at[sent] = std::chrono::steady_clock::now();
+                    if (!client_write_fully(fd, &req, sizeof(req))) {
+                        failed[c] = 1;
+                        break;
+                    }
+                    sent++;
+                }
+
+                QueryResponseHeader header;
+                if (failed[c] || !client_read_fully(fd, &header, sizeof(header)) || header.id >= (uint32_t)to_send) {
+                    failed[c] = 1;
+                    break;
+                }
+
+                std::vector<QueryResponsePoint> pts(header.count);
+                if (header.count > 0 && !client_read_fully(fd, &pts[0], sizeof(QueryResponsePoint) * header.count)) {
+                    failed[c] = 1;
+                    break;
+                }
+
+                auto now = std::chrono::steady_clock::now();
+                latencies[c].push_back(std::chrono::duration <double, std::micro> (now - sent_at[header.id]).count());
+                received++;
+            }
+
+            close(fd);
+        }));
+    }
+
+    for (size_t c = 0; c < threads.size(); c++) {
+        threads[c].join();
+    }
+    auto end = std::chrono::steady_clock::now();
+    double total_ms = std::chrono::duration <double, std::milli> (end - start).count();
+
+    std::vector<double> all;
+    bool ok = true;
+    for (int c = 0; c < num_connections; c++) {
+        all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+        if (failed[c]) ok = false;
+    }
+    std::sort(all.begin(), all.end());
+
+    printf("Queries: %d over %d connections, pipeline depth %d%s\n", (int)all.size(), num_connections, depth, ok ? "" : " (some connections failed)");
+    printf("Throughput: %.0f queries/s\n", all.size() / (total_ms / 1000));
+    if (all.size() > 0) {
+        const double pcts[] = { 50, 90, 99, 99.9 };
+        for (int i = 0; i < 4; i++) {
+            size_t at = std::min(all.size() - 1, (size_t)(all.size() * pcts[i] / 100));
+            printf("p%g Latency: %.1f us\n", pcts[i], all[at]);
+        }
+        printf("Max Latency: %.1f us\n", all.back());
+    }
+
+    return ok;
+}
+
+#endif
@@ -0,0 +1,295 @@
+//
+//  Shard.h
+//  ChurchillNavigationChallenge
+//
+//  Created by Eric Campbell on 2/18/15.
+//  Copyright (c) 2015 ECC. All rights reserved.
+//
+//
+//
+//  Sharded index: the points are partitioned into independently built KdTrees, each served by its own process
+//  over the Server.h protocol (local processes stand in for machines). A coordinator sends each query only to the
+//  shards whose bounds intersect it and merges their top-K lists by rank.
+//
+//  Shards are contacted in waves, lowest min_rank first. After each wave the coordinator stops if it already has
+//  K results ranked below the next shard's min_rank, since nothing from that shard or any after it could make the
+//  results. Spatial shards are all asked in one wave. Rank-range shards are asked one at a time, so most queries
+//  never leave the first shard.
+
+#ifndef ChurchillNavigationChallenge_Shard_h
+#define ChurchillNavigationChallenge_Shard_h
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <vector>
+#include "Shared.h"
+#include "Util.h"
+#include "KdTree.h"
+#include "Server.h"
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+const int SHARD_START_TIMEOUT_MS = 60000;  // How long the coordinator waits for every shard to start listening
+
+enum ShardPartition {
+    SHARD_SPATIAL,  // Vertical strips holding equal numbers of points
+    SHARD_RANK      // Contiguous rank ranges, each spread over the whole space
+};
+
+struct ShardInfo {
+    std::string path;  // Socket the shard serves on
+    pid_t pid;         // Shard process, 0 until spawned
+    Rect bounds;       // Tight bounds of the shard's points
+    int min_rank;      // Lowest rank in the shard, INT_MAX while empty
+    int count;         // Number of points in the shard
+
+    ShardInfo() : pid(0), min_rank(std::numeric_limits<int>::max()), count(0) {}
+};
+
+struct ShardCluster {
+    ShardPartition partition;
+    std::vector<ShardInfo> shards;  // Sorted by min_rank, the order shards are contacted in
+    int wave;                       // Shards contacted at once before checking the rank cutoff
+};
+
+// One coordinator thread's connections, fds[i] talks to shards[i]
+struct ShardClient {
+    std::vector<int> fds;
+    uint32_t next_id;
+
+    ShardClient() : next_id(0) {}
+};
+
+// Split rank ordered points into num_shards partitions. shard_points[i] holds shard i's points in rank order
+static void shard_partition(const std::vector<Point*>& points, int num_shards, ShardPartition partition, ShardCluster& cluster,
+                            std::vector<std::vector<Point*> >& shard_points) {
+    num_shards = std::max(1, num_shards);
+    cluster.partition = partition;
+    cluster.wave = partition == SHARD_SPATIAL ? num_shards : 1;
+    cluster.shards.assign(num_shards, ShardInfo());
+    shard_points.assign(num_shards, std::vector<Point*>());
+
+    // Strip boundaries at the X quantiles; a point on a boundary belongs to the strip on its right
+    std::vector<float> splits;
+    if (partition == SHARD_SPATIAL && points.size() > 0) {
+        std::vector<float> xs(points.size());
+        for (size_t i = 0; i < points.size(); i++) xs[i] = points[i]->x;
+        std::sort(xs.begin(), xs.end());
+        for (int s = 1; s < num_shards; s++) {
+            splits.push_back(xs[xs.size() * s / num_shards]);
+        }
+    }
+
+    for (size_t i = 0; i < points.size(); i++) {
+        int s;
+        if (partition == SHARD_SPATIAL)
+            s = (int)(std::upper_bound(splits.begin(), splits.end(), points[i]->x) - splits.begin());
+        else
+            s = (int)(i * num_shards / points.size());
+        shard_points[s].push_back(points[i]);
+    }
+
+    for (int s = 0; s < num_shards; s++) {
+        ShardInfo& shard = cluster.shards[s];
+        shard.count = (int)shard_points[s].size();
+        if (shard.count == 0)
+            continue;
+
+        shard.bounds = Rect(shard_points[s][0]->x, shard_points[s][0]->x, shard_points[s][0]->y, shard_points[s][0]->y);
+        for (int i = 0; i < shard.count; i++) {
+            const Point* p = shard_points[s][i];
+            shard.bounds.lx = std::min(shard.bounds.lx, p->x);
+            shard.bounds.hx = std::max(shard.bounds.hx, p->x);
+            shard.bounds.ly = std::min(shard.bounds.ly, p->y);
+            shard.bounds.hy = std::max(shard.bounds.hy, p->y);
+            shard.min_rank = std::min(shard.min_rank, p->rank);
+        }
+    }
+
+    // Contact order: lowest min_rank first, empty shards last
+    std::vector<int> order(num_shards);
+    for (int s = 0; s < num_shards; s++) order[s] = s;
+    std::stable_sort(order.begin(), order.end(), [&cluster](int a, int b) {
+        return cluster.shards[a].min_rank < cluster.shards[b].min_rank;
+    });
+
+    std::vector<ShardInfo> shards(num_shards);
+    std::vector<std::vector<Point*> > pts(num_shards);
+    for (int s = 0; s < num_shards; s++) {
+        shards[s] = cluster.shards[order[s]];
+        pts[s].swap(shard_points[order[s]]);
+    }
+    cluster.shards.swap(shards);
+    shard_points.swap(pts);
+}
+
+// Body of a shard process: build the shard's KdTree and serve it until SIGTERM
+static int shard_serve(const ShardInfo& shard, std::vector<Point*>& pts, int num_workers) {
+    KdTree* kdt = kdtree_construct(shard.bounds, 0);
+    kdtree_insert(kdt, pts);
+
+    QueryServer server;
+    if (!server_start(&server, shard.path.c_str(), kdt, num_workers)) {
+        fflush(stdout);
+        return 1;
+    }
+    server_run(&server);
+    server_shutdown(&server, shard.path.c_str());
+
+    kdtree_delete(kdt);
+    return 0;
+}
+
+// Stop every running shard process and wait for it to exit
+static void shard_stop(ShardCluster& cluster) {
+    for (size_t s = 0; s < cluster.shards.size(); s++) {
+        if (cluster.shards[s].pid > 0)
+            kill(cluster.shards[s].pid, SIGTERM);
+    }
+    for (size_t s = 0; s < cluster.shards.size(); s++) {
+        if (cluster.shards[s].pid > 0) {
+            waitpid(cluster.shards[s].pid, 0, 0);
+            cluster.shards[s].pid = 0;
+        }
+    }
+}
+
+// Fork one process per non-empty shard, serving on <base_path>.<shard>, and wait until all of them accept
+// connections. Must be called before the coordinator starts any threads. Returns false (with a message) on failure
+static bool shard_spawn(ShardCluster& cluster, const char* base_path, std::vector<std::vector<Point*> >& shard_points) {
+    int num_workers = std::max(1, (int)std::thread::hardware_concurrency() / (int)cluster.shards.size());
+
+    for (size_t s = 0; s < cluster.shards.size(); s++) {
+        ShardInfo& shard = cluster.shards[s];
+        shard.path = std::string(base_path) + "." + std::to_string(s);
+        if (shard.count == 0)
+            continue;
+
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            printf("Couldn't fork shard %d: %s\n", (int)s, strerror(errno));
+            shard_stop(cluster);
+            return false;
+        }
+        if (pid == 0) {
+#ifdef __linux__
+            // Don't outlive the coordinator
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+            _exit(shard_serve(shard, shard_points[s], num_workers));
+        }
+        shard.pid = pid;
+    }
+
+    // Wait for each shard to finish building and start listening
+    auto start = std::chrono::steady_clock::now();
+    for (size_t s = 0; s < cluster.shards.size(); s++) {
+        while (cluster.shards[s].pid > 0) {
+            int fd = client_connect(cluster.shards[s].path.c_str());
+            if (fd >= 0) {
+                close(fd);
+                break;
+            }
+
+            int status;
+            bool exited = waitpid(cluster.shards[s].pid, &status, WNOHANG) == cluster.shards[s].pid;
+            if (exited)
+                cluster.shards[s].pid = 0;
+            if (exited || std::chrono::steady_clock::now() - start > std::chrono::milliseconds(SHARD_START_TIMEOUT_MS)) {
+                printf("Shard %d failed to start on %s\n", (int)s, cluster.shards[s].path.c_str());
+                shard_stop(cluster);
+                return false;
+            }
+            usleep(10000);
+        }
+    }
+    return true;
+}
+
+// Open a connection to every running shard. Returns false if any connection fails
+static bool shard_connect(const ShardCluster& cluster, ShardClient& client) {
+    client.fds.assign(cluster.shards.size(), -1);
+    for (size_t s = 0; s < cluster.shards.size(); s++) {
+        if (cluster.shards[s].pid > 0 && (client.fds[s] = client_connect(cluster.shards[s].path.c_str())) < 0)
+            return false;
+    }
+    return true;
+}
+
+static void shard_disconnect(ShardClient& client) {
+    for (size_t s = 0; s < client.fds.size(); s++) {
+        if (client.fds[s] >= 0)
+            close(client.fds[s]);
+    }
+    client.fds.clear();
+}
+
+// Scatter query to the shards that could hold results and gather the SEARCH_MAX_RESULTS lowest ranked points into out,
+// lowest rank first. K is fixed by the shard servers, which always answer with their default top-K searches.
+// Returns the number of shards contacted, or -1 if a shard connection failed
+static int shard_search(const ShardCluster& cluster, ShardClient& client, const Rect& query, std::vector<QueryResponsePoint>& out) {
+    out.clear();
+    int contacted = 0;
+
+    std::vector<int> wave;
+    std::vector<QueryResponsePoint> shard_results, merged;
+    size_t next = 0;
+    while (next < cluster.shards.size()) {
+
+        // Rank cutoff: every shard from here on ranks above the current last result
+        if (out.size() >= (size_t)SEARCH_MAX_RESULTS && out.back().rank < cluster.shards[next].min_rank)
+            break;
+
+        // Send the next wave of intersecting shards their requests before reading any response
+        wave.clear();
+        for (; next < cluster.shards.size() && (int)wave.size() < cluster.wave; next++) {
+            const ShardInfo& shard = cluster.shards[next];
+            if (client.fds[next] < 0 || !rects_intersect(shard.bounds, query))
+                continue;
+
+            QueryRequest req;
+            req.id = client.next_id++;
+            req.lx = query.lx; req.hx = query.hx;
+            req.ly = query.ly; req.hy = query.hy;
+            if (!client_write_fully(client.fds[next], &req, sizeof(req)))
+                return -1;
+            wave.push_back((int)next);
+        }
+        contacted += (int)wave.size();
+
+        // Each shard's list is already rank ordered, so merge them two at a time and keep the first SEARCH_MAX_RESULTS
+        for (size_t w = 0; w < wave.size(); w++) {
+            QueryResponseHeader header;
+            if (!client_read_fully(client.fds[wave[w]], &header, sizeof(header)))
+                return -1;
+            shard_results.resize(header.count);
+            if (header.count > 0 && !client_read_fully(client.fds[wave[w]], &shard_results[0], sizeof(QueryResponsePoint) * header.count))
+                return -1;
+
+            merged.clear();
+            size_t a = 0, b = 0;
+            while (merged.size() < (size_t)SEARCH_MAX_RESULTS && (a < out.size() || b < shard_results.size())) {
+                if (b == shard_results.size() || (a < out.size() && out[a].rank < shard_results[b].rank))
+                    merged.push_back(out[a++]);
+                else
+                    merged.push_back(shard_results[b++]);
+            }
+            out.swap(merged);
+        }
+    }
+
+    return contacted;
+}
+
+#endif
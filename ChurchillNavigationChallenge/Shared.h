@@ -9,12 +9,19 @@
 #ifndef ChurchillNavigationChallenge_Shared_h
 #define ChurchillNavigationChallenge_Shared_h
 
+#include <stdint.h>
 #include <vector>
 #include <queue>
+#include <unordered_map>
+#include "Memory.h"
 
 struct QuadTree;
 struct KdTree;
 
+const int SEARCH_MAX_RESULTS = 20; // Number of lowest ranked points a search returns (the K of the top-K searches)
+
+// A ranked 2D point. Coordinates are float only: the engines are templated on K and the KdTree split axis but not on
+// the coordinate type, and integer coordinates go through KeyTree.h's keys instead
 struct Point
 {
     short id;
@@ -23,7 +30,6 @@ struct Point
     float y;
     
     Point() : id(0), rank(0), x(0), y(0) {}
-    Point(const Point&) {}
     
     bool operator()(const Point& l, const Point& r)
     {
@@ -31,22 +37,81 @@ struct Point
     }
 };
 
-struct Rect
+// Orders Point pointers by rank so the top of a results queue is always the highest (worst) ranked point
+// Comparing the raw pointers only worked while points happened to be allocated in rank order
+struct PointRankCompare
+{
+    bool operator()(const Point* l, const Point* r) const
+    {
+        return l->rank < r->rank;
+    }
+};
+
+// Points stored in index nodes; lives in the index arena when one is set
+typedef std::vector<Point*, IndexAllocator<Point*> > PointList;
+
+// Maps points onto their copies when an index is cloned over replicated point data
+typedef std::unordered_map<const Point*, Point*> PointMap;
+
+// Max-heap of search results keyed by rank
+typedef std::priority_queue<Point*, std::vector<Point*>, PointRankCompare> ResultQueue;
+
+const int ID_DOMAIN = 10000;                             // Point ids fall in [0, ID_DOMAIN)
+const int ID_BUCKET_WIDTH = (ID_DOMAIN + 63) / 64;       // Ids per bucket of an IdSummary / IdFilter bitmap
+
+// Compact summary of the ids stored beneath an index node: their range plus a bitmap of which 64th of the id domain they fall in
+struct IdSummary
 {
-    float lx;
-    float ly;
-    float hx;
-    float hy;
+    short min_id;
+    short max_id;
+    uint64_t buckets;
     
-    Rect() {
+    IdSummary() : min_id(32767), max_id(-32768), buckets(0) {}
+};
+
+// Predicate on Point::id for filtered searches: an inclusive id range, optionally narrowed to a sorted set of ids
+struct IdFilter
+{
+    short min_id;
+    short max_id;
+    uint64_t buckets;        // Which 64ths of the id domain (ID_BUCKET_WIDTH ids each) an accepted id can fall in
+    std::vector<short> ids;  // Accepted ids, sorted; empty accepts the whole range
+    
+    IdFilter() : min_id(-32768), max_id(32767), buckets(~0ULL) {}
+};
+
+// Axis aligned rectangle, templated on its coordinate type: float for the point engines, integer keys in KeyTree.h
+template <typename T>
+struct BasicRect
+{
+    T lx;
+    T ly;
+    T hx;
+    T hy;
+    
+    BasicRect() {
         lx = 0;
         ly = 0;
         hx = 0;
         hy = 0;
     }
     
-    Rect(float lx, float hx, float ly, float hy) : lx(lx), hx(hx), ly(ly), hy(hy) {}
-    Rect(const Rect& other) { lx = other.lx; ly = other.ly; hx = other.hx; hy = other.hy; }
+    BasicRect(T lx, T hx, T ly, T hy) : lx(lx), ly(ly), hx(hx), hy(hy) {}
+};
+
+typedef BasicRect<float> Rect;
+
+// Histogram of point counts over a w x h grid of equal cells covering rect. Cell (x, y) is counts[y * w + x]
+struct DensityGrid
+{
+    Rect rect;
+    int w;
+    int h;
+    float sx;  // Cells per unit along X
+    float sy;  // Cells per unit along Y
+    std::vector<int> counts;
+    
+    DensityGrid() : w(0), h(0), sx(0), sy(0) {}
 };
 
 #endif
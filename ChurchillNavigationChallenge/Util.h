@@ -9,10 +9,13 @@
 #ifndef ChurchillNavigationChallenge_Util_h
 #define ChurchillNavigationChallenge_Util_h
 
+#include <stdint.h>
+#include <algorithm>
 #include "Shared.h"
 
 // true if r1 intersects r2
-static bool inline rects_intersect(const Rect& r1, const Rect& r2) {
+template <typename T>
+static bool inline rects_intersect(const BasicRect<T>& r1, const BasicRect<T>& r2) {
     if (r2.lx > r1.hx || r2.ly > r1.hy || r2.hx < r1.lx || r2.hy < r1.ly)
         return false;
     
@@ -20,7 +23,8 @@ static bool inline rects_intersect(const Rect& r1, const Rect& r2) {
 }
 
 // true if r1 fully contains r2
-static bool inline rects_contained(const Rect& r1, const Rect& r2) {
+template <typename T>
+static bool inline rects_contained(const BasicRect<T>& r1, const BasicRect<T>& r2) {
     if ((r1.lx <= r2.lx && r1.hx >= r2.hx) && r1.ly <= r2.ly && r1.hy >= r2.hy) return true;
     
     return false;
@@ -31,6 +35,208 @@ static bool inline pt_contained(const Rect& r, const Point& p) {
     return (r.lx <= p.x && r.hx >= p.x) && (r.ly <= p.y && r.hy >= p.y);
 }
 
+// Low edge of r along Axis (0 = x, 1 = y)
+template <int Axis, typename T>
+static inline T rect_lo(const BasicRect<T>& r) {
+    return Axis == 0 ? r.lx : r.ly;
+}
+
+// High edge of r along Axis (0 = x, 1 = y)
+template <int Axis, typename T>
+static inline T rect_hi(const BasicRect<T>& r) {
+    return Axis == 0 ? r.hx : r.hy;
+}
+
+// Coordinate of p along Axis (0 = x, 1 = y)
+template <int Axis>
+static inline float pt_coord(const Point& p) {
+    return Axis == 0 ? p.x : p.y;
+}
+
+// Size grid to w x h empty cells covering rect
+static inline void density_grid_init(DensityGrid& grid, const Rect& rect, int w, int h) {
+    grid.rect = rect;
+    grid.w = std::max(1, w);
+    grid.h = std::max(1, h);
+    grid.sx = rect.hx > rect.lx ? grid.w / (rect.hx - rect.lx) : 0;
+    grid.sy = rect.hy > rect.ly ? grid.h / (rect.hy - rect.ly) : 0;
+    grid.counts.assign(grid.w * grid.h, 0);
+}
+
+// Column / row of the cell holding coordinate v. Monotone in v, so every point in a node whose corners share a
+// cell lands in that cell too. Only meaningful for coordinates inside the grid's rect
+static inline int density_grid_col(const DensityGrid& grid, float x) {
+    return std::min(grid.w - 1, (int)((x - grid.rect.lx) * grid.sx));
+}
+
+static inline int density_grid_row(const DensityGrid& grid, float y) {
+    return std::min(grid.h - 1, (int)((y - grid.rect.ly) * grid.sy));
+}
+
+// Count a single point into the grid if the grid's rect contains it
+static inline void density_grid_add(DensityGrid& grid, const Point& p) {
+    if (pt_contained(grid.rect, p))
+        grid.counts[density_grid_row(grid, p.y) * grid.w + density_grid_col(grid, p.x)]++;
+}
+
+// Add n points to the cell holding all of bounds and return true, or return false if bounds spans more than one
+// cell or isn't inside the grid's rect
+static inline bool density_grid_add_node(DensityGrid& grid, const Rect& bounds, int n) {
+    if (!rects_contained(grid.rect, bounds))
+        return false;
+    
+    int col = density_grid_col(grid, bounds.lx), row = density_grid_row(grid, bounds.ly);
+    if (col != density_grid_col(grid, bounds.hx) || row != density_grid_row(grid, bounds.hy))
+        return false;
+    
+    grid.counts[row * grid.w + col] += n;
+    return true;
+}
+
+// Bucket of an id in IdSummary / IdFilter bitmaps. Buckets are consecutive slices of the id domain, so a range of ids
+// sets a contiguous run of bits. Ids outside the domain share the edge buckets
+static inline int id_bucket_index(short id) {
+    return std::min(63, std::max(0, (int)id / ID_BUCKET_WIDTH));
+}
+
+static inline uint64_t id_bucket(short id) {
+    return 1ULL << id_bucket_index(id);
+}
+
+// Fold one id into a summary
+static inline void id_summary_add(IdSummary& summary, short id) {
+    if (id < summary.min_id) summary.min_id = id;
+    if (id > summary.max_id) summary.max_id = id;
+    summary.buckets |= id_bucket(id);
+}
+
+// Fold a child's summary into its parent's
+static inline void id_summary_merge(IdSummary& summary, const IdSummary& child) {
+    if (child.min_id < summary.min_id) summary.min_id = child.min_id;
+    if (child.max_id > summary.max_id) summary.max_id = child.max_id;
+    summary.buckets |= child.buckets;
+}
+
+// Filter accepting ids in [min_id, max_id]
+static inline IdFilter id_filter_range(short min_id, short max_id) {
+    IdFilter filter;
+    filter.min_id = min_id;
+    filter.max_id = max_id;
+    
+    // Every bucket from the one holding min_id to the one holding max_id
+    if (min_id > max_id) {
+        filter.buckets = 0;
+    } else {
+        int lo = id_bucket_index(min_id), hi = id_bucket_index(max_id);
+        filter.buckets = hi - lo == 63 ? ~0ULL : ((1ULL << (hi - lo + 1)) - 1) << lo;
+    }
+    return filter;
+}
+
+// Filter accepting only the given ids
+static inline IdFilter id_filter_set(const std::vector<short>& ids) {
+    IdFilter filter;
+    filter.ids = ids;
+    std::sort(filter.ids.begin(), filter.ids.end());
+    filter.ids.erase(std::unique(filter.ids.begin(), filter.ids.end()), filter.ids.end());
+    
+    filter.buckets = 0;
+    filter.min_id = filter.ids.size() > 0 ? filter.ids.front() : 1;
+    filter.max_id = filter.ids.size() > 0 ? filter.ids.back() : 0;
+    for (size_t i = 0; i < filter.ids.size(); i++) {
+        filter.buckets |= id_bucket(filter.ids[i]);
+    }
+    return filter;
+}
+
+// true if the filter accepts id
+static inline bool id_filter_matches(const IdFilter& filter, short id) {
+    if (id < filter.min_id || id > filter.max_id || (filter.buckets & id_bucket(id)) == 0)
+        return false;
+    return filter.ids.size() == 0 || std::binary_search(filter.ids.begin(), filter.ids.end(), id);
+}
+
+// false if no id under a node with this summary can pass the filter, so the whole subtree can be skipped
+static inline bool id_filter_may_match(const IdFilter& filter, const IdSummary& summary) {
+    return summary.min_id <= filter.max_id && summary.max_id >= filter.min_id && (summary.buckets & filter.buckets) != 0;
+}
+
+// Number of explicit stack entries ahead of the current node whose node (and, one step later, point block)
+// the iterative searches prefetch. 0 disables prefetching
+const int SEARCH_PREFETCH_DISTANCE = 2;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SEARCH_PREFETCH(addr) __builtin_prefetch((const void*)(addr), 0, 3)
+#else
+#define SEARCH_PREFETCH(addr)
+#endif
+
+// Queries the interleaved searches keep in flight on one thread. Each step of a query prefetches what its next step
+// touches and moves on to the next query, so it wants enough queries to cover a DRAM miss. 1 runs them one at a time
+const int SEARCH_INTERLEAVE_GROUP = 8;
+
+// Points an interleaved search step scans before yielding. The points behind a node's pointer block are scattered,
+// so a step prefetches the next chunk's points while the other queries run
+const int SEARCH_INTERLEAVE_CHUNK = 8;
+
+// Prefetch the points pts[begin, end) point to
+template <typename P>
+static inline void prefetch_points(P* const* pts, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+        SEARCH_PREFETCH(pts[i]);
+    }
+}
+
+// Offer a point to a top K results queue, keeping only the K lowest ranks.
+// Returns false if the point ranks too high to get in
+template <int K>
+static inline bool results_offer(ResultQueue& results, Point* p) {
+    if (results.size() < K) {
+        results.push(p);
+        return true;
+    }
+    else if (results.top()->rank > p->rank) {
+        results.pop();
+        results.push(p);
+        return true;
+    }
+    return false;
+}
+
+// Spread the low 16 bits of v out to the even bits of the result
+static inline uint32_t morton_spread(uint32_t v) {
+    v &= 0x0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+// Z-order (Morton) code of the center of rect r, quantized to 16 bits per axis within bounds
+static inline uint32_t rect_morton_code(const Rect& r, const Rect& bounds) {
+    float cx = ((r.lx + r.hx) / 2 - bounds.lx) / (bounds.hx - bounds.lx);
+    float cy = ((r.ly + r.hy) / 2 - bounds.ly) / (bounds.hy - bounds.ly);
+    cx = std::min(std::max(cx, 0.0f), 1.0f);
+    cy = std::min(std::max(cy, 0.0f), 1.0f);
+    return morton_spread((uint32_t)(cx * 65535)) | (morton_spread((uint32_t)(cy * 65535)) << 1);
+}
+
+// Fill order with the indices of queries sorted by the Morton code of their centers, so queries
+// that are near each other in space are near each other in the batch
+static inline void morton_sort_queries(const std::vector<Rect>& queries, const Rect& bounds, std::vector<int>& order) {
+    std::vector<std::pair<uint32_t, int> > keyed(queries.size());
+    for (size_t i = 0; i < queries.size(); i++) {
+        keyed[i] = std::make_pair(rect_morton_code(queries[i], bounds), i);
+    }
+    std::sort(keyed.begin(), keyed.end());
+    
+    order.resize(queries.size());
+    for (size_t i = 0; i < keyed.size(); i++) {
+        order[i] = keyed[i].second;
+    }
+}
+
 static inline void print_point(const Point& p) {
     printf("[Point x=%f y=%f]\n", p.x, p.y);
 }
@@ -0,0 +1,599 @@
+//
+//  Verify.h
+//  ChurchillNavigationChallenge
+//
+//  Created by Eric Campbell on 2/14/15.
+//  Copyright (c) 2015 ECC. All rights reserved.
+//
+//
+//
+//  Differential correctness checks for the search engines. Every engine is compared against a
+//  brute force oracle, rank by rank, on randomized and adversarial point sets and queries.
+//  Run with `ChurchillNavigationChallenge --verify [cases] [seed]`, or build with -DFUZZ_SEARCH
+//  and -fsanitize=fuzzer to drive verify_fuzz_one() from libFuzzer.
+
+#ifndef ChurchillNavigationChallenge_Verify_h
+#define ChurchillNavigationChallenge_Verify_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "Shared.h"
+#include "Util.h"
+#include "QuadTree.h"
+#include "KdTree.h"
+#include "Gen.h"
+#include "Numa.h"
+#include "KeyTree.h"
+#include "Wavelet.h"
+#include "WideTree.h"
+#include "Delta.h"
+#include "IdIndex.h"
+
+const int VERIFY_LARGE_K = 100; // Second result count the templated searches are checked at
+
+// Kinds of point sets generated for a verification case
+enum VerifyPointSet {
+    VERIFY_UNIFORM = 0,     // Uniform random floats over the whole range
+    VERIFY_DUPLICATES,      // Only a handful of distinct coordinates, lots of exact duplicates
+    VERIFY_SPLIT_LINES,     // Coordinates snapped to QuadTree split lines and the range edges
+    VERIFY_CLUSTERED,       // Everything packed into a tiny cell so the trees hit their max depth
+    VERIFY_TINY,            // 0 - 40 points, around the node capacity
+    VERIFY_NUM_POINT_SETS
+};
+
+// A single verification case: a rank sorted point set and the queries to run against it
+struct VerifyCase {
+    std::vector<Point*> points;
+    std::vector<Rect> queries;
+};
+
+// Pop a results queue into a vector ordered by ascending rank
+static inline void verify_sorted_results(ResultQueue results, std::vector<Point*>& out) {
+    out.clear();
+    while (results.size() > 0) {
+        out.push_back(results.top());
+        results.pop();
+    }
+    std::reverse(out.begin(), out.end());
+}
+
+// Brute force oracle: the k lowest ranked points contained in the query, ascending by rank
+static inline void verify_oracle(const std::vector<Point*>& points, const Rect& query, std::vector<Point*>& out, int k = SEARCH_MAX_RESULTS) {
+    out.clear();
+    for (size_t i = 0; i < points.size(); i++) {
+        if (pt_contained(query, *points[i]))
+            out.push_back(points[i]);
+    }
+    std::sort(out.begin(), out.end(), kd_compare_pts_rank);
+    if (out.size() > (size_t)k)
+        out.resize(k);
+}
+
+// Compare an engine's results to the oracle, printing the first mismatch. Returns true if they match
+static inline bool verify_compare(const char* engine, const Rect& query, const std::vector<Point*>& expected, const std::vector<Point*>& actual) {
+    if (expected.size() != actual.size()) {
+        printf("MISMATCH %s: expected %d results, got %d\n", engine, (int)expected.size(), (int)actual.size());
+        printf("[Rect  %f %f  %f %f]\n", query.lx, query.hx, query.ly, query.hy);
+        return false;
+    }
+
+    for (size_t i = 0; i < expected.size(); i++) {
+        if (expected[i]->rank != actual[i]->rank) {
+            printf("MISMATCH %s: result %d expected rank %d, got rank %d\n", engine, i, expected[i]->rank, actual[i]->rank);
+            printf("[Rect  %f %f  %f %f]\n", query.lx, query.hx, query.ly, query.hy);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Check one engine's top k results queue for query against the oracle. Returns true if they match
+static inline bool verify_results(const char* engine, const std::vector<Point*>& points, const Rect& query, const ResultQueue& results, int k = SEARCH_MAX_RESULTS) {
+    std::vector<Point*> expected, actual;
+    verify_oracle(points, query, expected, k);
+    verify_sorted_results(results, actual);
+    return verify_compare(engine, query, expected, actual);
+}
+
+// Run one query through every engine and check each against the oracle. Returns the number of engines that disagreed
+static inline int verify_query(const std::vector<Point*>& points, QuadTree* qt, KdTree* kdt, const Rect& query) {
+    int failures = 0;
+    int ct = 0;
+
+    ResultQueue qt_results;
+    quadtree_search(qt, query, qt_results, ct);
+    if (!verify_results("QuadTree", points, query, qt_results))
+        failures++;
+
+    ResultQueue kd_results;
+    kdtree_search(kdt, query, kd_results, ct);
+    if (!verify_results("KdTree", points, query, kd_results))
+        failures++;
+
+    // Specialized top 100 searches
+    ResultQueue qt_large_results;
+    quadtree_search<VERIFY_LARGE_K>(qt, query, qt_large_results, ct);
+    if (!verify_results("QuadTree K=100", points, query, qt_large_results, VERIFY_LARGE_K))
+        failures++;
+
+    ResultQueue kd_large_results;
+    kdtree_search<VERIFY_LARGE_K>(kdt, query, kd_large_results, ct);
+    if (!verify_results("KdTree K=100", points, query, kd_large_results, VERIFY_LARGE_K))
+        failures++;
+
+    ResultQueue qt_ranked_results;
+    quadtree_search_ranked(qt, query, qt_ranked_results, ct);
+    if (!verify_results("QuadTree ranked", points, query, qt_ranked_results))
+        failures++;
+
+    ResultQueue qt_prefetch_results;
+    quadtree_search_prefetch(qt, query, qt_prefetch_results, ct);
+    if (!verify_results("QuadTree prefetch", points, query, qt_prefetch_results))
+        failures++;
+
+    ResultQueue kd_prefetch_results;
+    kdtree_search_prefetch(kdt, query, kd_prefetch_results, ct);
+    if (!verify_results("KdTree prefetch", points, query, kd_prefetch_results))
+        failures++;
+
+    return failures;
+}
+
+// Run one query and id filter through the filtered engines and the id index's postings, whatever the filter's size,
+// and check each against a filtered oracle. Returns the number of engines that disagreed
+static inline int verify_filtered(const std::vector<Point*>& points, QuadTree* qt, KdTree* kdt, const IdIndex* id_index,
+                                  const Rect& query, const IdFilter& filter) {
+    std::vector<Point*> expected, actual;
+    for (size_t i = 0; i < points.size(); i++) {
+        if (pt_contained(query, *points[i]) && id_filter_matches(filter, points[i]->id))
+            expected.push_back(points[i]);
+    }
+    std::sort(expected.begin(), expected.end(), kd_compare_pts_rank);
+    if (expected.size() > SEARCH_MAX_RESULTS)
+        expected.resize(SEARCH_MAX_RESULTS);
+
+    int failures = 0;
+    int ct = 0;
+
+    ResultQueue qt_results;
+    quadtree_search_filtered(qt, query, filter, qt_results, ct);
+    verify_sorted_results(qt_results, actual);
+    if (!verify_compare("QuadTree filtered", query, expected, actual))
+        failures++;
+
+    ResultQueue kd_results;
+    kdtree_search_filtered(kdt, query, filter, kd_results, ct);
+    verify_sorted_results(kd_results, actual);
+    if (!verify_compare("KdTree filtered", query, expected, actual))
+        failures++;
+
+    ResultQueue id_results;
+    id_index_search(id_index, query, filter, id_results, ct, points.size());
+    verify_sorted_results(id_results, actual);
+    if (!verify_compare("Id index", query, expected, actual))
+        failures++;
+
+    return failures;
+}
+
+// Check both engines' counts and density grids for query against brute force. Returns the number of mismatches
+static inline int verify_count(const std::vector<Point*>& points, QuadTree* qt, KdTree* kdt, const Rect& query) {
+    int expected = 0;
+    DensityGrid expected_grid, grid;
+    density_grid_init(expected_grid, query, 7, 5);
+    for (size_t i = 0; i < points.size(); i++) {
+        if (pt_contained(query, *points[i]))
+            expected++;
+        density_grid_add(expected_grid, *points[i]);
+    }
+
+    int failures = 0;
+    int qt_ct = quadtree_count(qt, query), kd_ct = kdtree_count(kdt, query);
+    if (qt_ct != expected) {
+        printf("MISMATCH QuadTree count: expected %d, got %d\n", expected, qt_ct);
+        failures++;
+    }
+    if (kd_ct != expected) {
+        printf("MISMATCH KdTree count: expected %d, got %d\n", expected, kd_ct);
+        failures++;
+    }
+
+    quadtree_density_grid(qt, query, 7, 5, grid);
+    if (grid.counts != expected_grid.counts) {
+        printf("MISMATCH QuadTree density grid\n");
+        failures++;
+    }
+    kdtree_density_grid(kdt, query, 7, 5, grid);
+    if (grid.counts != expected_grid.counts) {
+        printf("MISMATCH KdTree density grid\n");
+        failures++;
+    }
+
+    if (failures > 0)
+        printf("[Rect  %f %f  %f %f]\n", query.lx, query.hx, query.ly, query.hy);
+    return failures;
+}
+
+// Run all queries through the batched engines in Morton order and check each against the oracle.
+// Returns the number of failed engine/query pairs
+static inline int verify_batch(const std::vector<Point*>& points, QuadTree* qt, KdTree* kdt, const std::vector<Rect>& queries) {
+    std::vector<int> order;
+    morton_sort_queries(queries, Rect(0, MAX_PT_RANGE, 0, MAX_PT_RANGE), order);
+
+    std::vector<ResultQueue> qt_results(queries.size()), kd_results(queries.size());
+    for (size_t i = 0; i < order.size(); i += SEARCH_BATCH_SIZE) {
+        int batch_size = std::min(SEARCH_BATCH_SIZE, (int)(order.size() - i));
+        quadtree_search_batch(qt, queries, &order[i], batch_size, qt_results);
+        kdtree_search_batch(kdt, queries, &order[i], batch_size, kd_results);
+    }
+
+    int failures = 0;
+    for (size_t i = 0; i < queries.size(); i++) {
+        if (!verify_results("QuadTree batch", points, queries[i], qt_results[i]))
+            failures++;
+        if (!verify_results("KdTree batch", points, queries[i], kd_results[i]))
+            failures++;
+    }
+    return failures;
+}
+
+// Run all queries through the interleaved engines at a few group sizes and check each against the oracle.
+// Returns the number of failed engine/query pairs
+static inline int verify_interleaved(const std::vector<Point*>& points, QuadTree* qt, KdTree* kdt, const std::vector<Rect>& queries) {
+    const int groups[] = { 1, 3, SEARCH_INTERLEAVE_GROUP };
+    int failures = 0;
+    for (int g = 0; g < 3; g++) {
+        std::vector<ResultQueue> qt_results, kd_results;
+        int ct = 0;
+        quadtree_search_interleaved(qt, queries, qt_results, ct, groups[g]);
+        kdtree_search_interleaved(kdt, queries, kd_results, ct, groups[g]);
+        
+        for (size_t i = 0; i < queries.size(); i++) {
+            if (!verify_results("QuadTree interleaved", points, queries[i], qt_results[i]))
+                failures++;
+            if (!verify_results("KdTree interleaved", points, queries[i], kd_results[i]))
+                failures++;
+        }
+    }
+    return failures;
+}
+
+// True if two quadtrees have identical structure, bounds and point order
+static bool verify_same_quadtree(QuadTree* a, QuadTree* b) {
+    if ((a == 0) != (b == 0))
+        return false;
+    if (a == 0)
+        return true;
+
+    if (a->depth != b->depth || a->min_rank != b->min_rank || a->count != b->count || a->pts.size() != b->pts.size())
+        return false;
+    if (a->ids.min_id != b->ids.min_id || a->ids.max_id != b->ids.max_id || a->ids.buckets != b->ids.buckets)
+        return false;
+    if (a->bounds.lx != b->bounds.lx || a->bounds.hx != b->bounds.hx || a->bounds.ly != b->bounds.ly || a->bounds.hy != b->bounds.hy)
+        return false;
+
+    for (size_t i = 0; i < a->pts.size(); i++) {
+        if (a->pts[i] != b->pts[i])
+            return false;
+    }
+
+    return verify_same_quadtree(a->nw, b->nw) && verify_same_quadtree(a->ne, b->ne) &&
+           verify_same_quadtree(a->sw, b->sw) && verify_same_quadtree(a->se, b->se);
+}
+
+// Check delta_search against the oracle over the live points
+static inline int verify_delta_queries(DeltaIndex* index, const std::vector<Point*>& live, const std::vector<Rect>& queries) {
+    int failures = 0;
+    for (size_t i = 0; i < queries.size(); i++) {
+        ResultQueue results;
+        int ct = 0;
+        delta_search(index, queries[i], results, ct);
+        if (!verify_results("Delta", live, queries[i], results))
+            failures++;
+    }
+    return failures;
+}
+
+// Apply rounds of deletes, rank changes and inserts to an updatable index, checking every query before and after
+// each compaction. New ranks count down from -1 so updated points outrank everything and land in the results
+static int verify_delta(const VerifyCase& vc) {
+    DeltaIndex* index = delta_index_create(vc.points, false);
+    std::vector<Point*> live(vc.points);
+    int next_rank = -1;
+    int failures = 0;
+
+    for (int round = 0; round < 3; round++) {
+        int ops = (int)live.size() / 4;
+        for (int k = 0; k < ops && live.size() > 0; k++) {
+            size_t j = ((size_t)k * 7919 + round) % live.size();
+            if (k % 3 == 0) {
+                delta_remove(index, live[j]);
+                live[j] = live.back();
+                live.pop_back();
+            }
+            else if (k % 3 == 1) {
+                live[j] = delta_update_rank(index, live[j], next_rank--);
+            }
+            else {
+                Point p(*live[j]);
+                p.rank = next_rank--;
+                live.push_back(delta_insert(index, p));
+            }
+        }
+
+        failures += verify_delta_queries(index, live, vc.queries);
+        delta_compact(index);
+        failures += verify_delta_queries(index, live, vc.queries);
+    }
+
+    std::vector<Point*> index_live;
+    delta_live_points(index, index_live);
+    if (index_live.size() != live.size()) {
+        printf("Delta: %d live points, expected %d\n", (int)index_live.size(), (int)live.size());
+        failures++;
+    }
+
+    delta_index_delete(index);
+    return failures;
+}
+
+// Build both engines over the case's points, run every query and tear everything down again.
+// Returns the number of failed engine/query pairs
+static int verify_case(VerifyCase& vc) {
+    QuadTree* qt = quadtree_construct(Rect(0, MAX_PT_RANGE, 0, MAX_PT_RANGE), 0);
+    int insert_ct = 0;
+    quadtree_insert(qt, vc.points, insert_ct);
+
+    // kdtree_insert reorders its input, so give it a copy
+    std::vector<Point*> kd_points(vc.points);
+    KdTree* kdt = kdtree_construct(Rect(0, MAX_PT_RANGE, 0, MAX_PT_RANGE), 0);
+    kdtree_insert(kdt, kd_points);
+
+    int failures = 0;
+
+    // The parallel builder must reproduce the sequential tree exactly
+    QuadTree* qt_parallel = quadtree_construct(Rect(0, MAX_PT_RANGE, 0, MAX_PT_RANGE), 0);
+    quadtree_build(qt_parallel, vc.points, insert_ct, 2);
+    if (!verify_same_quadtree(qt, qt_parallel)) {
+        printf("MISMATCH QuadTree parallel build\n");
+        failures++;
+    }
+    quadtree_delete(qt_parallel);
+
+    for (size_t i = 0; i < vc.queries.size(); i++) {
+        failures += verify_query(vc.points, qt, kdt, vc.queries[i]);
+    }
+    failures += verify_batch(vc.points, qt, kdt, vc.queries);
+    failures += verify_interleaved(vc.points, qt, kdt, vc.queries);
+
+    // Id filters: a wide range, a narrow range, ranges running off either end of the id domain,
+    // a set drawn from the case's own ids, and an empty set
+    std::vector<IdFilter> filters;
+    short first_id = vc.points.size() > 0 ? vc.points[0]->id : 0;
+    filters.push_back(id_filter_range(0, 999));
+    filters.push_back(id_filter_range(first_id, first_id + 20));
+    filters.push_back(id_filter_range(-500, 100));
+    filters.push_back(id_filter_range(ID_DOMAIN - 100, ID_DOMAIN + 500));
+    std::vector<short> ids;
+    for (size_t i = 0; i < vc.points.size() && ids.size() < 8; i += 1 + vc.points.size() / 8) {
+        ids.push_back(vc.points[i]->id);
+    }
+    filters.push_back(id_filter_set(ids));
+    filters.push_back(id_filter_set(std::vector<short>()));
+
+    IdIndex* id_index = id_index_build(vc.points);
+    for (size_t i = 0; i < vc.queries.size(); i++) {
+        for (size_t f = 0; f < filters.size(); f++) {
+            failures += verify_filtered(vc.points, qt, kdt, id_index, vc.queries[i], filters[f]);
+        }
+        failures += verify_count(vc.points, qt, kdt, vc.queries[i]);
+    }
+    id_index_delete(id_index);
+
+    // The integer key index must select exactly what the float engines do, at either key width
+    for (int key_bits = 16; key_bits <= 32; key_bits += 16) {
+        KeyTree* keyt = keytree_build(vc.points, key_bits);
+        for (size_t i = 0; i < vc.queries.size(); i++) {
+            ResultQueue key_results;
+            int ct = 0;
+            keytree_search(keyt, vc.queries[i], key_results, ct);
+            if (!verify_results("KeyTree", vc.points, vc.queries[i], key_results))
+                failures++;
+        }
+        keytree_delete(keyt);
+    }
+
+    // So must the wavelet index, walking candidates in rank order instead of pruning a tree
+    WaveletIndex* wt = wavelet_build(vc.points);
+    for (size_t i = 0; i < vc.queries.size(); i++) {
+        ResultQueue wavelet_results;
+        int ct = 0;
+        wavelet_search(wt, vc.queries[i], wavelet_results, ct);
+        if (!verify_results("Wavelet", vc.points, vc.queries[i], wavelet_results))
+            failures++;
+    }
+    wavelet_delete(wt);
+
+    // And the wide tree, pruning up to 8 children per node from one mask
+    WideTree* wide = widetree_build(vc.points);
+    for (size_t i = 0; i < vc.queries.size(); i++) {
+        ResultQueue wide_results;
+        int ct = 0;
+        widetree_search(wide, vc.queries[i], wide_results, ct);
+        if (!verify_results("WideTree", vc.points, vc.queries[i], wide_results))
+            failures++;
+    }
+    widetree_delete(wide);
+
+    failures += verify_delta(vc);
+
+    // Arena backed replicas must answer exactly like the trees they were cloned from
+    IndexReplica* replica = index_replicate(vc.points, qt, kdt, -1, false);
+    for (size_t i = 1; i < replica->num_points; i++) {
+        if (replica->points[i - 1].rank > replica->points[i].rank) {
+            printf("MISMATCH Replica: points out of rank order at %d\n", (int)i);
+            failures++;
+            break;
+        }
+    }
+    for (size_t i = 0; i < vc.queries.size(); i++) {
+        failures += verify_query(vc.points, replica->qt, replica->kdt, vc.queries[i]);
+    }
+    index_replica_delete(replica);
+
+    quadtree_delete(qt);
+    kdtree_delete(kdt);
+
+    for (size_t i = 0; i < vc.points.size(); i++) {
+        delete vc.points[i];
+    }
+    vc.points.clear();
+    vc.queries.clear();
+
+    return failures;
+}
+
+// Random coordinate for the given point set kind, always inside [0, MAX_PT_RANGE]
+static inline float verify_coord(VerifyPointSet kind, std::mt19937& rng, float cluster) {
+    std::uniform_real_distribution<float> uniform(0, MAX_PT_RANGE);
+
+    switch (kind) {
+        case VERIFY_DUPLICATES:
+            return (float)(MAX_PT_RANGE / 8) * (rng() % 9);
+        case VERIFY_SPLIT_LINES: {
+            // Any multiple of MAX_PT_RANGE / 2^depth lies on a QuadTree split line at that depth
+            int depth = rng() % 6;
+            int cells = 1 << depth;
+            return (float)MAX_PT_RANGE / cells * (rng() % (cells + 1));
+        }
+        case VERIFY_CLUSTERED:
+            return cluster + (rng() % 4) * 0.0001f;
+        default:
+            return uniform(rng);
+    }
+}
+
+// Generate a case: points are allocated in shuffled order so heap addresses don't follow rank,
+// then stored sorted by rank as the engines expect
+static void verify_generate_case(VerifyPointSet kind, std::mt19937& rng, VerifyCase& vc) {
+    int ct;
+    if (kind == VERIFY_TINY)
+        ct = rng() % 41;
+    else
+        ct = 200 + rng() % 4000;
+
+    std::vector<int> ranks(ct);
+    for (int i = 0; i < ct; i++) ranks[i] = i;
+    std::shuffle(ranks.begin(), ranks.end(), rng);
+
+    float cluster_x = (float)(rng() % MAX_PT_RANGE);
+    float cluster_y = (float)(rng() % MAX_PT_RANGE);
+
+    vc.points.resize(ct);
+    for (int i = 0; i < ct; i++) {
+        Point* p = new Point();
+        p->id = rng() % 10000;
+        p->rank = ranks[i];
+        p->x = verify_coord(kind, rng, cluster_x);
+        p->y = verify_coord(kind, rng, cluster_y);
+        vc.points[ranks[i]] = p;
+    }
+
+    std::uniform_real_distribution<float> wide(-MAX_PT_RANGE / 4, MAX_PT_RANGE * 1.25f);
+
+    for (int i = 0; i < 64; i++) {
+        float x1 = wide(rng), x2 = wide(rng), y1 = wide(rng), y2 = wide(rng);
+        vc.queries.push_back(Rect(std::min(x1, x2), std::max(x1, x2), std::min(y1, y2), std::max(y1, y2)));
+    }
+
+    // Zero-area rects sitting exactly on existing points
+    for (int i = 0; i < 16 && ct > 0; i++) {
+        Point* p = vc.points[rng() % ct];
+        vc.queries.push_back(Rect(p->x, p->x, p->y, p->y));
+    }
+
+    // Zero-width and zero-height lines along the root split lines
+    const float mid = MAX_PT_RANGE / 2;
+    vc.queries.push_back(Rect(mid, mid, 0, MAX_PT_RANGE));
+    vc.queries.push_back(Rect(0, MAX_PT_RANGE, mid, mid));
+    vc.queries.push_back(Rect(mid, mid, mid, mid));
+
+    // Rects exactly matching node bounds, the whole range, and beyond it
+    vc.queries.push_back(Rect(0, mid, 0, mid));
+    vc.queries.push_back(Rect(mid, MAX_PT_RANGE, mid, MAX_PT_RANGE));
+    vc.queries.push_back(Rect(0, MAX_PT_RANGE, 0, MAX_PT_RANGE));
+    vc.queries.push_back(Rect(-MAX_PT_RANGE, MAX_PT_RANGE * 2, -MAX_PT_RANGE, MAX_PT_RANGE * 2));
+
+    // Rects entirely outside the bounds
+    vc.queries.push_back(Rect(MAX_PT_RANGE + 1, MAX_PT_RANGE * 2, 0, MAX_PT_RANGE));
+    vc.queries.push_back(Rect(-MAX_PT_RANGE, -1, -MAX_PT_RANGE, -1));
+
+    // Tiny rects around the cluster for the depth-limited case
+    vc.queries.push_back(Rect(cluster_x, cluster_x + 0.0002f, cluster_y, cluster_y + 0.0002f));
+    vc.queries.push_back(Rect(cluster_x - 1, cluster_x, cluster_y - 1, cluster_y));
+}
+
+// Run the randomized/adversarial suite. Returns the number of failed engine/query pairs
+static int verify_run(int num_cases, unsigned int seed) {
+    std::mt19937 rng(seed);
+    int failures = 0;
+    int num_queries = 0;
+
+    for (int i = 0; i < num_cases; i++) {
+        VerifyCase vc;
+        VerifyPointSet kind = (VerifyPointSet)(i % VERIFY_NUM_POINT_SETS);
+        verify_generate_case(kind, rng, vc);
+        num_queries += vc.queries.size();
+
+        int case_failures = verify_case(vc);
+        if (case_failures > 0)
+            printf("Case %d (point set %d, seed %u): %d failures\n", i, kind, seed, case_failures);
+        failures += case_failures;
+    }
+
+    printf("Verify: %d cases, %d queries, %d failures\n", num_cases, num_queries, failures);
+    return failures;
+}
+
+#ifdef FUZZ_SEARCH
+// Build a case straight from fuzzer bytes. Coordinates are quantized to 1/4 units so the fuzzer hits
+// duplicates and split lines easily. The first byte splits the input between points and queries.
+// Aborts on any mismatch so libFuzzer records the input
+static int verify_fuzz_one(const uint8_t* data, size_t size) {
+    if (size < 1)
+        return 0;
+
+    size_t num_points = (size - 1) * data[0] / 255 / 4;
+    const uint8_t* p = data + 1;
+    const uint8_t* end = data + size;
+
+    VerifyCase vc;
+    for (size_t i = 0; i < num_points && p + 4 <= end; i++, p += 4) {
+        Point* pt = new Point();
+        pt->rank = i;
+        pt->id = i % 97;
+        pt->x = ((p[0] | (p[1] << 8)) % (MAX_PT_RANGE * 4 + 1)) / 4.0f;
+        pt->y = ((p[2] | (p[3] << 8)) % (MAX_PT_RANGE * 4 + 1)) / 4.0f;
+        vc.points.push_back(pt);
+    }
+
+    for (; p + 8 <= end; p += 8) {
+        float v[4];
+        for (int j = 0; j < 4; j++)
+            v[j] = ((int)(p[j*2] | (p[j*2+1] << 8)) % (MAX_PT_RANGE * 6 + 1)) / 4.0f - MAX_PT_RANGE / 4;
+        vc.queries.push_back(Rect(std::min(v[0], v[1]), std::max(v[0], v[1]), std::min(v[2], v[3]), std::max(v[2], v[3])));
+    }
+
+    if (verify_case(vc) > 0)
+        abort();
+
+    return 0;
+}
+#endif
+
+#endif
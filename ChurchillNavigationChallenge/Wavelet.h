@@ -0,0 +1,559 @@
+//
+//  Wavelet.h
+//  ChurchillNavigationChallenge
+//
+//  Created by Eric Campbell on 2/20/15.
+//  Copyright (c) 2015 ECC. All rights reserved.
+//
+//
+//
+//  Succinct rank-space engine. With the points sorted by x, a query's x range is a contiguous slab of positions, and
+//  with y replaced by its y rank the query's y range is a contiguous range of values. A wavelet matrix over the y rank
+//  at each x position splits the slab into at most two ranges per level whose values all fall inside the y range.
+//  Every level also carries a range minimum structure over the points' ranks in that level's order, 2n + o(n) bits
+//  of balanced parentheses, so the lowest ranked point of any range comes out in O(1) and is traced to its y rank in
+//  O(log N). A heap over the ranges then reports the top K: O(log^2 N) to seed it, O(log N) per point reported,
+//  whatever the shape of the query or the data.
+//
+//  Space is n bits per level for the matrix and about 2.4n for its RMQ, with rank directories, plus one Point* per
+//  point (in y order) to hand results back and every 32nd coordinate per axis to translate queries. With log N levels
+//  that is O(log N) bits per point, not a constant few: at 50k points (16 levels) the levels take about 8 bytes per
+//  point and the whole index 16.4, against 11.5 for the KdTree. The bounds above hold for any query, but on the
+//  benchmark's uniform queries the constant factors lose: it runs about 4x slower than the KdTree.
+
+#ifndef ChurchillNavigationChallenge_Wavelet_h
+#define ChurchillNavigationChallenge_Wavelet_h
+
+#include <stdint.h>
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include "Shared.h"
+#include "Util.h"
+
+const int WAVELET_SELECT_SAMPLE = 256;  // Opening parentheses between select samples
+const int WAVELET_RMQ_BLOCK = 8;        // Words per block of the RMQ's block minima
+const int WAVELET_COORD_SAMPLE = 32;    // Positions between sampled coordinates
+
+// Set bits in a word. Without hardware popcount (-mpopcnt) the builtin is a library call, so count in registers
+static inline int wavelet_popcount(uint64_t x) {
+#ifdef __POPCNT__
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// Bitvector with constant time rank: a cumulative count every 4 words (256 bits)
+struct WaveletBits {
+    std::vector<uint64_t> words;
+    std::vector<uint32_t> counts;  // counts[i] = set bits before words[i * 4]
+};
+
+static void wavelet_bits_init(WaveletBits& bits, size_t n) {
+    bits.words.assign((n + 63) / 64 + 1, 0);
+}
+
+static void wavelet_bits_finish(WaveletBits& bits) {
+    bits.counts.resize(bits.words.size() / 4 + 1);
+    uint32_t total = 0;
+    for (size_t w = 0; w < bits.words.size(); w++) {
+        if (w % 4 == 0)
+            bits.counts[w / 4] = total;
+        total += wavelet_popcount(bits.words[w]);
+    }
+}
+
+static inline int wavelet_bit(const WaveletBits& bits, size_t i) {
+    return (int)((bits.words[i / 64] >> (i % 64)) & 1);
+}
+
+// Number of set bits in [0, i)
+static inline uint32_t wavelet_rank1(const WaveletBits& bits, size_t i) {
+    size_t w = i / 64;
+    uint32_t r = bits.counts[w / 4];
+    for (size_t k = w & ~(size_t)3; k < w; k++) {
+        r += wavelet_popcount(bits.words[k]);
+    }
+    if (i % 64)
+        r += wavelet_popcount(bits.words[w] << (64 - i % 64));
+    return r;
+}
+
+// Up to 8 bits starting at position i
+static inline unsigned wavelet_byte_at(const WaveletBits& bits, size_t i) {
+    uint64_t v = bits.words[i / 64] >> (i % 64);
+    if (i % 64 > 56)
+        v |= bits.words[i / 64 + 1] << (64 - i % 64);
+    return (unsigned)v & 0xFF;
+}
+
+// Range minimum queries over one sequence in 2n + o(n) bits. The sequence's 2d min-heap is written as balanced
+// parentheses: scanning left to right, each value closes the values above it that it is smaller than, then opens
+// its own. For i < j the minimum of [i, j] is i unless the excess dips below i's somewhere between the two opens;
+// then it is the value opened right after the rightmost lowest dip. The lowest excess of a range is found from
+// per-word and per-block minima, with a min tree over the blocks
+struct WaveletRmq {
+    WaveletBits parens;                  // 1 opens a value, 0 closes one
+    size_t length;                       // 2n
+    std::vector<uint32_t> open_samples;  // Position of every WAVELET_SELECT_SAMPLE-th open
+    std::vector<int8_t> word_min;        // Lowest excess in each word, relative to the excess before it
+    size_t blocks;                       // Full blocks of WAVELET_RMQ_BLOCK words, rounded up to a power of 2
+    std::vector<int32_t> block_tree;     // Lowest excess under each node of a complete binary tree over the blocks,
+                                         // block b at leaf blocks + b
+};
+
+// Lowest excess over the prefixes of the first len + 1 bits of a byte, the last prefix reaching it and the total
+struct WaveletByteTable {
+    int8_t min[8][256];
+    int8_t pos[8][256];
+    int8_t total[8][256];
+
+    WaveletByteTable() {
+        for (int len = 0; len < 8; len++) {
+            for (int v = 0; v < 256; v++) {
+                int e = 0;
+                min[len][v] = 8;
+                for (int b = 0; b <= len; b++) {
+                    e += (v >> b) & 1 ? 1 : -1;
+                    if (e <= min[len][v]) {
+                        min[len][v] = (int8_t)e;
+                        pos[len][v] = (int8_t)b;
+                    }
+                }
+                total[len][v] = (int8_t)e;
+            }
+        }
+    }
+};
+
+static const WaveletByteTable wavelet_byte_table;
+
+// Excess (opens minus closes) of the parentheses before position i
+static inline int wavelet_excess(const WaveletRmq& rmq, size_t i) {
+    return 2 * (int)wavelet_rank1(rmq.parens, i) - (int)i;
+}
+
+// Position of open number k
+static inline size_t wavelet_select_open(const WaveletRmq& rmq, size_t k) {
+    size_t p = rmq.open_samples[k / WAVELET_SELECT_SAMPLE];
+    size_t r = k % WAVELET_SELECT_SAMPLE;
+    size_t w = p / 64;
+    uint64_t word = rmq.parens.words[w] & (~0ULL << (p % 64));
+    for (size_t c = wavelet_popcount(word); r >= c; c = wavelet_popcount(word)) {
+        r -= c;
+        word = rmq.parens.words[++w];
+    }
+    for (; r > 0; r--) {
+        word &= word - 1;
+    }
+    return w * 64 + __builtin_ctzll(word);
+}
+
+// Scan the excess after each position in [from, to), starting at excess, keeping the rightmost lowest in best/best_pos.
+// Returns the excess after the range
+static inline int wavelet_scan_excess(const WaveletRmq& rmq, size_t from, size_t to, int excess, int& best, size_t& best_pos) {
+    const WaveletByteTable& table = wavelet_byte_table;
+    for (size_t p = from; p < to; p += 8) {
+        size_t len = std::min((size_t)8, to - p) - 1;
+        unsigned byte = wavelet_byte_at(rmq.parens, p) & (0x1FFu >> (8 - len));
+        if (excess + table.min[len][byte] <= best) {
+            best = excess + table.min[len][byte];
+            best_pos = p + table.pos[len][byte];
+        }
+        excess += table.total[len][byte];
+    }
+    return excess;
+}
+
+// Excess after word w's bits, given the excess before them
+static inline int wavelet_word_excess(const WaveletRmq& rmq, size_t w, int excess) {
+    return excess + 2 * wavelet_popcount(rmq.parens.words[w]) - 64;
+}
+
+static void wavelet_rmq_build(WaveletRmq& rmq, const std::vector<int>& values) {
+    const size_t n = values.size();
+    rmq.length = 2 * n;
+    wavelet_bits_init(rmq.parens, rmq.length);
+
+    std::vector<int> stack;
+    size_t p = 0;
+    for (size_t i = 0; i < n; i++) {
+        while (!stack.empty() && stack.back() > values[i]) {
+            stack.pop_back();
+            p++;
+        }
+        rmq.parens.words[p / 64] |= 1ULL << (p % 64);
+        p++;
+        stack.push_back(values[i]);
+    }
+    wavelet_bits_finish(rmq.parens);
+
+    rmq.open_samples.clear();
+    for (size_t i = 0, opens = 0; i < rmq.length; i++) {
+        if (wavelet_bit(rmq.parens, i)) {
+            if (opens % WAVELET_SELECT_SAMPLE == 0)
+                rmq.open_samples.push_back((uint32_t)i);
+            opens++;
+        }
+    }
+
+    size_t words = rmq.length / 64;
+    rmq.word_min.resize(words);
+    for (size_t w = 0; w < words; w++) {
+        int best = std::numeric_limits<int>::max();
+        size_t best_pos = 0;
+        wavelet_scan_excess(rmq, w * 64, w * 64 + 64, 0, best, best_pos);
+        rmq.word_min[w] = (int8_t)best;
+    }
+
+    size_t full_blocks = words / WAVELET_RMQ_BLOCK;
+    rmq.blocks = 1;
+    while (rmq.blocks < full_blocks) rmq.blocks *= 2;
+    rmq.block_tree.assign(2 * rmq.blocks, std::numeric_limits<int>::max());
+    for (size_t b = 0; b < full_blocks; b++) {
+        int excess = wavelet_excess(rmq, b * WAVELET_RMQ_BLOCK * 64);
+        int32_t& leaf = rmq.block_tree[rmq.blocks + b];
+        for (size_t w = b * WAVELET_RMQ_BLOCK; w < (b + 1) * WAVELET_RMQ_BLOCK; w++) {
+            leaf = std::min(leaf, excess + rmq.word_min[w]);
+            excess = wavelet_word_excess(rmq, w, excess);
+        }
+    }
+    for (size_t node = rmq.blocks - 1; node > 0; node--) {
+        rmq.block_tree[node] = std::min(rmq.block_tree[2 * node], rmq.block_tree[2 * node + 1]);
+    }
+}
+
+// Rightmost block in [first, last) holding their lowest excess, which is returned in best
+static inline size_t wavelet_min_block(const WaveletRmq& rmq, size_t first, size_t last, int& best) {
+    // Cover the range with tree nodes, left to right, keeping the rightmost lowest
+    size_t right_nodes[64];
+    int rights = 0;
+    size_t node = 0;
+    best = std::numeric_limits<int>::max();
+    for (size_t l = first + rmq.blocks, r = last + rmq.blocks; l < r; l /= 2, r /= 2) {
+        if (l & 1) {
+            if (rmq.block_tree[l] <= best) {
+                best = rmq.block_tree[l];
+                node = l;
+            }
+            l++;
+        }
+        if (r & 1)
+            right_nodes[rights++] = --r;
+    }
+    while (rights > 0) {
+        size_t r = right_nodes[--rights];
+        if (rmq.block_tree[r] <= best) {
+            best = rmq.block_tree[r];
+            node = r;
+        }
+    }
+
+    // Down to the rightmost block under it that reaches the minimum
+    while (node < rmq.blocks) {
+        node = rmq.block_tree[2 * node + 1] == rmq.block_tree[node] ? 2 * node + 1 : 2 * node;
+    }
+    return node - rmq.blocks;
+}
+
+// Rightmost position of the lowest excess after any position in [from, to], given the excess before from. The
+// lowest excess is returned in best
+static size_t wavelet_min_excess(const WaveletRmq& rmq, size_t from, size_t to, int excess, int& best) {
+    best = std::numeric_limits<int>::max();
+    size_t best_pos = from;
+    size_t end = to + 1;
+    size_t first_word = (from + 63) / 64, last_word = end / 64;
+    if (first_word >= last_word) {
+        wavelet_scan_excess(rmq, from, end, excess, best, best_pos);
+        return best_pos;
+    }
+
+    // Partial words are scanned exactly. Whole words and blocks only report their minimum; the rightmost one holding
+    // the overall minimum is opened up at the end
+    excess = wavelet_scan_excess(rmq, from, first_word * 64, excess, best, best_pos);
+    size_t best_word = 0, best_block = 0;
+    enum { EXACT, WORD, BLOCK } found = EXACT;
+
+    size_t first_block = (first_word + WAVELET_RMQ_BLOCK - 1) / WAVELET_RMQ_BLOCK, last_block = last_word / WAVELET_RMQ_BLOCK;
+    if (first_block >= last_block)
+        first_block = last_block = last_word;  // No whole blocks: every word goes through the word loop below
+
+    size_t w = first_word;
+    for (; w < std::min(last_word, first_block * WAVELET_RMQ_BLOCK); w++) {
+        if (excess + rmq.word_min[w] <= best) {
+            best = excess + rmq.word_min[w];
+            best_word = w;
+            found = WORD;
+        }
+        excess = wavelet_word_excess(rmq, w, excess);
+    }
+
+    if (first_block < last_block) {
+        int block_best;
+        size_t block = wavelet_min_block(rmq, first_block, last_block, block_best);
+        if (block_best <= best) {
+            best = block_best;
+            best_block = block;
+            found = BLOCK;
+        }
+        w = last_block * WAVELET_RMQ_BLOCK;
+        excess = wavelet_excess(rmq, w * 64);
+    }
+    for (; w < last_word; w++) {
+        if (excess + rmq.word_min[w] <= best) {
+            best = excess + rmq.word_min[w];
+            best_word = w;
+            found = WORD;
+        }
+        excess = wavelet_word_excess(rmq, w, excess);
+    }
+
+    // Anything in the last partial word that ties the minimum is further right
+    size_t tail = rmq.length;
+    wavelet_scan_excess(rmq, last_word * 64, end, excess, best, tail);
+    if (tail != rmq.length)
+        return tail;
+
+    if (found == BLOCK) {
+        // Rightmost word of the block that reaches the block's minimum
+        excess = wavelet_excess(rmq, best_block * WAVELET_RMQ_BLOCK * 64);
+        for (w = best_block * WAVELET_RMQ_BLOCK; w < (best_block + 1) * WAVELET_RMQ_BLOCK; w++) {
+            if (excess + rmq.word_min[w] == best)
+                best_word = w;
+            excess = wavelet_word_excess(rmq, w, excess);
+        }
+        found = WORD;
+    }
+    if (found == WORD) {
+        int word_best = std::numeric_limits<int>::max();
+        wavelet_scan_excess(rmq, best_word * 64, best_word * 64 + 64, wavelet_excess(rmq, best_word * 64), word_best, best_pos);
+    }
+    return best_pos;
+}
+
+// Position of the lowest value in [i, j]
+static inline size_t wavelet_rmq(const WaveletRmq& rmq, size_t i, size_t j) {
+    if (i == j)
+        return i;
+    size_t open_i = wavelet_select_open(rmq, i), open_j = wavelet_select_open(rmq, j);
+    int before = 2 * (int)i - (int)open_i, best;  // i opens and open_i - i closes precede open_i
+    size_t dip = wavelet_min_excess(rmq, open_i, open_j - 1, before, best);
+    if (best >= before + 1)
+        return i;
+    return wavelet_rank1(rmq.parens, dip + 1);
+}
+
+// Wavelet matrix over a permutation of [0, n), most significant bit first, with an RMQ over the ranks at every level
+struct WaveletMatrix {
+    int levels;
+    std::vector<WaveletBits> bits;
+    std::vector<uint32_t> zeros;  // Zero bits on each level; the ones are stably moved after them
+    std::vector<WaveletRmq> rmq;  // Ranks in each level's order
+};
+
+static void wavelet_matrix_build(WaveletMatrix& wm, std::vector<uint32_t> values, std::vector<int> ranks) {
+    size_t n = values.size();
+    wm.levels = 1;
+    while (((size_t)1 << wm.levels) < n) wm.levels++;
+    wm.bits.resize(wm.levels);
+    wm.zeros.resize(wm.levels);
+    wm.rmq.resize(wm.levels);
+
+    std::vector<uint32_t> next(n);
+    std::vector<int> next_ranks(n);
+    for (int l = 0; l < wm.levels; l++) {
+        int shift = wm.levels - 1 - l;
+        wavelet_bits_init(wm.bits[l], n);
+        wavelet_rmq_build(wm.rmq[l], ranks);
+
+        size_t z = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (((values[i] >> shift) & 1) == 0) {
+                next_ranks[z] = ranks[i];
+                next[z++] = values[i];
+            }
+        }
+        wm.zeros[l] = (uint32_t)z;
+        size_t o = z;
+        for (size_t i = 0; i < n; i++) {
+            if ((values[i] >> shift) & 1) {
+                wm.bits[l].words[i / 64] |= 1ULL << (i % 64);
+                next_ranks[o] = ranks[i];
+                next[o++] = values[i];
+            }
+        }
+        wavelet_bits_finish(wm.bits[l]);
+        values.swap(next);
+        ranks.swap(next_ranks);
+    }
+}
+
+// Value at position pos of level, given the value bits above it (prefix)
+static inline uint32_t wavelet_trace(const WaveletMatrix& wm, int level, size_t pos, uint32_t prefix) {
+    for (int l = level; l < wm.levels; l++) {
+        int bit = wavelet_bit(wm.bits[l], pos);
+        size_t ones = wavelet_rank1(wm.bits[l], pos);
+        pos = bit ? wm.zeros[l] + ones : pos - ones;
+        prefix = (prefix << 1) | bit;
+    }
+    return prefix;
+}
+
+struct WaveletIndex {
+    std::vector<Point*> by_y;      // Points in y order; the matrix's values index into this
+    std::vector<float> x_samples;  // X of every WAVELET_COORD_SAMPLE-th point in x order
+    std::vector<float> y_samples;  // Y of every WAVELET_COORD_SAMPLE-th point in y order
+    WaveletMatrix by_x;            // Y rank of the point at each x position
+};
+
+// A range of one level whose values all fall in the query, with its lowest ranked point
+struct WaveletCandidate {
+    int rank;
+    int level;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t pos;     // Position of the lowest rank in [begin, end)
+    uint32_t prefix;  // Value bits above level, shared by the whole range
+    Point* point;
+
+    bool operator<(const WaveletCandidate& other) const { return rank > other.rank; }
+};
+
+// Build the wavelet index over points
+static WaveletIndex* wavelet_build(const std::vector<Point*>& points) {
+    WaveletIndex* index = new WaveletIndex();
+    const size_t n = points.size();
+    index->by_y = points;
+    std::sort(index->by_y.begin(), index->by_y.end(), [](const Point* a, const Point* b) { return a->y < b->y; });
+
+    std::vector<uint32_t> order(n);
+    for (size_t i = 0; i < n; i++) order[i] = (uint32_t)i;
+    std::sort(order.begin(), order.end(), [index](uint32_t a, uint32_t b) { return index->by_y[a]->x < index->by_y[b]->x; });
+
+    std::vector<int> ranks(n);
+    for (size_t i = 0; i < n; i++) {
+        ranks[i] = index->by_y[order[i]]->rank;
+        if (i % WAVELET_COORD_SAMPLE == 0) {
+            index->x_samples.push_back(index->by_y[order[i]]->x);
+            index->y_samples.push_back(index->by_y[i]->y);
+        }
+    }
+    wavelet_matrix_build(index->by_x, order, ranks);
+    return index;
+}
+
+static void wavelet_delete(WaveletIndex* index) {
+    delete index;
+}
+
+static inline float wavelet_x_at(const WaveletIndex* index, size_t pos) {
+    return index->by_y[wavelet_trace(index->by_x, 0, pos, 0)]->x;
+}
+
+static inline float wavelet_y_at(const WaveletIndex* index, size_t pos) {
+    return index->by_y[pos]->y;
+}
+
+// First position whose coordinate is >= v (> v if upper): the samples narrow it to one gap, searched through the points
+template <typename CoordAt>
+static inline size_t wavelet_find(const WaveletIndex* index, const std::vector<float>& samples, float v, bool upper, CoordAt coord_at) {
+    size_t s = (upper ? std::upper_bound(samples.begin(), samples.end(), v) : std::lower_bound(samples.begin(), samples.end(), v)) - samples.begin();
+    if (s == 0)
+        return 0;
+    size_t lo = (s - 1) * WAVELET_COORD_SAMPLE + 1, hi = std::min(s * WAVELET_COORD_SAMPLE, index->by_y.size());
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        float c = coord_at(index, mid);
+        if (upper ? c > v : c >= v)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+// Push the lowest ranked point of level's [begin, end) onto the heap: O(1) to find it, O(log N) to trace it to its point
+static inline void wavelet_push(const WaveletIndex* index, std::vector<WaveletCandidate>& heap, int level, size_t begin, size_t end, uint32_t prefix) {
+    if (begin >= end)
+        return;
+    WaveletCandidate c;
+    c.level = level;
+    c.begin = (uint32_t)begin;
+    c.end = (uint32_t)end;
+    c.pos = (uint32_t)(end - begin > 1 ? wavelet_rmq(index->by_x.rmq[level], begin, end - 1) : begin);
+    c.prefix = prefix;
+    c.point = index->by_y[wavelet_trace(index->by_x, level, c.pos, prefix)];
+    c.rank = c.point->rank;
+    heap.push_back(c);
+    std::push_heap(heap.begin(), heap.end());
+}
+
+// Split level's [begin, end), whose values share prefix, into ranges whose values all lie in [y_begin, y_end)
+static void wavelet_cover(const WaveletIndex* index, std::vector<WaveletCandidate>& heap, int level, size_t begin, size_t end,
+                          uint32_t prefix, size_t y_begin, size_t y_end) {
+    const WaveletMatrix& wm = index->by_x;
+    if (begin >= end)
+        return;
+    size_t lo = (size_t)prefix << (wm.levels - level), hi = (size_t)(prefix + 1) << (wm.levels - level);
+    if (hi <= y_begin || lo >= y_end)
+        return;
+    if (y_begin <= lo && hi <= y_end) {
+        wavelet_push(index, heap, level, begin, end, prefix);
+        return;
+    }
+
+    size_t ones_begin = wavelet_rank1(wm.bits[level], begin), ones_end = wavelet_rank1(wm.bits[level], end);
+    wavelet_cover(index, heap, level + 1, begin - ones_begin, end - ones_end, prefix << 1, y_begin, y_end);
+    wavelet_cover(index, heap, level + 1, wm.zeros[level] + ones_begin, wm.zeros[level] + ones_end, (prefix << 1) | 1, y_begin, y_end);
+}
+
+// Search the wavelet index for the K lowest ranked points inside query, same interface as kdtree_search
+template <int K = SEARCH_MAX_RESULTS>
+static inline void wavelet_search(const WaveletIndex* index, const Rect& query, ResultQueue& results, int& ct) {
+    if (index->by_y.size() == 0 || !(query.lx <= query.hx && query.ly <= query.hy))
+        return;
+
+    size_t x_begin = wavelet_find(index, index->x_samples, query.lx, false, wavelet_x_at);
+    size_t x_end = wavelet_find(index, index->x_samples, query.hx, true, wavelet_x_at);
+    size_t y_begin = wavelet_find(index, index->y_samples, query.ly, false, wavelet_y_at);
+    size_t y_end = wavelet_find(index, index->y_samples, query.hy, true, wavelet_y_at);
+    if (x_begin >= x_end || y_begin >= y_end)
+        return;
+
+    std::vector<WaveletCandidate> heap;
+    heap.reserve(2 * index->by_x.levels + 2 * K + 2);
+    wavelet_cover(index, heap, 0, x_begin, x_end, 0, y_begin, y_end);
+
+    // Every candidate is inside the query and the heap yields them lowest rank first, so the first rejection ends it
+    for (int accepted = 0; accepted < K && !heap.empty(); accepted++) {
+        std::pop_heap(heap.begin(), heap.end());
+        WaveletCandidate c = heap.back();
+        heap.pop_back();
+        if (!results_offer<K>(results, c.point))
+            return;
+        ct++;
+
+        // The rest of the range splits around the reported point
+        wavelet_push(index, heap, c.level, c.begin, c.pos, c.prefix);
+        wavelet_push(index, heap, c.level, c.pos + 1, c.end, c.prefix);
+    }
+}
+
+// Bytes used by the index
+static inline size_t wavelet_size(const WaveletIndex* index) {
+    size_t size = index->by_y.size() * sizeof(Point*) + (index->x_samples.size() + index->y_samples.size()) * sizeof(float);
+    const WaveletMatrix& wm = index->by_x;
+    for (int l = 0; l < wm.levels; l++) {
+        const WaveletRmq& rmq = wm.rmq[l];
+        size += wm.bits[l].words.size() * sizeof(uint64_t) + wm.bits[l].counts.size() * sizeof(uint32_t);
+        size += rmq.parens.words.size() * sizeof(uint64_t) + rmq.parens.counts.size() * sizeof(uint32_t) +
+                rmq.open_samples.size() * sizeof(uint32_t) + rmq.word_min.size() * sizeof(int8_t) + rmq.block_tree.size() * sizeof(int32_t);
+    }
+    return size;
+}
+
+#endif
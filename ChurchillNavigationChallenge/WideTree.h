@@ -0,0 +1,361 @@
+//
+//  WideTree.h
+//  ChurchillNavigationChallenge
+//
+//  Created by Eric Campbell on 2/21/15.
+//  Copyright (c) 2015 ECC. All rights reserved.
+//
+//
+//
+//  Wide fanout static index. Each internal node splits its points three times at the median of the wider axis, giving
+//  up to 8 children whose tight bounds are stored as SoA float arrays in two cache lines, with their min ranks and
+//  child indices in a third. One pass of SIMD compares tests all 8 child boxes against the query and yields bitmasks
+//  of the children it intersects and contains, so the tree is a third of the KdTree's height and a node costs one
+//  predictable loop instead of a branch per level. Children are stored in min rank order, so a search walks the set
+//  bits of the mask in order and stops at the first child that can no longer make the results.
+//  Leaves keep their points' coordinates as SoA arrays in rank order, scanned 4 points per compare.
+
+#ifndef ChurchillNavigationChallenge_WideTree_h
+#define ChurchillNavigationChallenge_WideTree_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include "Shared.h"
+#include "Util.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+const int WIDE_FANOUT = 8;       // Children per node; a multiple of 8 up to 32 so the masks fit an unsigned
+const int WIDE_LEAF_SIZE = 128;  // Max points per leaf. Leaf scans are cheap next to a node visit, so this beat 32 and 64
+const int WIDE_SIMD_WIDTH = 4;   // Leaf coordinates per 128 bit compare
+const int WIDE_NODE_ALIGN = 64;  // Nodes start on a cache line so the bounds arrays never straddle an extra one
+
+// Internal node. Unused child slots have empty (inverted) bounds, so they never match a query
+struct WideNode {
+    float lx[WIDE_FANOUT];        // Tight bounds of each child's points
+    float hx[WIDE_FANOUT];
+    float ly[WIDE_FANOUT];
+    float hy[WIDE_FANOUT];
+    int32_t min_rank[WIDE_FANOUT]; // Lowest rank under each child, ascending across the slots
+    int32_t child[WIDE_FANOUT];    // Node index, or ~leaf index for a leaf
+};
+
+struct WideLeaf {
+    uint32_t begin;  // Point range [begin, end) in the coordinate arrays
+    uint32_t end;
+};
+
+struct WideTree {
+    Rect bounds;                  // Tight bounds of all the points
+    int32_t root;                 // Node index, or ~leaf index when every point fits one leaf
+    WideNode* nodes;              // WIDE_NODE_ALIGN aligned
+    size_t node_count;
+    std::vector<WideLeaf> leaves;
+    std::vector<float> xs;        // Point coordinates in leaf order, each leaf sorted by rank.
+    std::vector<float> ys;        //   Padded with NaN by WIDE_SIMD_WIDTH so the last leaf can be loaded whole
+    std::vector<Point*> pts;      // Original points in the same order
+
+    WideTree() : root(0), nodes(0), node_count(0) {}
+};
+
+// A query with its bounds splatted for the node and leaf compares
+struct WideQuery {
+    Rect r;
+#ifdef __SSE2__
+    __m128 lx, hx, ly, hy;
+#endif
+#ifdef __AVX__
+    __m256 lx8, hx8, ly8, hy8;
+#endif
+};
+
+static inline void wide_query_init(WideQuery& q, const Rect& query) {
+    q.r = query;
+#ifdef __SSE2__
+    q.lx = _mm_set1_ps(query.lx);
+    q.hx = _mm_set1_ps(query.hx);
+    q.ly = _mm_set1_ps(query.ly);
+    q.hy = _mm_set1_ps(query.hy);
+#endif
+#ifdef __AVX__
+    q.lx8 = _mm256_set1_ps(query.lx);
+    q.hx8 = _mm256_set1_ps(query.hx);
+    q.ly8 = _mm256_set1_ps(query.ly);
+    q.hy8 = _mm256_set1_ps(query.hy);
+#endif
+}
+
+// Tight bounds of pts[begin, end)
+static inline Rect widetree_bounds(const std::vector<Point*>& pts, size_t begin, size_t end) {
+    Rect bounds(pts[begin]->x, pts[begin]->x, pts[begin]->y, pts[begin]->y);
+    for (size_t i = begin; i < end; i++) {
+        bounds.lx = std::min(bounds.lx, pts[i]->x);
+        bounds.hx = std::max(bounds.hx, pts[i]->x);
+        bounds.ly = std::min(bounds.ly, pts[i]->y);
+        bounds.hy = std::max(bounds.hy, pts[i]->y);
+    }
+    return bounds;
+}
+
+// Split pts[begin, end) into up to parts ranges by repeated median splits along the wider axis
+static void widetree_partition(std::vector<Point*>& pts, size_t begin, size_t end, int parts, std::vector<WideLeaf>& ranges) {
+    if (parts == 1 || end - begin <= WIDE_LEAF_SIZE) {
+        WideLeaf range = { (uint32_t)begin, (uint32_t)end };
+        ranges.push_back(range);
+        return;
+    }
+
+    Rect bounds = widetree_bounds(pts, begin, end);
+    size_t mid = begin + (end - begin) / 2;
+    if (bounds.hx - bounds.lx >= bounds.hy - bounds.ly)
+        std::nth_element(pts.begin() + begin, pts.begin() + mid, pts.begin() + end, [](const Point* a, const Point* b) { return a->x < b->x; });
+    else
+        std::nth_element(pts.begin() + begin, pts.begin() + mid, pts.begin() + end, [](const Point* a, const Point* b) { return a->y < b->y; });
+
+    widetree_partition(pts, begin, mid, parts / 2, ranges);
+    widetree_partition(pts, mid, end, parts / 2, ranges);
+}
+
+// Build the subtree over pts[begin, end). Returns its node index, or ~leaf index if the points fit in one leaf
+static int32_t widetree_build_node(WideTree* tree, std::vector<WideNode>& nodes, std::vector<Point*>& pts, size_t begin, size_t end) {
+    if (end - begin <= WIDE_LEAF_SIZE) {
+        // Leaves are scanned in rank order so a scan can stop at the first rejected point
+        std::sort(pts.begin() + begin, pts.begin() + end, PointRankCompare());
+        WideLeaf leaf = { (uint32_t)begin, (uint32_t)end };
+        tree->leaves.push_back(leaf);
+        return ~(int32_t)(tree->leaves.size() - 1);
+    }
+
+    std::vector<WideLeaf> ranges;
+    widetree_partition(pts, begin, end, WIDE_FANOUT, ranges);
+
+    // Build the children first, since they append to nodes, then lay them out in min rank order
+    std::vector<std::pair<int, int> > slots;  // (min rank, range index)
+    std::vector<int32_t> children(ranges.size());
+    std::vector<Rect> bounds(ranges.size());
+    for (size_t c = 0; c < ranges.size(); c++) {
+        bounds[c] = widetree_bounds(pts, ranges[c].begin, ranges[c].end);
+        int min_rank = std::numeric_limits<int>::max();
+        for (uint32_t i = ranges[c].begin; i < ranges[c].end; i++) {
+            min_rank = std::min(min_rank, pts[i]->rank);
+        }
+        slots.push_back(std::make_pair(min_rank, (int)c));
+        children[c] = widetree_build_node(tree, nodes, pts, ranges[c].begin, ranges[c].end);
+    }
+    std::sort(slots.begin(), slots.end());
+
+    WideNode node;
+    for (int s = 0; s < WIDE_FANOUT; s++) {
+        node.lx[s] = node.ly[s] = std::numeric_limits<float>::infinity();
+        node.hx[s] = node.hy[s] = -std::numeric_limits<float>::infinity();
+        node.min_rank[s] = std::numeric_limits<int32_t>::max();
+        node.child[s] = 0;
+    }
+    for (size_t s = 0; s < slots.size(); s++) {
+        int c = slots[s].second;
+        node.lx[s] = bounds[c].lx;
+        node.hx[s] = bounds[c].hx;
+        node.ly[s] = bounds[c].ly;
+        node.hy[s] = bounds[c].hy;
+        node.min_rank[s] = slots[s].first;
+        node.child[s] = children[c];
+    }
+    nodes.push_back(node);
+    return (int32_t)(nodes.size() - 1);
+}
+
+// Build a wide tree over points
+static WideTree* widetree_build(const std::vector<Point*>& points) {
+    WideTree* tree = new WideTree();
+    if (points.size() == 0)
+        return tree;
+
+    std::vector<Point*> pts(points);
+    tree->bounds = widetree_bounds(pts, 0, pts.size());
+    std::vector<WideNode> nodes;
+    tree->root = widetree_build_node(tree, nodes, pts, 0, pts.size());
+
+    tree->node_count = nodes.size();
+    if (nodes.size() > 0) {
+        void* block = 0;
+        if (posix_memalign(&block, WIDE_NODE_ALIGN, nodes.size() * sizeof(WideNode)) != 0) {
+            delete tree;
+            return 0;
+        }
+        tree->nodes = (WideNode*)block;
+        memcpy(tree->nodes, &nodes[0], nodes.size() * sizeof(WideNode));
+    }
+
+    tree->xs.resize(pts.size() + WIDE_SIMD_WIDTH, std::numeric_limits<float>::quiet_NaN());
+    tree->ys.resize(pts.size() + WIDE_SIMD_WIDTH, std::numeric_limits<float>::quiet_NaN());
+    tree->pts = pts;
+    for (size_t i = 0; i < pts.size(); i++) {
+        tree->xs[i] = pts[i]->x;
+        tree->ys[i] = pts[i]->y;
+    }
+    return tree;
+}
+
+static void widetree_delete(WideTree* tree) {
+    free(tree->nodes);
+    delete tree;
+}
+
+// Bitmask of the node's children whose bounds intersect the query; inside gets the ones it fully contains
+static inline unsigned widetree_match(const WideNode& node, const WideQuery& q, unsigned& inside) {
+    unsigned hit = 0;
+    inside = 0;
+#if defined(__AVX__)
+    for (int i = 0; i < WIDE_FANOUT; i += 8) {
+        __m256 lx = _mm256_loadu_ps(&node.lx[i]), hx = _mm256_loadu_ps(&node.hx[i]);
+        __m256 ly = _mm256_loadu_ps(&node.ly[i]), hy = _mm256_loadu_ps(&node.hy[i]);
+        __m256 overlap = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(lx, q.hx8, _CMP_LE_OQ), _mm256_cmp_ps(hx, q.lx8, _CMP_GE_OQ)),
+                                       _mm256_and_ps(_mm256_cmp_ps(ly, q.hy8, _CMP_LE_OQ), _mm256_cmp_ps(hy, q.ly8, _CMP_GE_OQ)));
+        __m256 within = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(lx, q.lx8, _CMP_GE_OQ), _mm256_cmp_ps(hx, q.hx8, _CMP_LE_OQ)),
+                                      _mm256_and_ps(_mm256_cmp_ps(ly, q.ly8, _CMP_GE_OQ), _mm256_cmp_ps(hy, q.hy8, _CMP_LE_OQ)));
+        hit |= (unsigned)_mm256_movemask_ps(overlap) << i;
+        inside |= (unsigned)_mm256_movemask_ps(_mm256_and_ps(overlap, within)) << i;
+    }
+#elif defined(__SSE2__)
+    for (int i = 0; i < WIDE_FANOUT; i += 4) {
+        __m128 lx = _mm_loadu_ps(&node.lx[i]), hx = _mm_loadu_ps(&node.hx[i]);
+        __m128 ly = _mm_loadu_ps(&node.ly[i]), hy = _mm_loadu_ps(&node.hy[i]);
+        __m128 overlap = _mm_and_ps(_mm_and_ps(_mm_cmple_ps(lx, q.hx), _mm_cmpge_ps(hx, q.lx)),
+                                    _mm_and_ps(_mm_cmple_ps(ly, q.hy), _mm_cmpge_ps(hy, q.ly)));
+        __m128 within = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(lx, q.lx), _mm_cmple_ps(hx, q.hx)),
+                                   _mm_and_ps(_mm_cmpge_ps(ly, q.ly), _mm_cmple_ps(hy, q.hy)));
+        hit |= (unsigned)_mm_movemask_ps(overlap) << i;
+        inside |= (unsigned)_mm_movemask_ps(_mm_and_ps(overlap, within)) << i;
+    }
+#else
+    for (int i = 0; i < WIDE_FANOUT; i++) {
+        if (node.lx[i] <= q.r.hx && node.hx[i] >= q.r.lx && node.ly[i] <= q.r.hy && node.hy[i] >= q.r.ly) {
+            hit |= 1u << i;
+            if (node.lx[i] >= q.r.lx && node.hx[i] <= q.r.hx && node.ly[i] >= q.r.ly && node.hy[i] <= q.r.hy)
+                inside |= 1u << i;
+        }
+    }
+#endif
+    return hit;
+}
+
+// Bitmask of the 4 points at xs/ys that query contains
+static inline unsigned widetree_match4(const float* xs, const float* ys, const WideQuery& q) {
+#ifdef __SSE2__
+    __m128 x = _mm_loadu_ps(xs), y = _mm_loadu_ps(ys);
+    __m128 in = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(x, q.lx), _mm_cmple_ps(x, q.hx)),
+                           _mm_and_ps(_mm_cmpge_ps(y, q.ly), _mm_cmple_ps(y, q.hy)));
+    return (unsigned)_mm_movemask_ps(in);
+#else
+    unsigned mask = 0;
+    for (int j = 0; j < WIDE_SIMD_WIDTH; j++) {
+        if (xs[j] >= q.r.lx && xs[j] <= q.r.hx && ys[j] >= q.r.ly && ys[j] <= q.r.hy)
+            mask |= 1u << j;
+    }
+    return mask;
+#endif
+}
+
+// Offer the leaf's points inside query (all of them if contained) in rank order, stopping at the first rejection
+template <int K>
+static inline bool widetree_scan_leaf(const WideTree* tree, const WideLeaf& leaf, const WideQuery& q, bool contained,
+                                      ResultQueue& results, int& ct) {
+    for (uint32_t i = leaf.begin; i < leaf.end; i += WIDE_SIMD_WIDTH) {
+        unsigned mask = contained ? 0xF : widetree_match4(&tree->xs[i], &tree->ys[i], q);
+        uint32_t block_end = std::min(leaf.end, i + WIDE_SIMD_WIDTH);
+        for (uint32_t j = i; j < block_end; j++) {
+            if (mask & (1u << (j - i))) {
+                if (!results_offer<K>(results, tree->pts[j]))
+                    return false;
+                ct++;
+            }
+        }
+    }
+    return true;
+}
+
+// Search the children of node n. Under a contained node every used slot matches, so the compares are skipped
+template <int K>
+static void widetree_search_node(const WideTree* tree, int32_t n, const WideQuery& q, bool contained, ResultQueue& results, int& ct) {
+    const WideNode& node = tree->nodes[n];
+
+    unsigned hit, inside;
+    if (contained) {
+        hit = 0;
+        for (int i = 0; i < WIDE_FANOUT; i++) {
+            if (node.min_rank[i] != std::numeric_limits<int32_t>::max())
+                hit |= 1u << i;
+        }
+        inside = hit;
+    } else {
+        hit = widetree_match(node, q, inside);
+    }
+
+    // Start fetching every child we might descend into before visiting the first
+    for (unsigned m = hit; m != 0; m &= m - 1) {
+        int32_t child = node.child[__builtin_ctz(m)];
+        if (child >= 0)
+            SEARCH_PREFETCH(&tree->nodes[child]);
+        else
+            SEARCH_PREFETCH(&tree->xs[tree->leaves[~child].begin]);
+    }
+
+    for (; hit != 0; hit &= hit - 1) {
+        int i = __builtin_ctz(hit);
+
+        // Slots are in min rank order, so once one can't make the results none of the later ones can either
+        if (results.size() >= K && node.min_rank[i] >= results.top()->rank)
+            return;
+
+        int32_t child = node.child[i];
+        bool child_contained = (inside >> i) & 1;
+        if (child >= 0)
+            widetree_search_node<K>(tree, child, q, child_contained, results, ct);
+        else
+            widetree_scan_leaf<K>(tree, tree->leaves[~child], q, child_contained, results, ct);
+    }
+}
+
+// Search the wide tree for the K lowest ranked points inside query, same interface as kdtree_search
+template <int K = SEARCH_MAX_RESULTS>
+static inline void widetree_search(const WideTree* tree, const Rect& query, ResultQueue& results, int& ct) {
+    if (tree->pts.size() == 0 || !rects_intersect(tree->bounds, query))
+        return;
+
+    WideQuery q;
+    wide_query_init(q, query);
+    bool contained = rects_contained(query, tree->bounds);
+    if (tree->root >= 0)
+        widetree_search_node<K>(tree, tree->root, q, contained, results, ct);
+    else
+        widetree_scan_leaf<K>(tree, tree->leaves[~tree->root], q, contained, results, ct);
+}
+
+// Height of the tree in nodes, counting the leaf level
+static int widetree_height(const WideTree* tree, int32_t n) {
+    if (n < 0)
+        return 1;
+    int height = 0;
+    for (int i = 0; i < WIDE_FANOUT; i++) {
+        if (tree->nodes[n].min_rank[i] != std::numeric_limits<int32_t>::max())
+            height = std::max(height, widetree_height(tree, tree->nodes[n].child[i]));
+    }
+    return height + 1;
+}
+
+// Bytes used by the nodes, leaves and point arrays
+static inline size_t widetree_size(const WideTree* tree) {
+    return tree->node_count * sizeof(WideNode) + tree->leaves.size() * sizeof(WideLeaf) +
+           (tree->xs.size() + tree->ys.size()) * sizeof(float) + tree->pts.size() * sizeof(Point*);
+}
+
+#endif
@@ -7,6 +7,7 @@
 //
 
 #include <stdlib.h>
+#include <string.h>
 #include <fstream>
 #include <iostream>
 #include <chrono>
@@ -16,13 +17,31 @@
 #include "QuadTree.h"
 #include "KdTree.h"
 #include "Gen.h"
+#include "Verify.h"
+#include "Numa.h"
+#include "Server.h"
+#include "Shard.h"
+#include "Perf.h"
+#include "KeyTree.h"
+#include "Wavelet.h"
+#include "WideTree.h"
+#include "Delta.h"
+#include "IdIndex.h"
 
 #define RENDER_QUADTREE
+//#define VERIFY_RESULTS        // Check every benchmark query against the brute force oracle (--verify runs the full suite)
+#define REPLICATE_INDEX         // Benchmark per-NUMA-node huge page replicas of the index against the heap built index
+//#define EXPLICIT_HUGE_PAGES   // Replicas use reserved MAP_HUGETLB pages (vm.nr_hugepages) instead of transparent huge pages
+//#define HARDWARE_COUNTERS     // Report perf_event_open counters (cycles, IPC, cache/branch/TLB misses) next to the timings
 
 #ifdef RENDER_QUADTREE
+#ifndef RENDER_DIR
+#define RENDER_DIR "."          // Directory the rendered images are written to, override with -DRENDER_DIR=...
+#endif
 #include "PPM.h"
 ppm quadtree_img(1024, 1024);
 ppm kdtree_img(1024, 1024);
+ppm heatmap_img(1024, 1024);
 #endif
 
 std::vector<QueryResult> query_results;
@@ -30,13 +49,77 @@ std::vector<Rect> queries;
 QuadTree* qt;
 KdTree* kdt;
 std::vector<Point*> points;
+PerfCounters perf;  // Stays closed (every read a no-op) without HARDWARE_COUNTERS or perf_event_open support
 
 void setup_data(int num_search_queries, int num_points, int max_point_range);
+void seed_like_setup_data();
 void execute_searches();
 void display_search_results();
+void execute_batch_searches();
+void execute_replica_searches();
+void execute_prefetch_searches();
+void execute_interleaved_searches();
+void execute_filtered_searches();
+void execute_count_queries();
+void execute_distribution_searches();
+void execute_key_searches();
+void execute_wavelet_searches();
+void execute_wide_searches();
+void execute_update_searches();
+int serve_index(const char* path, int num_points);
+int shard_index(const char* base_path, int num_shards, int num_points, ShardPartition partition);
 
+#ifdef FUZZ_SEARCH
+// libFuzzer entry point, build with -DFUZZ_SEARCH -fsanitize=fuzzer (replaces main)
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    return verify_fuzz_one(data, size);
+}
+#else
 int main(int argc, const char * argv[])
 {
+    // Differential correctness suite: --verify [cases] [seed]
+    if (argc > 1 && strcmp(argv[1], "--verify") == 0) {
+        int num_cases = argc > 2 ? atoi(argv[2]) : 500;
+        unsigned int seed = argc > 3 ? (unsigned int)strtoul(argv[3], 0, 10) : 1;
+        return verify_run(num_cases, seed) == 0 ? 0 : 1;
+    }
+    
+    // The interleaved searches alone over a larger point set: --interleaved [points]. Interleaving hides cache
+    // misses, and the default NUM_PTS index fits in cache, so it only pays off with millions of points
+    if (argc > 1 && strcmp(argv[1], "--interleaved") == 0) {
+        srand (1000000000000);
+        setup_data(1, argc > 2 ? atoi(argv[2]) : 5000000, MAX_PT_RANGE);
+        execute_interleaved_searches();
+        return 0;
+    }
+    
+    // Query server on a Unix domain socket: --serve <socket> [points]
+    if (argc > 2 && strcmp(argv[1], "--serve") == 0) {
+        return serve_index(argv[2], argc > 3 ? atoi(argv[3]) : NUM_PTS);
+    }
+    
+    // Load generator against a running server: --client <socket> [queries] [connections] [pipeline depth]
+    if (argc > 2 && strcmp(argv[1], "--client") == 0) {
+        int num_queries = argc > 3 ? atoi(argv[3]) : 100000;
+        int num_connections = argc > 4 ? atoi(argv[4]) : 8;
+        int depth = argc > 5 ? atoi(argv[5]) : 16;
+        return client_run(argv[2], num_queries, std::max(1, num_connections), std::max(1, depth)) ? 0 : 1;
+    }
+    
+    // Scatter-gather over local shard processes: --shard <socket base> [shards] [points] [spatial|rank]
+    if (argc > 2 && strcmp(argv[1], "--shard") == 0) {
+        int num_shards = argc > 3 ? atoi(argv[3]) : 4;
+        int num_points = argc > 4 ? atoi(argv[4]) : NUM_PTS;
+        ShardPartition partition = argc > 5 && strcmp(argv[5], "rank") == 0 ? SHARD_RANK : SHARD_SPATIAL;
+        return shard_index(argv[2], std::max(1, num_shards), num_points, partition);
+    }
+    
+#ifdef HARDWARE_COUNTERS
+    if (!perf_counters_open(perf))
+        std::cout << "Hardware counters unavailable (perf_event_open failed, check kernel.perf_event_paranoid)" << std::endl;
+#endif
+    
     /* initialize random seed: */
     srand (1000000000000);//time(NULL)
     
@@ -48,13 +131,35 @@ int main(int argc, const char * argv[])
     ppm_draw_quadtree(quadtree_img, qt, ppm::pixel(75, 75, 145));
     ppm_draw_kdtree(kdtree_img, kdt, ppm::pixel(75, 75, 145));
     
-    // Output the quadtree and kdtree PPM images
-    ppm_write(quadtree_img, "/Users/ericc/Desktop/quadtree.pbm");
-    ppm_write(kdtree_img, "/Users/ericc/Desktop/kdtree.pbm");
+    // Point density heatmap, binned straight from the quadtree's subtree counts
+    DensityGrid heatmap;
+    quadtree_density_grid(qt, Rect(0, MAX_PT_RANGE, 0, MAX_PT_RANGE), 256, 256, heatmap);
+    ppm_draw_heatmap(heatmap_img, heatmap);
+    
+    // Output the quadtree, kdtree and heatmap PPM images
+    ppm_write(quadtree_img, RENDER_DIR "/quadtree.pbm");
+    ppm_write(kdtree_img, RENDER_DIR "/kdtree.pbm");
+    ppm_write(heatmap_img, RENDER_DIR "/heatmap.pbm");
 #endif
     
     execute_searches();
     display_search_results();
+    execute_batch_searches();
+    execute_prefetch_searches();
+    execute_interleaved_searches();
+    execute_filtered_searches();
+    execute_count_queries();
+    execute_distribution_searches();
+    execute_key_searches();
+    execute_wavelet_searches();
+    execute_wide_searches();
+    execute_update_searches();
+    
+#ifdef REPLICATE_INDEX
+    execute_replica_searches();
+#endif
+    
+    perf_counters_close(perf);
     
     // Clean up heap allocations
     quadtree_delete(qt);
@@ -67,6 +172,7 @@ int main(int argc, const char * argv[])
     
     return 0;
 }
+#endif
 
 void setup_data(int num_search_queries, int num_points, int max_point_range) {
     // Generate random 2D rectangular search queries
@@ -80,26 +186,57 @@ void setup_data(int num_search_queries, int num_points, int max_point_range) {
     auto end = std::chrono::steady_clock::now();
     auto diff = end - start;
     
-    // Create the QuadTree and insert the points vector
+    // Create the QuadTree and insert the points vector one at a time
     /////
-    qt = quadtree_construct(Rect(0, max_point_range, 0, max_point_range), 0);
+    PerfSample qt_sequential_perf;
+    perf_counters_start(perf);
+    start = std::chrono::steady_clock::now();
+    QuadTree* qt_sequential = quadtree_construct(Rect(0, max_point_range, 0, max_point_range), 0);
     int insert_ct = 0;
-    quadtree_insert(qt, points, insert_ct);
+    quadtree_insert(qt_sequential, points, insert_ct);
+    end = std::chrono::steady_clock::now();
+    perf_counters_stop(perf, qt_sequential_perf);
+    /////
+    diff = end - start;
+    std::cout << "QuadTree Sequential Creation Time: " << std::chrono::duration <double, std::milli> (diff).count() << " ms" << std::endl;
+    perf_sample_print("QuadTree Sequential Creation Counters:", qt_sequential_perf);
+    
+    // Create the QuadTree again with independent quadrant subtrees built in parallel
     /////
+    PerfSample qt_perf;
+    perf_counters_start(perf);
+    start = std::chrono::steady_clock::now();
+    qt = quadtree_construct(Rect(0, max_point_range, 0, max_point_range), 0);
+    insert_ct = 0;
+    quadtree_build(qt, points, insert_ct);
     end = std::chrono::steady_clock::now();
+    perf_counters_stop(perf, qt_perf);
+    /////
     diff = end - start;
     std::cout << "QuadTree Creation Time: " << std::chrono::duration <double, std::milli> (diff).count() << " ms" << std::endl;
+    // Counters follow the calling thread only, so worker threads of the parallel build aren't included
+    perf_sample_print("QuadTree Creation Counters (calling thread):", qt_perf);
+    
+#ifdef VERIFY_RESULTS
+    if (!verify_same_quadtree(qt, qt_sequential))
+        std::cout << "PARALLEL QUADTREE FAILED VERIFICATION" << std::endl;
+#endif
+    quadtree_delete(qt_sequential);
     
     
-    start = std::chrono::steady_clock::now();
     // Create the KdTree and insert the points vector
     /////
+    PerfSample kd_perf;
+    perf_counters_start(perf);
+    start = std::chrono::steady_clock::now();
     kdt = kdtree_construct(Rect(0, max_point_range, 0, max_point_range), 0);
     kdtree_insert(kdt, points);
-    /////
     end = std::chrono::steady_clock::now();
+    perf_counters_stop(perf, kd_perf);
+    /////
     diff = end - start;
     std::cout << "KdTree Creation Time: " << std::chrono::duration <double, std::milli> (diff).count() << " ms" << std::endl;
+    perf_sample_print("KdTree Creation Counters:", kd_perf);
     
 }
 
@@ -119,11 +256,12 @@ void execute_searches() {
         i++;
         
         // Priority queues for keeping a sorted list of the 20 lowest ranked points
-        std::priority_queue<Point*, std::vector<Point*>> results, results2, results3;
+        ResultQueue results, results2, results3, results4;
         
         QueryResult qr;
         qr.i = i;
         
+        perf_counters_start(perf);
         start = std::chrono::steady_clock::now();
         
         // Do a brute force search of all points in O(N^2) time
@@ -133,27 +271,48 @@ void execute_searches() {
         }
         
         end = std::chrono::steady_clock::now();
+        perf_counters_stop(perf, qr.bf_perf);
         diff = end - start;
         qr.bf = std::chrono::duration <double, std::milli> (diff).count();
         qr.ct_bf = results.size();
         
         // Search quadtree in ~O(log N) time
-        start = std::chrono::steady_clock::now();
         int ct = 0;
+        perf_counters_start(perf);
+        start = std::chrono::steady_clock::now();
         quadtree_search(qt, *q, results2, ct);
         end = std::chrono::steady_clock::now();
+        perf_counters_stop(perf, qr.qt_perf);
         diff = end - start;
         qr.qt = std::chrono::duration <double, std::milli> (diff).count();
         qr.ct_qt = results2.size();
         
         // Search KdTree in O(n^(1-1/k) + m) time, where m is the number of the reported points, and k the dimension of the k-d tree
+        perf_counters_start(perf);
         start = std::chrono::steady_clock::now();
         kdtree_search(kdt, *q, results3, ct);
         end = std::chrono::steady_clock::now();
+        perf_counters_stop(perf, qr.kd_perf);
         diff = end - start;
         qr.kd = std::chrono::duration <double, std::milli> (diff).count();
         qr.ct_kd = results3.size();
         
+        // Search quadtree visiting children lowest rank first, pruning subtrees that can't make the top 20
+        perf_counters_start(perf);
+        start = std::chrono::steady_clock::now();
+        quadtree_search_ranked(qt, *q, results4, ct);
+        end = std::chrono::steady_clock::now();
+        perf_counters_stop(perf, qr.qtr_perf);
+        diff = end - start;
+        qr.qtr = std::chrono::duration <double, std::milli> (diff).count();
+        qr.ct_qtr = results4.size();
+        
+#ifdef VERIFY_RESULTS
+        // Check both engines against the brute force results, rank by rank
+        if (verify_query(points, qt, kdt, *q) > 0)
+            std::cout << "QUERY " << i << " FAILED VERIFICATION" << std::endl;
+#endif
+        
 #ifdef RENDER_QUADTREE
         while (results2.size() > 0) {
             ppm_set_pt(quadtree_img, results2.top()->x, results2.top()->y, ppm::green);
@@ -175,6 +334,8 @@ void display_search_results() {
     float avg_bf = 0;
     float avg_qt = 0;
     float avg_kd = 0;
+    float avg_qtr = 0;
+    PerfSample sum_bf_perf, sum_qt_perf, sum_kd_perf, sum_qtr_perf;
     
     // Display search results
     for (std::vector<QueryResult>::iterator q = query_results.begin() ; q != query_results.end(); ++q) {
@@ -183,28 +344,940 @@ void display_search_results() {
         std::cout << " " << std::endl;
         std::cout << "Brute Force Time: " << (*q).bf << " ms" << std::endl;
         std::cout << "Brute Force Results: " << (*q).ct_bf << std::endl;
+        perf_sample_print("Brute Force Counters:", (*q).bf_perf);
         std::cout << " " << std::endl;
         std::cout << "QuadTree Time: " << (*q).qt << " ms" << std::endl;
         std::cout << "QuadTree Results: " << (*q).ct_qt << std::endl;
+        perf_sample_print("QuadTree Counters:", (*q).qt_perf);
         std::cout << " " << std::endl;
         std::cout << "KdTree Time: " << (*q).kd << " ms" << std::endl;
         std::cout << "KdTree Results: " << (*q).ct_kd << std::endl;
+        perf_sample_print("KdTree Counters:", (*q).kd_perf);
+        std::cout << " " << std::endl;
+        std::cout << "QuadTree Ranked Time: " << (*q).qtr << " ms" << std::endl;
+        std::cout << "QuadTree Ranked Results: " << (*q).ct_qtr << std::endl;
+        perf_sample_print("QuadTree Ranked Counters:", (*q).qtr_perf);
         std::cout << " " << std::endl;
         
         avg_bf += (*q).bf;
         avg_qt += (*q).qt;
         avg_kd += (*q).kd;
+        avg_qtr += (*q).qtr;
+        perf_sample_add(sum_bf_perf, (*q).bf_perf);
+        perf_sample_add(sum_qt_perf, (*q).qt_perf);
+        perf_sample_add(sum_kd_perf, (*q).kd_perf);
+        perf_sample_add(sum_qtr_perf, (*q).qtr_perf);
     }
     
     // Calculate search time averages
     avg_bf /= query_results.size();
     avg_qt /= query_results.size();
     avg_kd /= query_results.size();
+    avg_qtr /= query_results.size();
     
     // Display search averages
     std::cout << "AVG Brute Force Search Time: " << avg_bf << " ms" << std::endl;
     std::cout << "AVG Quad Tree Search Time: " << avg_qt << " ms" << std::endl;
     std::cout << "AVG KdTree Search Time : " << avg_kd << " ms" << std::endl;
+    std::cout << "AVG Quad Tree Ranked Search Time: " << avg_qtr << " ms" << std::endl;
+    perf_sample_print("AVG Brute Force Counters:", sum_bf_perf, query_results.size());
+    perf_sample_print("AVG Quad Tree Counters:", sum_qt_perf, query_results.size());
+    perf_sample_print("AVG KdTree Counters:", sum_kd_perf, query_results.size());
+    perf_sample_print("AVG Quad Tree Ranked Counters:", sum_qtr_perf, query_results.size());
 }
 
+// Compare one-query-at-a-time search throughput against Morton sorted batches traversing the tree once per batch
+void execute_batch_searches() {
+    std::vector<Rect> batch_queries;
+    generate_queries(NUM_BATCH_QUERIES, batch_queries);
+    
+    std::vector<ResultQueue> results(batch_queries.size());
+    std::vector<int> order;
+    int ct = 0;
+    
+    PerfSample qt_single_perf, qt_batch_perf, kd_single_perf, kd_batch_perf;
+    
+    // QuadTree, one query at a time
+    perf_counters_start(perf);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < batch_queries.size(); i++) {
+        quadtree_search(qt, batch_queries[i], results[i], ct);
+    }
+    auto end = std::chrono::steady_clock::now();
+    perf_counters_stop(perf, qt_single_perf);
+    double qt_single = std::chrono::duration <double, std::milli> (end - start).count();
+    
+    // QuadTree, batched (the Morton sort is part of the measured time)
+    results.assign(batch_queries.size(), ResultQueue());
+    perf_counters_start(perf);
+    start = std::chrono::steady_clock::now();
+    morton_sort_queries(batch_queries, qt->bounds, order);
+    for (size_t i = 0; i < order.size(); i += SEARCH_BATCH_SIZE) {
+        quadtree_search_batch(qt, batch_queries, &order[i], std::min(SEARCH_BATCH_SIZE, (int)(order.size() - i)), results);
+    }
+    end = std::chrono::steady_clock::now();
+    perf_counters_stop(perf, qt_batch_perf);
+    double qt_batch = std::chrono::duration <double, std::milli> (end - start).count();
+    
+    // KdTree, one query at a time
+    results.assign(batch_queries.size(), ResultQueue());
+    perf_counters_start(perf);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < batch_queries.size(); i++) {
+        kdtree_search(kdt, batch_queries[i], results[i], ct);
+    }
+    end = std::chrono::steady_clock::now();
+    perf_counters_stop(perf, kd_single_perf);
+    double kd_single = std::chrono::duration <double, std::milli> (end - start).count();
+    
+    // KdTree, batched
+    results.assign(batch_queries.size(), ResultQueue());
+    perf_counters_start(perf);
+    start = std::chrono::steady_clock::now();
+    morton_sort_queries(batch_queries, kdt->bounds, order);
+    for (size_t i = 0; i < order.size(); i += SEARCH_BATCH_SIZE) {
+        kdtree_search_batch(kdt, batch_queries, &order[i], std::min(SEARCH_BATCH_SIZE, (int)(order.size() - i)), results);
+    }
+    end = std::chrono::steady_clock::now();
+    perf_counters_stop(perf, kd_batch_perf);
+    double kd_batch = std::chrono::duration <double, std::milli> (end - start).count();
+    
+    std::cout << std::endl;
+    std::cout << "=============================================" << std::endl;
+    std::cout << "BATCH " << batch_queries.size() << " queries, batch size " << SEARCH_BATCH_SIZE << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << "QuadTree One-at-a-time: " << qt_single << " ms (" << batch_queries.size() / qt_single << " queries/ms)" << std::endl;
+    std::cout << "QuadTree Batched: " << qt_batch << " ms (" << batch_queries.size() / qt_batch << " queries/ms)" << std::endl;
+    std::cout << "KdTree One-at-a-time: " << kd_single << " ms (" << batch_queries.size() / kd_single << " queries/ms)" << std::endl;
+    std::cout << "KdTree Batched: " << kd_batch << " ms (" << batch_queries.size() / kd_batch << " queries/ms)" << std::endl;
+    
+    // Per query counters for each of the four runs
+    perf_sample_print("QuadTree One-at-a-time Counters/query:", qt_single_perf, batch_queries.size());
+    perf_sample_print("QuadTree Batched Counters/query:", qt_batch_perf, batch_queries.size());
+    perf_sample_print("KdTree One-at-a-time Counters/query:", kd_single_perf, batch_queries.size());
+    perf_sample_print("KdTree Batched Counters/query:", kd_batch_perf, batch_queries.size());
+}
 
+// Run the queries across one thread per hardware thread, each pinned to a NUMA node round robin.
+// Searches either the heap built index or the replica local to each thread's node. Returns the wall time in ms
+double execute_parallel_searches(const std::vector<Rect>& search_queries, const std::vector<NumaNode>& nodes,
+                                 const std::vector<IndexReplica*>& replicas, bool use_replicas, bool use_kdtree) {
+    int num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < num_threads; t++) {
+        threads.push_back(std::thread([&, t]() {
+            int node = t % nodes.size();
+            numa_pin_thread(nodes[node]);
+            
+            QuadTree* search_qt = use_replicas ? replicas[node]->qt : qt;
+            KdTree* search_kdt = use_replicas ? replicas[node]->kdt : kdt;
+            int ct = 0;
+            
+            for (size_t i = t; i < search_queries.size(); i += num_threads) {
+                ResultQueue results;
+                if (use_kdtree)
+                    kdtree_search(search_kdt, search_queries[i], results, ct);
+                else
+                    quadtree_search(search_qt, search_queries[i], results, ct);
+            }
+        }));
+    }
+    
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration <double, std::milli> (end - start).count();
+}
+
+// Compare multi-threaded search over the heap built index against per-NUMA-node replicas in huge page arenas
+void execute_replica_searches() {
+#ifdef EXPLICIT_HUGE_PAGES
+    const bool explicit_huge = true;
+#else
+    const bool explicit_huge = false;
+#endif
+    
+    std::vector<NumaNode> nodes;
+    numa_topology(nodes);
+    
+    std::vector<IndexReplica*> replicas;
+    auto start = std::chrono::steady_clock::now();
+    index_replicate_numa(points, qt, kdt, nodes, replicas, explicit_huge);
+    auto end = std::chrono::steady_clock::now();
+    double replicate_ms = std::chrono::duration <double, std::milli> (end - start).count();
+    
+    std::vector<Rect> search_queries;
+    generate_queries(NUM_BATCH_QUERIES, search_queries);
+    
+    double qt_heap = execute_parallel_searches(search_queries, nodes, replicas, false, false);
+    double qt_replica = execute_parallel_searches(search_queries, nodes, replicas, true, false);
+    double kd_heap = execute_parallel_searches(search_queries, nodes, replicas, false, true);
+    double kd_replica = execute_parallel_searches(search_queries, nodes, replicas, true, true);
+    
+    std::cout << std::endl;
+    std::cout << "=============================================" << std::endl;
+    std::cout << "REPLICAS " << nodes.size() << " NUMA node(s), " << std::max(1, (int)std::thread::hardware_concurrency()) << " query threads, "
+              << search_queries.size() << " queries" << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << "Replication Time: " << replicate_ms << " ms" << std::endl;
+    for (size_t i = 0; i < replicas.size(); i++) {
+        std::cout << "Replica " << i << " (node " << replicas[i]->numa_node << "): " << index_arena_size(replicas[i]->arena) / 1024 << " KB, "
+                  << replicas[i]->arena->huge_chunks << "/" << replicas[i]->arena->chunks.size() << " chunks on explicit huge pages" << std::endl;
+    }
+    long thp = index_thp_bytes();
+    if (thp >= 0)
+        std::cout << "Transparent Huge Pages In Use: " << thp / 1024 << " KB" << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << "QuadTree Heap Index: " << qt_heap << " ms" << std::endl;
+    std::cout << "QuadTree Local Replicas: " << qt_replica << " ms" << std::endl;
+    std::cout << "KdTree Heap Index: " << kd_heap << " ms" << std::endl;
+    std::cout << "KdTree Local Replicas: " << kd_replica << " ms" << std::endl;
+    
+    for (size_t i = 0; i < replicas.size(); i++) {
+        index_replica_delete(replicas[i]);
+    }
+}
+
+// Compare the recursive searches against the iterative prefetching searches over a range of prefetch distances
+void execute_prefetch_searches() {
+    std::vector<Rect> search_queries;
+    generate_queries(NUM_BATCH_QUERIES, search_queries);
+    int ct = 0;
+    
+    std::cout << std::endl;
+    std::cout << "=============================================" << std::endl;
+    std::cout << "PREFETCH " << search_queries.size() << " queries" << std::endl;
+    std::cout << " " << std::endl;
+    
+    // Recursive baselines
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        ResultQueue results;
+        quadtree_search(qt, search_queries[i], results, ct);
+    }
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "QuadTree Recursive: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+    
+    for (int distance = 0; distance <= 4; distance++) {
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < search_queries.size(); i++) {
+            ResultQueue results;
+            quadtree_search_prefetch(qt, search_queries[i], results, ct, distance);
+        }
+        end = std::chrono::steady_clock::now();
+        std::cout << "QuadTree Iterative, Prefetch Distance " << distance << ": " << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+    }
+    
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        ResultQueue results;
+        kdtree_search(kdt, search_queries[i], results, ct);
+    }
+    end = std::chrono::steady_clock::now();
+    std::cout << "KdTree Recursive: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+    
+    for (int distance = 0; distance <= 4; distance++) {
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < search_queries.size(); i++) {
+            ResultQueue results;
+            kdtree_search_prefetch(kdt, search_queries[i], results, ct, distance);
+        }
+        end = std::chrono::steady_clock::now();
+        std::cout << "KdTree Iterative, Prefetch Distance " << distance << ": " << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+    }
+}
+
+// One query at a time, as in execute_searches, against groups of queries interleaved on this thread. All single
+// threaded, so queries/sec is throughput per core. At NUM_PTS the trees sit in cache and grouping only adds
+// overhead; run --interleaved [points] to see it with an index that doesn't fit
+void execute_interleaved_searches() {
+    std::vector<Rect> search_queries;
+    generate_queries(NUM_BATCH_QUERIES, search_queries);
+    const int groups[] = { 1, 2, 4, 8, 16, 32 };
+    int ct = 0;
+    
+    std::cout << std::endl;
+    std::cout << "=============================================" << std::endl;
+    std::cout << "INTERLEAVED " << search_queries.size() << " queries" << std::endl;
+    std::cout << " " << std::endl;
+    
+    PerfSample qt_perf, qt_group_perf, kd_perf, kd_group_perf;
+    perf_counters_start(perf);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        ResultQueue results;
+        quadtree_search(qt, search_queries[i], results, ct);
+    }
+    auto end = std::chrono::steady_clock::now();
+    perf_counters_stop(perf, qt_perf);
+    double ms = std::chrono::duration <double, std::milli> (end - start).count();
+    std::cout << "QuadTree One At A Time: " << ms << " ms, " << search_queries.size() / ms * 1000 << " queries/sec" << std::endl;
+    
+    std::vector<ResultQueue> qt_results;
+    for (size_t g = 0; g < sizeof(groups) / sizeof(groups[0]); g++) {
+        qt_results.clear();
+        if (groups[g] == SEARCH_INTERLEAVE_GROUP)
+            perf_counters_start(perf);
+        start = std::chrono::steady_clock::now();
+        quadtree_search_interleaved(qt, search_queries, qt_results, ct, groups[g]);
+        end = std::chrono::steady_clock::now();
+        if (groups[g] == SEARCH_INTERLEAVE_GROUP)
+            perf_counters_stop(perf, qt_group_perf);
+        ms = std::chrono::duration <double, std::milli> (end - start).count();
+        std::cout << "QuadTree Interleaved, Group " << groups[g] << ": " << ms << " ms, " << search_queries.size() / ms * 1000 << " queries/sec" << std::endl;
+    }
+    
+    perf_counters_start(perf);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        ResultQueue results;
+        kdtree_search(kdt, search_queries[i], results, ct);
+    }
+    end = std::chrono::steady_clock::now();
+    perf_counters_stop(perf, kd_perf);
+    ms = std::chrono::duration <double, std::milli> (end - start).count();
+    std::cout << "KdTree One At A Time: " << ms << " ms, " << search_queries.size() / ms * 1000 << " queries/sec" << std::endl;
+    
+    std::vector<ResultQueue> kd_results;
+    for (size_t g = 0; g < sizeof(groups) / sizeof(groups[0]); g++) {
+        kd_results.clear();
+        if (groups[g] == SEARCH_INTERLEAVE_GROUP)
+            perf_counters_start(perf);
+        start = std::chrono::steady_clock::now();
+        kdtree_search_interleaved(kdt, search_queries, kd_results, ct, groups[g]);
+        end = std::chrono::steady_clock::now();
+        if (groups[g] == SEARCH_INTERLEAVE_GROUP)
+            perf_counters_stop(perf, kd_group_perf);
+        ms = std::chrono::duration <double, std::milli> (end - start).count();
+        std::cout << "KdTree Interleaved, Group " << groups[g] << ": " << ms << " ms, " << search_queries.size() / ms * 1000 << " queries/sec" << std::endl;
+    }
+    
+    perf_sample_print("QuadTree One At A Time Counters/query:", qt_perf, search_queries.size());
+    perf_sample_print("QuadTree Interleaved Counters/query:", qt_group_perf, search_queries.size());
+    perf_sample_print("KdTree One At A Time Counters/query:", kd_perf, search_queries.size());
+    perf_sample_print("KdTree Interleaved Counters/query:", kd_group_perf, search_queries.size());
+    
+#ifdef VERIFY_RESULTS
+    int failures = 0;
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        if (!verify_results("QuadTree interleaved", points, search_queries[i], qt_results[i]))
+            failures++;
+        if (!verify_results("KdTree interleaved", points, search_queries[i], kd_results[i]))
+            failures++;
+    }
+    std::cout << "Interleaved Verification: " << failures << " failures" << std::endl;
+#endif
+}
+
+// Time id filtered searches against the same queries unfiltered. Selective filters go to the id index postings,
+// broad ones to the trees' summary pushdown, which can only skip subtrees holding no accepted id
+void execute_filtered_searches() {
+    std::vector<Rect> search_queries;
+    generate_queries(NUM_BATCH_QUERIES, search_queries);
+    
+    // A narrow id range and a handful of scattered ids (ids are uniform in [0, ID_DOMAIN))
+    std::vector<IdFilter> filters;
+    std::vector<const char*> names;
+    filters.push_back(id_filter_range(0, 999));
+    names.push_back("Range 0-999");
+    filters.push_back(id_filter_range(5000, 5049));
+    names.push_back("Range 5000-5049");
+    std::vector<short> ids;
+    for (int i = 0; i < 8; i++) ids.push_back(i * 1237 % ID_DOMAIN);
+    filters.push_back(id_filter_set(ids));
+    names.push_back("Set of 8 ids");
+    
+    std::cout << std::endl;
+    std::cout << "=============================================" << std::endl;
+    std::cout << "FILTERED " << search_queries.size() << " queries" << std::endl;
+    std::cout << " " << std::endl;
+    
+    auto start = std::chrono::steady_clock::now();
+    IdIndex* id_index = id_index_build(points);
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "Id Index Creation Time: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms, "
+              << id_index_size(id_index) / 1024 << " KB" << std::endl;
+    
+    int ct = 0;
+    long found = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        ResultQueue results;
+        quadtree_search_ranked(qt, search_queries[i], results, ct);
+        found += results.size();
+    }
+    end = std::chrono::steady_clock::now();
+    std::cout << "QuadTree Unfiltered: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms, "
+              << found / (double)search_queries.size() << " results/query" << std::endl;
+    
+    found = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        ResultQueue results;
+        kdtree_search(kdt, search_queries[i], results, ct);
+        found += results.size();
+    }
+    end = std::chrono::steady_clock::now();
+    std::cout << "KdTree Unfiltered: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms, "
+              << found / (double)search_queries.size() << " results/query" << std::endl;
+    
+    // Filters naming few points are answered from the id index's postings, the rest by the trees' summary pushdown
+    for (size_t f = 0; f < filters.size(); f++) {
+        size_t matching = id_index_count(id_index, filters[f]);
+        std::cout << names[f] << ": " << matching << " matching points, "
+                  << (matching <= ID_INDEX_MAX_SCAN ? "id index postings" : "tree pushdown") << std::endl;
+        
+        found = 0;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < search_queries.size(); i++) {
+            ResultQueue results;
+            if (!id_index_search(id_index, search_queries[i], filters[f], results, ct))
+                quadtree_search_filtered(qt, search_queries[i], filters[f], results, ct);
+            found += results.size();
+        }
+        end = std::chrono::steady_clock::now();
+        std::cout << "QuadTree " << names[f] << ": " << std::chrono::duration <double, std::milli> (end - start).count() << " ms, "
+                  << found / (double)search_queries.size() << " results/query" << std::endl;
+        
+        found = 0;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < search_queries.size(); i++) {
+            ResultQueue results;
+            if (!id_index_search(id_index, search_queries[i], filters[f], results, ct))
+                kdtree_search_filtered(kdt, search_queries[i], filters[f], results, ct);
+            found += results.size();
+        }
+        end = std::chrono::steady_clock::now();
+        std::cout << "KdTree " << names[f] << ": " << std::chrono::duration <double, std::milli> (end - start).count() << " ms, "
+                  << found / (double)search_queries.size() << " results/query" << std::endl;
+    }
+    
+    id_index_delete(id_index);
+}
+
+// Time range counts and density grids from the subtree counts against brute force scans of every point, and report
+// the finest density grid the trees still build faster than a scan
+void execute_count_queries() {
+    std::vector<Rect> search_queries;
+    generate_queries(NUM_BATCH_QUERIES, search_queries);
+    
+    std::cout << std::endl;
+    std::cout << "=============================================" << std::endl;
+    std::cout << "COUNT " << search_queries.size() << " queries" << std::endl;
+    std::cout << " " << std::endl;
+    
+    // Brute force baseline
+    long total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        for (size_t j = 0; j < points.size(); j++) {
+            if (pt_contained(search_queries[i], *points[j]))
+                total++;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "Brute Force: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms, " << total << " points" << std::endl;
+    
+    total = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        total += quadtree_count(qt, search_queries[i]);
+    }
+    end = std::chrono::steady_clock::now();
+    std::cout << "QuadTree: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms, " << total << " points" << std::endl;
+    
+    total = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        total += kdtree_count(kdt, search_queries[i]);
+    }
+    end = std::chrono::steady_clock::now();
+    std::cout << "KdTree: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms, " << total << " points" << std::endl;
+    
+    // Whole range heatmap grids at growing resolutions. The trees only win while a cell holds enough points for
+    // whole nodes to land in it; past that they descend to the leaves and lose to the single brute force pass
+    const Rect range(0, MAX_PT_RANGE, 0, MAX_PT_RANGE);
+    DensityGrid grid;
+    int crossover = 0;
+    for (int w = 16; w <= 256; w *= 2) {
+        start = std::chrono::steady_clock::now();
+        density_grid_init(grid, range, w, w);
+        for (size_t j = 0; j < points.size(); j++) {
+            density_grid_add(grid, *points[j]);
+        }
+        end = std::chrono::steady_clock::now();
+        double brute_ms = std::chrono::duration <double, std::milli> (end - start).count();
+        
+        start = std::chrono::steady_clock::now();
+        quadtree_density_grid(qt, range, w, w, grid);
+        end = std::chrono::steady_clock::now();
+        double quadtree_ms = std::chrono::duration <double, std::milli> (end - start).count();
+        
+        start = std::chrono::steady_clock::now();
+        kdtree_density_grid(kdt, range, w, w, grid);
+        end = std::chrono::steady_clock::now();
+        double kdtree_ms = std::chrono::duration <double, std::milli> (end - start).count();
+        
+        std::cout << w << "x" << w << " Density Grid (" << points.size() / (w * w) << " points/cell): Brute Force "
+                  << brute_ms << " ms, QuadTree " << quadtree_ms << " ms, KdTree " << kdtree_ms << " ms" << std::endl;
+        if (std::min(quadtree_ms, kdtree_ms) < brute_ms)
+            crossover = w;
+    }
+    if (crossover == 0)
+        std::cout << "Density Grid: brute force wins at every resolution with " << points.size() << " points" << std::endl;
+    else
+        std::cout << "Density Grid: trees win up to " << crossover << "x" << crossover << " with " << points.size() << " points" << std::endl;
+}
+
+// Time the point generators, then build both trees over each generated distribution and time a mixed query workload
+void execute_distribution_searches() {
+    const char* names[GEN_NUM_DISTRIBUTIONS] = { "Uniform", "Clustered", "Roads", "Zipf", "Duplicates" };
+    const int gen_points_ct = 1000000;
+    
+    std::cout << std::endl;
+    std::cout << "=============================================" << std::endl;
+    std::cout << "DISTRIBUTIONS " << NUM_BATCH_QUERIES << " mixed queries" << std::endl;
+    std::cout << " " << std::endl;
+    
+    // Generator throughput: the rand() generator against the counter based one
+    std::vector<Point*> legacy;
+    auto start = std::chrono::steady_clock::now();
+    generate_points(gen_points_ct, legacy);
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "generate_points " << gen_points_ct << " Points: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+    for (size_t i = 0; i < legacy.size(); i++) {
+        delete legacy[i];
+    }
+    
+    PointStore store;
+    start = std::chrono::steady_clock::now();
+    gen_points(store, gen_points_ct, GEN_UNIFORM, 1);
+    end = std::chrono::steady_clock::now();
+    std::cout << "gen_points " << gen_points_ct << " Points: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+    
+#ifdef VERIFY_RESULTS
+    // Output must not depend on the thread count
+    PointStore single, several;
+    gen_points(single, gen_points_ct, GEN_ZIPF, 1, 1);
+    gen_points(several, gen_points_ct, GEN_ZIPF, 1, 4);
+    for (int i = 0; i < gen_points_ct; i++) {
+        const Point& a = single.data[i];
+        const Point& b = several.data[i];
+        if (a.id != b.id || a.rank != b.rank || a.x != b.x || a.y != b.y) {
+            std::cout << "GENERATOR DEPENDS ON THREAD COUNT" << std::endl;
+            break;
+        }
+    }
+#endif
+    
+    std::vector<Rect> mix;
+    gen_query_mix(mix, NUM_BATCH_QUERIES, 7);
+    
+    for (int d = 0; d < GEN_NUM_DISTRIBUTIONS; d++) {
+        gen_points(store, NUM_PTS, (GenDistribution)d, 1);
+        
+        QuadTree* dist_qt = quadtree_construct(Rect(0, MAX_PT_RANGE, 0, MAX_PT_RANGE), 0);
+        int ct = 0;
+        quadtree_build(dist_qt, store.ptrs, ct);
+        std::vector<Point*> kd_points(store.ptrs);
+        KdTree* dist_kdt = kdtree_construct(Rect(0, MAX_PT_RANGE, 0, MAX_PT_RANGE), 0);
+        kdtree_insert(dist_kdt, kd_points);
+        
+        long found = 0;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < mix.size(); i++) {
+            ResultQueue results;
+            quadtree_search_ranked(dist_qt, mix[i], results, ct);
+            found += results.size();
+        }
+        end = std::chrono::steady_clock::now();
+        std::cout << names[d] << " QuadTree Ranked: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms, "
+                  << found / (double)mix.size() << " results/query" << std::endl;
+        
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < mix.size(); i++) {
+            ResultQueue results;
+            kdtree_search(dist_kdt, mix[i], results, ct);
+        }
+        end = std::chrono::steady_clock::now();
+        std::cout << names[d] << " KdTree: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+        
+        quadtree_delete(dist_qt);
+        kdtree_delete(dist_kdt);
+    }
+}
+
+// Compare the float KdTree against the integer key index, at 16 and 32 bit keys, on the same queries. Also size
+// both key widths over low cardinality points, the only data 16 bit keys are smaller for
+void execute_key_searches() {
+    std::vector<Rect> search_queries;
+    generate_queries(NUM_BATCH_QUERIES, search_queries);
+    
+    std::cout << std::endl;
+    std::cout << "=============================================" << std::endl;
+    std::cout << "INTEGER KEYS " << search_queries.size() << " queries" << std::endl;
+    std::cout << " " << std::endl;
+    
+    // 16 bit rank keys (the points have a distinct value per coordinate, so these lose) and the default 32 bit keys
+    const int key_widths[] = { 16, 32 };
+    KeyTree* keyts[2];
+    for (int w = 0; w < 2; w++) {
+        auto start = std::chrono::steady_clock::now();
+        keyts[w] = keytree_build(points, key_widths[w]);
+        auto end = std::chrono::steady_clock::now();
+        std::cout << "KeyTree (" << keytree_key_bits(keyts[w]) << " bit keys) Creation Time: "
+                  << std::chrono::duration <double, std::milli> (end - start).count() << " ms, "
+                  << keytree_size(keyts[w]) / 1024 << " KB" << std::endl;
+    }
+    std::cout << "KdTree: " << kdtree_size(kdt) / 1024 << " KB" << std::endl;
+    
+    PointStore sites;
+    gen_points(sites, (int)points.size(), GEN_DUPLICATES, 1);
+    for (int w = 0; w < 2; w++) {
+        KeyTree* keyt = keytree_build(sites.ptrs, key_widths[w]);
+        std::cout << "KeyTree (" << keytree_key_bits(keyt) << " bit keys) over " << GEN_DUPLICATE_SITES << " duplicated sites: "
+                  << keytree_size(keyt) / 1024 << " KB" << std::endl;
+        keytree_delete(keyt);
+    }
+    
+    int ct = 0;
+    PerfSample kd_perf, key_perf[2];
+    perf_counters_start(perf);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        ResultQueue results;
+        kdtree_search(kdt, search_queries[i], results, ct);
+    }
+    auto end = std::chrono::steady_clock::now();
+    perf_counters_stop(perf, kd_perf);
+    std::cout << "KdTree (float): " << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+    
+    for (int w = 0; w < 2; w++) {
+        perf_counters_start(perf);
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < search_queries.size(); i++) {
+            ResultQueue results;
+            keytree_search(keyts[w], search_queries[i], results, ct);
+        }
+        end = std::chrono::steady_clock::now();
+        perf_counters_stop(perf, key_perf[w]);
+        std::cout << "KeyTree (" << keytree_key_bits(keyts[w]) << " bit keys): "
+                  << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+    }
+    perf_sample_print("KdTree Counters/query:", kd_perf, search_queries.size());
+    perf_sample_print("KeyTree (16 bit) Counters/query:", key_perf[0], search_queries.size());
+    perf_sample_print("KeyTree (32 bit) Counters/query:", key_perf[1], search_queries.size());
+    
+#ifdef VERIFY_RESULTS
+    int failures = 0;
+    for (int w = 0; w < 2; w++) {
+        for (size_t i = 0; i < search_queries.size(); i++) {
+            ResultQueue key_results;
+            keytree_search(keyts[w], search_queries[i], key_results, ct);
+            if (!verify_results("KeyTree", points, search_queries[i], key_results))
+                failures++;
+        }
+    }
+    std::cout << "KeyTree Verification: " << failures << " failures" << std::endl;
+#endif
+    
+    keytree_delete(keyts[0]);
+    keytree_delete(keyts[1]);
+}
+
+// Compare the KdTree against the wavelet index (wavelet matrix with per-level RMQ) on time and bytes per point
+void execute_wavelet_searches() {
+    std::vector<Rect> search_queries;
+    generate_queries(NUM_BATCH_QUERIES, search_queries);
+    
+    std::cout << std::endl;
+    std::cout << "=============================================" << std::endl;
+    std::cout << "WAVELET " << search_queries.size() << " queries" << std::endl;
+    std::cout << " " << std::endl;
+    
+    auto start = std::chrono::steady_clock::now();
+    WaveletIndex* wt = wavelet_build(points);
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "Wavelet Creation Time: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms, "
+              << wavelet_size(wt) / 1024 << " KB, " << wavelet_size(wt) / (double)points.size() << " bytes/point" << std::endl;
+    std::cout << "KdTree: " << kdtree_size(kdt) / (double)points.size() << " bytes/point" << std::endl;
+    
+    int ct = 0;
+    PerfSample kd_perf, wavelet_perf;
+    perf_counters_start(perf);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        ResultQueue results;
+        kdtree_search(kdt, search_queries[i], results, ct);
+    }
+    end = std::chrono::steady_clock::now();
+    perf_counters_stop(perf, kd_perf);
+    std::cout << "KdTree: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+    
+    perf_counters_start(perf);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        ResultQueue results;
+        wavelet_search(wt, search_queries[i], results, ct);
+    }
+    end = std::chrono::steady_clock::now();
+    perf_counters_stop(perf, wavelet_perf);
+    std::cout << "Wavelet: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+    perf_sample_print("KdTree Counters/query:", kd_perf, search_queries.size());
+    perf_sample_print("Wavelet Counters/query:", wavelet_perf, search_queries.size());
+    
+#ifdef VERIFY_RESULTS
+    int failures = 0;
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        ResultQueue wavelet_results;
+        wavelet_search(wt, search_queries[i], wavelet_results, ct);
+        if (!verify_results("Wavelet", points, search_queries[i], wavelet_results))
+            failures++;
+    }
+    std::cout << "Wavelet Verification: " << failures << " failures" << std::endl;
+#endif
+    
+    wavelet_delete(wt);
+}
+
+// Compare the binary KdTree against the wide fanout tree, whose nodes test all their children in one SIMD pass
+void execute_wide_searches() {
+    std::vector<Rect> search_queries;
+    generate_queries(NUM_BATCH_QUERIES, search_queries);
+    
+    std::cout << std::endl;
+    std::cout << "=============================================" << std::endl;
+    std::cout << "WIDE FANOUT " << search_queries.size() << " queries" << std::endl;
+    std::cout << " " << std::endl;
+    
+    auto start = std::chrono::steady_clock::now();
+    WideTree* wide = widetree_build(points);
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "WideTree Creation Time: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms, "
+              << widetree_size(wide) / 1024 << " KB, " << wide->node_count << " nodes, " << wide->leaves.size() << " leaves, height "
+              << widetree_height(wide, wide->root) << " (KdTree " << KD_MAX_DEPTH + 1 << ")" << std::endl;
+    
+    int ct = 0;
+    PerfSample kd_perf, wide_perf;
+    perf_counters_start(perf);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        ResultQueue results;
+        kdtree_search(kdt, search_queries[i], results, ct);
+    }
+    end = std::chrono::steady_clock::now();
+    perf_counters_stop(perf, kd_perf);
+    std::cout << "KdTree (fanout 2): " << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+    
+    perf_counters_start(perf);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        ResultQueue results;
+        widetree_search(wide, search_queries[i], results, ct);
+    }
+    end = std::chrono::steady_clock::now();
+    perf_counters_stop(perf, wide_perf);
+    std::cout << "WideTree (fanout " << WIDE_FANOUT << "): " << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+    perf_sample_print("KdTree Counters/query:", kd_perf, search_queries.size());
+    perf_sample_print("WideTree Counters/query:", wide_perf, search_queries.size());
+    
+#ifdef VERIFY_RESULTS
+    int failures = 0;
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        ResultQueue wide_results;
+        widetree_search(wide, search_queries[i], wide_results, ct);
+        if (!verify_results("WideTree", points, search_queries[i], wide_results))
+            failures++;
+    }
+    std::cout << "WideTree Verification: " << failures << " failures" << std::endl;
+#endif
+    
+    widetree_delete(wide);
+}
+
+// Interleave inserts, deletes and rank changes with queries on the updatable index while its compactor runs,
+// against the same queries on the static KdTree
+void execute_update_searches() {
+    std::vector<Rect> search_queries;
+    generate_queries(NUM_BATCH_QUERIES, search_queries);
+    
+    std::cout << std::endl;
+    std::cout << "=============================================" << std::endl;
+    std::cout << "UPDATES " << search_queries.size() << " queries, one update each" << std::endl;
+    std::cout << " " << std::endl;
+    
+    auto start = std::chrono::steady_clock::now();
+    DeltaIndex* index = delta_index_create(points, true);
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "Delta Index Creation Time: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+    
+    int ct = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        ResultQueue results;
+        kdtree_search(kdt, search_queries[i], results, ct);
+    }
+    end = std::chrono::steady_clock::now();
+    std::cout << "KdTree (static): " << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+    
+    // Updates hit random live points; new ranks count down from -1 so updated points show up in the results
+    std::vector<Point*> live(points);
+    int next_rank = -1;
+    std::chrono::steady_clock::duration update_time(0), search_time(0);
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        size_t j = rand() % live.size();
+        auto t0 = std::chrono::steady_clock::now();
+        if (i % 3 == 0) {
+            delta_remove(index, live[j]);
+        }
+        else if (i % 3 == 1) {
+            live[j] = delta_update_rank(index, live[j], next_rank--);
+        }
+        else {
+            Point p;
+            p.id = rand() % 10000;
+            p.rank = next_rank--;
+            p.x = rand() % MAX_PT_RANGE;
+            p.y = rand() % MAX_PT_RANGE;
+            live.push_back(delta_insert(index, p));
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        if (i % 3 == 0) {
+            live[j] = live.back();
+            live.pop_back();
+        }
+        
+        ResultQueue results;
+        delta_search(index, search_queries[i], results, ct);
+        update_time += t1 - t0;
+        search_time += std::chrono::steady_clock::now() - t1;
+    }
+    std::cout << "Delta Index: " << std::chrono::duration <double, std::milli> (search_time).count() << " ms searching, "
+              << std::chrono::duration <double, std::micro> (update_time).count() / search_queries.size() << " us/update, "
+              << index->compactions << " compactions (" << std::chrono::duration <double, std::milli> (index->compact_time).count()
+              << " ms, on the compactor thread)" << std::endl;
+    
+#ifdef VERIFY_RESULTS
+    int failures = 0;
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        ResultQueue delta_results;
+        delta_search(index, search_queries[i], delta_results, ct);
+        if (!verify_results("Delta", live, search_queries[i], delta_results))
+            failures++;
+    }
+    std::cout << "Delta Index Verification: " << failures << " failures" << std::endl;
+#endif
+    
+    delta_index_delete(index);
+}
+
+// Put rand() where main's setup_data leaves it before generating points: main's seed (its 1000000000000 literal
+// truncated to unsigned int), then the one query setup_data generates first. The points then match main's
+void seed_like_setup_data() {
+    srand (3567587328u);
+    std::vector<Rect> skipped;
+    generate_queries(1, skipped);
+}
+
+// Build the KdTree once and serve queries for it on a Unix domain socket until interrupted
+int serve_index(const char* path, int num_points) {
+    seed_like_setup_data();
+    generate_points(num_points, points);
+    
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Point*> kd_points(points);
+    kdt = kdtree_construct(Rect(0, MAX_PT_RANGE, 0, MAX_PT_RANGE), 0);
+    kdtree_insert(kdt, kd_points);
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "KdTree Creation Time: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+    
+    QueryServer server;
+    if (!server_start(&server, path, kdt, 0))
+        return 1;
+    
+    std::cout << "Serving " << points.size() << " points on " << path << " with " << server.workers.size() << " workers" << std::endl;
+    server_run(&server);
+    server_shutdown(&server, path);
+    
+    kdtree_delete(kdt);
+    for (size_t i = 0; i < points.size(); i++) {
+        delete points[i];
+    }
+    points.clear();
+    return 0;
+}
+
+// Partition the points into shard processes and run the batch queries through a scatter-gather coordinator,
+// checking every merged result against a single KdTree over all of the points
+int shard_index(const char* base_path, int num_shards, int num_points, ShardPartition partition) {
+    seed_like_setup_data();
+    generate_points(num_points, points);
+    
+    std::vector<Rect> search_queries;
+    generate_queries(NUM_BATCH_QUERIES, search_queries);
+    
+    ShardCluster cluster;
+    std::vector<std::vector<Point*> > shard_points;
+    auto start = std::chrono::steady_clock::now();
+    shard_partition(points, num_shards, partition, cluster, shard_points);
+    if (!shard_spawn(cluster, base_path, shard_points))
+        return 1;
+    auto end = std::chrono::steady_clock::now();
+    std::cout << num_shards << (partition == SHARD_RANK ? " rank range" : " spatial") << " shards started in "
+              << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+    
+    ShardClient client;
+    if (!shard_connect(cluster, client)) {
+        std::cout << "Couldn't connect to every shard" << std::endl;
+        shard_stop(cluster);
+        return 1;
+    }
+    
+    long contacted = 0;
+    std::vector<std::vector<QueryResponsePoint> > results(search_queries.size());
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        int ct = shard_search(cluster, client, search_queries[i], results[i]);
+        if (ct < 0) {
+            std::cout << "Shard connection failed" << std::endl;
+            break;
+        }
+        contacted += ct;
+    }
+    end = std::chrono::steady_clock::now();
+    std::cout << "Scatter-Gather: " << std::chrono::duration <double, std::milli> (end - start).count() << " ms, "
+              << contacted / (double)search_queries.size() << " shards/query" << std::endl;
+    
+    shard_disconnect(client);
+    shard_stop(cluster);
+    
+    // Not behind VERIFY_RESULTS: this mode exists to check the coordinator, and the check runs after the timing
+    std::vector<Point*> kd_points(points);
+    kdt = kdtree_construct(Rect(0, MAX_PT_RANGE, 0, MAX_PT_RANGE), 0);
+    kdtree_insert(kdt, kd_points);
+    
+    int failures = 0;
+    for (size_t i = 0; i < search_queries.size(); i++) {
+        ResultQueue expected;
+        int ct = 0;
+        kdtree_search(kdt, search_queries[i], expected, ct);
+        
+        bool match = expected.size() == results[i].size();
+        for (int r = (int)results[i].size() - 1; match && r >= 0; r--) {
+            match = expected.top()->rank == results[i][r].rank;
+            expected.pop();
+        }
+        if (!match) failures++;
+    }
+    std::cout << "Scatter-Gather Verification: " << failures << " failures" << std::endl;
+    kdtree_delete(kdt);
+    
+    for (size_t i = 0; i < points.size(); i++) {
+        delete points[i];
+    }
+    points.clear();
+    return 0;
+}